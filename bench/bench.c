@@ -0,0 +1,635 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+/*
+ * Times creating, applying and joining patches for a fixed set of generated
+ * workloads, and writes the results as tab-separated lines that can be
+ * compared between builds:
+ *
+ *	pcips-bench [-r repeats] [-b baseline] [output]
+ *
+ * Every file is generated from a fixed seed, so each run measures the same
+ * work. The best of the repeated runs is reported for each operation.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "apply.h"
+#include "common.h"
+#include "create.h"
+#include "err.h"
+#include "format.h"
+#include "join.h"
+#include "reader.h"
+
+#define DEFAULT_OUTPUT "bench_output.txt"
+#define DEFAULT_REPEATS 3
+#define JOIN_INPUTS 4
+#define DIR_SIZE 1024
+#define PATH_SIZE (DIR_SIZE + 16)
+#define MAX_BASELINE 256
+
+enum diff_kind
+{
+	DIFF_SPARSE,
+	DIFF_DENSE,
+	DIFF_RLE,
+	DIFF_LARGE
+};
+
+struct workload
+{
+	const char *name;
+	long size;
+	enum diff_kind kind;
+};
+
+/* files over 16MB are patched with IPS32 */
+static const struct workload workloads[] = {
+	{ "64k-sparse", 65536L, DIFF_SPARSE },
+	{ "64k-dense", 65536L, DIFF_DENSE },
+	{ "64k-rle", 65536L, DIFF_RLE },
+	{ "64k-large", 65536L, DIFF_LARGE },
+	{ "1m-sparse", 1048576L, DIFF_SPARSE },
+	{ "1m-dense", 1048576L, DIFF_DENSE },
+	{ "1m-rle", 1048576L, DIFF_RLE },
+	{ "1m-large", 1048576L, DIFF_LARGE },
+	{ "16m-sparse", 16777215L, DIFF_SPARSE },
+	{ "16m-dense", 16777215L, DIFF_DENSE },
+	{ "16m-rle", 16777215L, DIFF_RLE },
+	{ "16m-large", 16777215L, DIFF_LARGE },
+	{ "32m-sparse", 33554432L, DIFF_SPARSE },
+	{ "32m-dense", 33554432L, DIFF_DENSE }
+};
+
+struct baseline
+{
+	char name[64];
+	char op[16];
+	double mb_per_s;
+};
+
+static struct baseline baselines[MAX_BASELINE];
+static int n_baselines = 0;
+
+static unsigned long rng_state;
+
+static unsigned long
+rng(void)
+{
+	rng_state ^= (rng_state << 13) & 0xFFFFFFFFUL;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= (rng_state << 5) & 0xFFFFFFFFUL;
+	return rng_state;
+}
+
+/* Returns a number from lo to hi inclusive. */
+static long
+rng_range(long lo, long hi)
+{
+	return lo + (long) (rng() % (unsigned long) (hi - lo + 1));
+}
+
+static void
+fill_random(unsigned char *p, long n)
+{
+	long i;
+
+	for (i = 0; i < n; ++i)
+		p[i] = rng() & 0xFF;
+}
+
+/*
+ * Generates the source and modified files of a workload. The source is
+ * random data with zero-filled padding blocks, like a typical ROM, and the
+ * modifications depend on the kind of workload:
+ *
+ *	sparse	a few bytes changed every 64KB or so
+ *	dense	a few bytes changed every few dozen bytes
+ *	rle	runs of repeated bytes written every 16KB or so
+ *	large	a few large blocks replaced
+ */
+static void
+generate(const struct workload *w, unsigned char *src, unsigned char *mod)
+{
+	long pos, n;
+	int i;
+
+	fill_random(src, w->size);
+	for (pos = 0; pos < w->size; pos += n)
+	{
+		n = w->size - pos < 4096 ? w->size - pos : 4096;
+		if (0 == rng() % 8)
+			memset(src + pos, 0, n);
+	}
+
+	memcpy(mod, src, w->size);
+	switch (w->kind)
+	{
+	case DIFF_SPARSE:
+		for (pos = rng_range(0, 65535); pos < w->size;
+			pos += rng_range(32768, 98304))
+		{
+			n = rng_range(1, 16);
+			if (pos + n > w->size)
+				n = w->size - pos;
+
+			fill_random(mod + pos, n);
+		}
+		break;
+
+	case DIFF_DENSE:
+		for (pos = rng_range(0, 63); pos < w->size;
+			pos += rng_range(16, 64))
+		{
+			n = rng_range(1, 8);
+			if (pos + n > w->size)
+				n = w->size - pos;
+
+			fill_random(mod + pos, n);
+		}
+		break;
+
+	case DIFF_RLE:
+		for (pos = rng_range(0, 16383); pos < w->size;
+			pos += n + rng_range(8192, 24576))
+		{
+			n = rng_range(256, 8192);
+			if (pos + n > w->size)
+				n = w->size - pos;
+
+			memset(mod + pos, rng() & 0xFF, n);
+		}
+		break;
+
+	case DIFF_LARGE:
+		for (i = 0; i < 8; ++i)
+		{
+			n = w->size / 64;
+			pos = rng_range(0, w->size - n);
+			fill_random(mod + pos, n);
+		}
+		break;
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+write_file(const char *path, const unsigned char *data, long n)
+{
+	int rc = 0;
+	FILE *f;
+
+	f = fopen(path, "wb");
+	if (!f)
+		return PCIPS_EIO;
+
+	if (fwrite(data, 1, n, f) != (size_t) n)
+		rc = PCIPS_EIO;
+
+	if (fclose(f) == EOF)
+		rc = PCIPS_EIO;
+
+	return rc;
+}
+
+static int
+same_contents(const char *path, const unsigned char *data, long n)
+{
+	int same;
+	unsigned char *buf;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return 0;
+
+	buf = malloc(n + 1);
+	same = buf && fread(buf, 1, n + 1, f) == (size_t) n
+		&& memcmp(buf, data, n) == 0;
+
+	free(buf);
+	fclose(f);
+	return same;
+}
+
+static int
+count_records(const char *path, long *n)
+{
+	int rc;
+	struct pcips_reader r;
+	struct pcips_record rec;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return PCIPS_EIO;
+
+	rc = pcips_reader_open(&r, f);
+	if (!rc)
+	{
+		*n = 0;
+		while ((rc = pcips_reader_next(&r, &rec)) > 0)
+			++*n;
+
+		if (rc < 0)
+			rc = r.error;
+
+		pcips_reader_close(&r);
+	}
+
+	fclose(f);
+	return rc;
+}
+
+static int
+time_create(const char *src_path, const char *mod_path, const char *patch_path,
+	long length, const struct pcips_create_options *opts, double *seconds)
+{
+	int rc;
+	double start;
+	FILE *src, *mod, *patch;
+
+	src = fopen(src_path, "rb");
+	mod = fopen(mod_path, "rb");
+	patch = fopen(patch_path, "wb");
+	if (!src || !mod || !patch)
+	{
+		rc = PCIPS_EIO;
+		goto end;
+	}
+
+	start = now();
+	rc = pcips_create_patch(src, mod, patch, length, opts);
+	if (fflush(patch) == EOF && !rc)
+		rc = PCIPS_EIO;
+
+	*seconds = now() - start;
+
+end:
+	if (src)
+		fclose(src);
+
+	if (mod)
+		fclose(mod);
+
+	if (patch)
+		fclose(patch);
+
+	return rc;
+}
+
+static int
+time_apply(const char *src_path, const char *patch_path, const char *out_path,
+	double *seconds)
+{
+	int rc;
+	double start;
+	FILE *src, *patch, *out;
+
+	src = fopen(src_path, "rb");
+	patch = fopen(patch_path, "rb");
+	out = fopen(out_path, "wb+");
+	if (!src || !patch || !out)
+	{
+		rc = PCIPS_EIO;
+		goto end;
+	}
+
+	start = now();
+	rc = pcips_apply_patch(src, out, patch);
+	if (fflush(out) == EOF && !rc)
+		rc = PCIPS_EIO;
+
+	*seconds = now() - start;
+
+end:
+	if (src)
+		fclose(src);
+
+	if (patch)
+		fclose(patch);
+
+	if (out)
+		fclose(out);
+
+	return rc;
+}
+
+static int
+time_join(const char *patch_path, const char *out_path, double *seconds)
+{
+	int rc, i;
+	double start;
+	const char *inputs[JOIN_INPUTS];
+	FILE *out;
+
+	for (i = 0; i < JOIN_INPUTS; ++i)
+		inputs[i] = patch_path;
+
+	out = fopen(out_path, "wb");
+	if (!out)
+		return PCIPS_EIO;
+
+	start = now();
+	rc = pcips_join_patches(out, inputs, JOIN_INPUTS, NULL);
+	if (fflush(out) == EOF && !rc)
+		rc = PCIPS_EIO;
+
+	*seconds = now() - start;
+
+	fclose(out);
+	return rc;
+}
+
+static long
+file_size(const char *path)
+{
+	long size = -1;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (f)
+	{
+		if (fseek(f, 0L, SEEK_END) == 0)
+			size = ftell(f);
+
+		fclose(f);
+	}
+
+	return size;
+}
+
+static void
+load_baseline(const char *path)
+{
+	char line[256];
+	struct baseline *b;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", path,
+			strerror(errno));
+		return;
+	}
+
+	while (n_baselines < MAX_BASELINE && fgets(line, sizeof line, f))
+	{
+		b = &baselines[n_baselines];
+		if ('#' != line[0] && sscanf(line, "%63s %15s %*d %*d %*f %lf",
+				b->name, b->op, &b->mb_per_s) == 3)
+			++n_baselines;
+	}
+
+	fclose(f);
+}
+
+static const struct baseline *
+find_baseline(const char *name, const char *op)
+{
+	int i;
+
+	for (i = 0; i < n_baselines; ++i)
+	{
+		if (strcmp(baselines[i].name, name) == 0
+			&& strcmp(baselines[i].op, op) == 0)
+			return &baselines[i];
+	}
+
+	return NULL;
+}
+
+static void
+report(FILE *out, const char *name, const char *op, long bytes, long records,
+	double seconds)
+{
+	double mb_per_s, records_per_s;
+	const struct baseline *b;
+
+	if (seconds < 1e-9)
+		seconds = 1e-9;
+
+	mb_per_s = bytes / seconds / 1048576.0;
+	records_per_s = records / seconds;
+
+	fprintf(out, "%s\t%s\t%ld\t%ld\t%.6f\t%.2f\t%.0f\n", name, op, bytes,
+		records, seconds, mb_per_s, records_per_s);
+
+	printf("%-12s %-7s %10.2f MB/s %14.0f records/s", name, op, mb_per_s,
+		records_per_s);
+
+	b = find_baseline(name, op);
+	if (b && b->mb_per_s > 0)
+		printf(" %+7.1f%%", (mb_per_s / b->mb_per_s - 1) * 100);
+
+	putchar('\n');
+}
+
+/*
+ * Runs one workload and reports create and apply throughput over the size of
+ * the modified file, and join throughput over the size of its inputs.
+ */
+static int
+run_workload(const struct workload *w, const char *dir, int repeats,
+	FILE *out)
+{
+	int rc = 0, i;
+	long records = 0, patch_size;
+	double t = 0, create = 0, apply = 0, join = 0;
+	char src_path[PATH_SIZE], mod_path[PATH_SIZE], patch_path[PATH_SIZE];
+	char out_path[PATH_SIZE];
+	unsigned char *src, *mod;
+	struct pcips_create_options opts;
+
+	opts.threads = 1;
+	opts.optimal = 0;
+	opts.format = w->size > IPS_MAX_OFFSET ? &pcips_ips32 : &pcips_ips;
+	opts.bps = 0;
+	opts.index = NULL;
+	opts.stats = NULL;
+
+	sprintf(src_path, "%s/src", dir);
+	sprintf(mod_path, "%s/mod", dir);
+	sprintf(patch_path, "%s/patch", dir);
+	sprintf(out_path, "%s/out", dir);
+
+	src = malloc(w->size);
+	mod = malloc(w->size);
+	if (!src || !mod)
+	{
+		rc = PCIPS_ENOMEM;
+		goto end;
+	}
+
+	rng_state = 2463534242UL + (w - workloads);
+	generate(w, src, mod);
+
+	rc = write_file(src_path, src, w->size);
+	if (!rc)
+		rc = write_file(mod_path, mod, w->size);
+
+	for (i = 0; !rc && i < repeats; ++i)
+	{
+		rc = time_create(src_path, mod_path, patch_path, w->size,
+			&opts, &t);
+		if (0 == i || t < create)
+			create = t;
+	}
+
+	if (!rc)
+		rc = count_records(patch_path, &records);
+
+	for (i = 0; !rc && i < repeats; ++i)
+	{
+		rc = time_apply(src_path, patch_path, out_path, &t);
+		if (0 == i || t < apply)
+			apply = t;
+	}
+
+	if (!rc && !same_contents(out_path, mod, w->size))
+	{
+		fprintf(stderr, "%s: applied patch does not match\n", w->name);
+		rc = PCIPS_EFILE;
+	}
+
+	for (i = 0; !rc && i < repeats; ++i)
+	{
+		rc = time_join(patch_path, out_path, &t);
+		if (0 == i || t < join)
+			join = t;
+	}
+
+	if (rc)
+	{
+		fprintf(stderr, "%s: %s\n", w->name, pcips_strerror(rc));
+		goto end;
+	}
+
+	patch_size = file_size(patch_path);
+	report(out, w->name, "create", w->size, records, create);
+	report(out, w->name, "apply", w->size, records, apply);
+	report(out, w->name, "join", JOIN_INPUTS * patch_size,
+		JOIN_INPUTS * records, join);
+
+end:
+	remove(src_path);
+	remove(mod_path);
+	remove(patch_path);
+	remove(out_path);
+	free(mod);
+	free(src);
+	return rc;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int rc = 0, c, repeats = DEFAULT_REPEATS;
+	size_t i;
+	const char *out_path, *tmp;
+	char dir[DIR_SIZE], *end;
+	FILE *out;
+
+	opterr = 0;
+	while ((c = getopt(argc, argv, "b:r:")) != -1)
+	{
+		switch (c)
+		{
+		case 'b':
+			load_baseline(optarg);
+			break;
+
+		case 'r':
+			repeats = strtol(optarg, &end, 10);
+			if (*end != '\0' || repeats < 1)
+			{
+				fprintf(stderr, "Invalid repeat count: %s\n",
+					optarg);
+				return PCIPS_EARGS;
+			}
+			break;
+
+		default:
+			fprintf(stderr, "Usage: %s [-r repeats] [-b baseline] "
+				"[output]\n", argv[0]);
+			return PCIPS_EARGS;
+		}
+	}
+
+	out_path = optind < argc ? argv[optind] : DEFAULT_OUTPUT;
+	out = fopen(out_path, "w");
+	if (!out)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", out_path,
+			strerror(errno));
+		return PCIPS_EARGS;
+	}
+
+	tmp = getenv("TMPDIR");
+	if (!tmp || strlen(tmp) > DIR_SIZE - 32)
+		tmp = "/tmp";
+
+	sprintf(dir, "%s/pcips-bench.XXXXXX", tmp);
+	if (!mkdtemp(dir))
+	{
+		fprintf(stderr, "Error creating %s: %s\n", dir,
+			strerror(errno));
+		fclose(out);
+		return PCIPS_EIO;
+	}
+
+	fprintf(out, "# workload\toperation\tbytes\trecords\tseconds\t"
+		"mb_per_s\trecords_per_s\n");
+
+	for (i = 0; !rc && i < sizeof workloads / sizeof workloads[0]; ++i)
+		rc = run_workload(&workloads[i], dir, repeats, out);
+
+	rmdir(dir);
+	if (fclose(out) == EOF && !rc)
+		rc = PCIPS_EIO;
+
+	return rc;
+}
@@ -29,120 +29,764 @@
  *  THE USE OF OR OTHER DEALINGS IN THE WORK.
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "apply.h"
+#include "bps.h"
 #include "common.h"
+#include "copy.h"
+#include "crc32.h"
 #include "err.h"
+#include "map.h"
+#include "patch.h"
+#include "plan.h"
+#include "sink.h"
+#include "stats.h"
 
-static long
-unbuffer(const unsigned char *buf, int nmemb)
+#define STREAM_BUFFER_SIZE 65536
+
+/*
+ * Zeroes n bytes of the mapped output at offset. Anything at or beyond the
+ * original length was added by ftruncate() and is already a hole, so it is
+ * left untouched, and long runs inside the original data are punched out of
+ * the file rather than written where the filesystem allows it.
+ */
+static void
+zero_mapped(unsigned char *dest, int fd, long offset, long n, long length,
+	struct pcips_stats *stats)
+{
+	if (offset >= length)
+		return;
+
+	if (offset + n > length)
+		n = length - offset;
+
+	if (n >= PCIPS_PUNCH_MIN_SIZE
+		&& pcips_punch_hole(fd, offset, n, stats) == 0)
+		return;
+
+	memset(dest + offset, 0, n);
+}
+
+/*
+ * Applies a patch by mapping the output file and writing each record directly
+ * into memory. When patching out of place, the source is first duplicated
+ * with pcips_copy_file() so that only the pages touched by records pass
+ * through user space. Returns -1 if the output could not be mapped, in which
+ * case the caller should fall back to stdio.
+ */
+static int
+apply_mapped(const struct pcips_patch *patch, FILE *src_file, FILE *dest_file,
+	struct pcips_stats *stats)
 {
-	long value = 0;
-	int i;
+	int rc, dest_fd;
+	long i, n, length, new_length;
+	const struct pcips_extent *e, *next;
+	struct pcips_timer timer;
+	struct stat st;
+	unsigned char *dest;
+
+	if (fflush(dest_file) == EOF)
+		return PCIPS_EIO;
+
+	dest_fd = fileno(dest_file);
+	if (fstat(fileno(src_file), &st) != 0)
+		return PCIPS_EIO;
+
+	length = st.st_size;
+	new_length = patch->writes.end > length ? patch->writes.end : length;
+
+	if (src_file != dest_file)
+	{
+		pcips_stats_begin(stats, &timer);
+		rc = pcips_copy_file(fileno(src_file), dest_fd, length, stats);
+		pcips_stats_end(stats, &timer, PCIPS_PHASE_COPY);
+		if (rc)
+			return rc;
+	}
+
+	pcips_stats_begin(stats, &timer);
+	if (new_length > length && ftruncate(dest_fd, new_length) != 0)
+		return PCIPS_EIO;
+
+	if (0 == new_length)
+		return 0;
 
-	for (i = 0; i < nmemb; ++i)
+	dest = mmap(NULL, new_length, PROT_READ | PROT_WRITE, MAP_SHARED,
+		dest_fd, 0);
+	if (MAP_FAILED == dest)
+		return -1;
+
+	for (i = 0; i < patch->writes.count; ++i)
 	{
-		value <<= 8;
-		value |= buf[i];
+		e = &patch->writes.extents[i];
+		if (e->data)
+		{
+			memcpy(dest + e->offset, e->data, e->length);
+		}
+		else if (e->value != 0)
+		{
+			memset(dest + e->offset, e->value, e->length);
+		}
+		else
+		{
+			/* clear adjacent runs of zeros together */
+			n = e->length;
+			for (next = e + 1; i + 1 < patch->writes.count
+				&& !next->data && 0 == next->value
+				&& next->offset == e->offset + n; ++next, ++i)
+			{
+				n += next->length;
+			}
+
+			zero_mapped(dest, dest_fd, e->offset, n, length,
+				stats);
+		}
 	}
 
-	return value;
+	rc = munmap(dest, new_length) != 0 ? PCIPS_EIO : 0;
+	pcips_stats_end(stats, &timer, PCIPS_PHASE_WRITE);
+	return rc;
 }
 
-int
-pcips_apply_patch(FILE *src_file, FILE *dest_file, FILE *patch)
+/*
+ * Applies a patch with pcips_plan_write(), which orders and batches the
+ * extents into as few system calls as it can. This is used to patch regular
+ * files in place, and for any regular output when io_uring is requested. When
+ * patching out of place, the source is first duplicated with
+ * pcips_copy_file(). The output is extended before anything is written.
+ */
+static int
+apply_planned(const struct pcips_patch *patch, FILE *src_file,
+	FILE *dest_file, const struct pcips_apply_options *opts)
 {
-	int c;
-	long offset, length, pos;
-	unsigned int size;
-	unsigned char buf[HEADER_SIZE];
+	int rc, fd;
+	long length;
+	struct pcips_stats *stats = opts ? opts->stats : NULL;
+	struct pcips_timer timer;
+	struct stat st;
+
+	if (fflush(dest_file) == EOF)
+		return PCIPS_EIO;
+
+	fd = fileno(dest_file);
+	if (fstat(fileno(src_file), &st) != 0)
+		return PCIPS_EIO;
 
+	length = st.st_size;
 	if (src_file != dest_file)
 	{
-		rewind(src_file);
-		rewind(dest_file);
+		pcips_stats_begin(stats, &timer);
+		rc = pcips_copy_file(fileno(src_file), fd, length, stats);
+		pcips_stats_end(stats, &timer, PCIPS_PHASE_COPY);
+		if (rc)
+			return rc;
+	}
+
+	pcips_stats_begin(stats, &timer);
+	if (patch->writes.end > length
+		&& ftruncate(fd, patch->writes.end) != 0)
+		rc = PCIPS_EIO;
+	else
+		rc = pcips_plan_write(fd, &patch->writes, length, opts);
+
+	pcips_stats_end(stats, &timer, PCIPS_PHASE_WRITE);
+	return rc;
+}
+
+/*
+ * Pads the stream, currently length bytes long, with zeros up to n bytes.
+ * The file is extended with ftruncate() where possible so that the padding
+ * becomes a hole instead of being written out.
+ */
+static int
+extend_stdio(FILE *f, long length, long n)
+{
+	if (fflush(f) != EOF && ftruncate(fileno(f), n) == 0)
+		return 0;
+
+	fseek(f, 0L, SEEK_END);
+	while (length < n)
+	{
+		if (fputc(0x00, f) == EOF)
+			return PCIPS_EIO;
+
+		++length;
+	}
+
+	return 0;
+}
+
+/* Writes n bytes to dest, adding them to the output checksum if wanted. */
+static int
+stream_write(FILE *dest, const unsigned char *data, size_t n,
+	struct pcips_checksums *sums)
+{
+	if (fwrite(data, 1, n, dest) != n)
+		return PCIPS_EIO;
+
+	if (sums)
+		sums->out = pcips_crc32(sums->out, data, n);
+
+	return 0;
+}
+
+/*
+ * Copies n bytes from src to dest, or discards them if dest is NULL. Once the
+ * source runs out, the rest is filled with zeros, as when a patch writes past
+ * the end of a file.
+ */
+static int
+stream_copy(FILE *src, FILE *dest, unsigned char *buf, long n,
+	struct pcips_checksums *sums)
+{
+	size_t chunk, got;
 
-		while ((c = fgetc(src_file)) != EOF)
+	while (n > 0)
+	{
+		chunk = n < STREAM_BUFFER_SIZE ? n : STREAM_BUFFER_SIZE;
+		got = fread(buf, 1, chunk, src);
+		if (got < chunk)
 		{
-			c = fputc(c, dest_file);
-			if (EOF == c)
+			if (ferror(src))
 				return PCIPS_EIO;
+
+			memset(buf + got, 0, chunk - got);
 		}
 
-		if (!feof(src_file))
+		if (sums)
+			sums->src = pcips_crc32(sums->src, buf, got);
+
+		if (dest && stream_write(dest, buf, chunk, sums) != 0)
 			return PCIPS_EIO;
 
+		n -= chunk;
 	}
-	else
+
+	return 0;
+}
+
+static int
+stream_run(FILE *dest, unsigned char *buf, int value, long n,
+	struct pcips_checksums *sums)
+{
+	size_t chunk;
+
+	memset(buf, value, n < STREAM_BUFFER_SIZE ? n : STREAM_BUFFER_SIZE);
+	while (n > 0)
 	{
-		fseek(src_file, 0L, SEEK_END);
+		chunk = n < STREAM_BUFFER_SIZE ? n : STREAM_BUFFER_SIZE;
+		if (stream_write(dest, buf, chunk, sums) != 0)
+			return PCIPS_EIO;
+
+		n -= chunk;
 	}
 
-	length = ftell(src_file);
+	return 0;
+}
+
+/*
+ * Applies a patch in a single pass over the source, so that neither stream
+ * has to be seekable and either may be a pipe. The extents are sorted by
+ * offset whatever order the records were in, so each one is written when the
+ * copy reaches it and the source bytes it replaces are skipped. Memory use
+ * does not depend on the size of the source. If sums is not NULL, the
+ * checksums of both streams are computed along the way.
+ */
+static int
+apply_stream(const struct pcips_patch *patch, FILE *src_file,
+	FILE *dest_file, struct pcips_checksums *sums)
+{
+	int rc = 0;
+	long i, pos = 0;
+	size_t n;
+	const struct pcips_extent *e;
+	unsigned char *buf;
+
+	buf = malloc(STREAM_BUFFER_SIZE);
+	if (!buf)
+		return PCIPS_ENOMEM;
+
+	/* a seekable source may have been read already */
+	if (pcips_file_is_regular(src_file))
+		rewind(src_file);
+
+	for (i = 0; !rc && i < patch->writes.count; ++i)
+	{
+		e = &patch->writes.extents[i];
 
-	clearerr(src_file);
-	rewind(patch);
+		rc = stream_copy(src_file, dest_file, buf, e->offset - pos,
+			sums);
+		if (rc)
+			break;
 
-	size = fread(buf, 1, HEADER_SIZE, patch);
-	if (size != HEADER_SIZE || memcmp(buf, IPS_HEADER, HEADER_SIZE) != 0)
-		return PCIPS_EFILE;
+		if (e->data)
+			rc = stream_write(dest_file, e->data, e->length, sums);
+		else
+			rc = stream_run(dest_file, buf, e->value, e->length,
+				sums);
+
+		if (!rc)
+			rc = stream_copy(src_file, NULL, buf, e->length, sums);
+
+		pos = e->offset + e->length;
+	}
 
-	while ((size = fread(buf, 1, HEADER_SIZE, patch)) == HEADER_SIZE)
+	/* the rest of the source, then any padding to the end of the patch */
+	while (!rc && (n = fread(buf, 1, STREAM_BUFFER_SIZE, src_file)) > 0)
 	{
-		offset = unbuffer(buf, IPS_OFFSET_SIZE);
-		size = unbuffer(&buf[IPS_OFFSET_SIZE], IPS_SIZE_SIZE);
+		if (sums)
+			sums->src = pcips_crc32(sums->src, buf, n);
+
+		rc = stream_write(dest_file, buf, n, sums);
+		pos += n;
+	}
+
+	if (!rc && ferror(src_file))
+		rc = PCIPS_EIO;
+
+	if (!rc && patch->writes.end > pos)
+		rc = stream_run(dest_file, buf, 0, patch->writes.end - pos,
+			sums);
 
-		if (offset > length)
+	if (!rc && fflush(dest_file) == EOF)
+		rc = PCIPS_EIO;
+
+	free(buf);
+	return rc;
+}
+
+/* Applies a patch in place to a stream that is not a regular file. */
+static int
+apply_stdio(const struct pcips_patch *patch, FILE *dest_file)
+{
+	long i, j, n, length;
+	const struct pcips_extent *e;
+
+	fseek(dest_file, 0L, SEEK_END);
+	length = ftell(dest_file);
+
+	clearerr(dest_file);
+
+	/* one extra pass pads the output out to the end of the patch */
+	for (i = 0; i <= patch->writes.count; ++i)
+	{
+		n = i < patch->writes.count
+			? patch->writes.extents[i].offset : patch->writes.end;
+
+		if (n > length)
 		{
-			fseek(dest_file, 0L, SEEK_END);
-			while (length++ < offset)
-			{
-				c = fputc(0x00, dest_file);
-				if (EOF == c)
-					return PCIPS_EIO;
-			}
+			if (extend_stdio(dest_file, length, n) != 0)
+				return PCIPS_EIO;
+
+			length = n;
 		}
 
-		fseek(dest_file, offset, SEEK_SET);
-		if (0 == size) /* RLE record */
-		{
-			size = fread(buf, 1, IPS_SIZE_SIZE, patch);
-			if (size != IPS_SIZE_SIZE)
-				return PCIPS_EFILE;
+		if (i == patch->writes.count)
+			break;
 
-			size = unbuffer(buf, IPS_SIZE_SIZE);
-			c = fgetc(patch);
-			if (EOF == c)
+		e = &patch->writes.extents[i];
+		fseek(dest_file, e->offset, SEEK_SET);
+		if (e->data)
+		{
+			n = fwrite(e->data, 1, e->length, dest_file);
+			if (n != e->length)
 				return PCIPS_EIO;
+		}
+		else
+		{
+			/* zeros past the end are left to the next extension */
+			n = e->length;
+			if (0 == e->value && e->offset + n > length)
+				n = length - e->offset;
 
-			while (size--)
+			for (j = 0; j < n; ++j)
 			{
-				if (fputc(c, dest_file) == EOF)
+				if (fputc(e->value, dest_file) == EOF)
 					return PCIPS_EIO;
 			}
 		}
+
+		if (e->offset + n > length)
+			length = e->offset + n;
+	}
+
+	return 0;
+}
+
+/*
+ * Adds the output bytes in [from, to) that come from the source to crc. The
+ * source is padded with zeros past its end.
+ */
+static unsigned long
+crc_source(unsigned long crc, const unsigned char *src, long length, long from,
+	long to)
+{
+	long n;
+
+	if (from < length)
+	{
+		n = (to < length ? to : length) - from;
+		crc = pcips_crc32(crc, src + from, n);
+		from += n;
+	}
+
+	if (to > from)
+		crc = pcips_crc32_run(crc, 0, to - from);
+
+	return crc;
+}
+
+/*
+ * Computes the checksums of a source and of the result of applying the patch
+ * to it, from the source and the patch alone, so that they can be verified
+ * before anything is written.
+ */
+static void
+checksum_buffer(const struct pcips_patch *patch, const unsigned char *src,
+	long length, struct pcips_checksums *sums)
+{
+	long i, pos = 0, end;
+	const struct pcips_extent *e;
+
+	sums->src = pcips_crc32(0, src, length);
+	sums->out = 0;
+
+	for (i = 0; i < patch->writes.count; ++i)
+	{
+		e = &patch->writes.extents[i];
+		sums->out = crc_source(sums->out, src, length, pos, e->offset);
+
+		if (e->data)
+			sums->out = pcips_crc32(sums->out, e->data, e->length);
+		else
+			sums->out = pcips_crc32_run(sums->out, e->value,
+				e->length);
+
+		pos = e->offset + e->length;
+	}
+
+	end = length > patch->writes.end ? length : patch->writes.end;
+	sums->out = crc_source(sums->out, src, length, pos, end);
+}
+
+static int
+checksum_file(const struct pcips_patch *patch, FILE *src_file,
+	struct pcips_checksums *sums)
+{
+	int rc;
+	struct pcips_map map;
+
+	rc = pcips_map_file(&map, src_file);
+	if (rc)
+		return rc;
+
+	checksum_buffer(patch, map.data, map.length, sums);
+	pcips_unmap(&map);
+	return 0;
+}
+
+static int
+verify_checksums(const struct pcips_apply_options *opts,
+	const struct pcips_checksums *sums)
+{
+	if (opts->verify_src && sums->src != opts->expected.src)
+		return PCIPS_ECHECKSUM;
+
+	if (opts->verify_out && sums->out != opts->expected.out)
+		return PCIPS_ECHECKSUM;
+
+	return 0;
+}
+
+/*
+ * Empties a regular output file before a patched copy of another file is
+ * written to it, so that nothing it held before is left past the result.
+ */
+static int
+empty_output(FILE *dest, struct pcips_stats *stats)
+{
+	if (!pcips_file_is_regular(dest))
+		return 0;
+
+	if (fflush(dest) == EOF)
+		return PCIPS_EIO;
+
+	PCIPS_STAT_ADD(stats, syscalls, 1);
+	if (ftruncate(fileno(dest), 0) != 0)
+		return PCIPS_EIO;
+
+	rewind(dest);
+	return 0;
+}
+
+/*
+ * Applies a loaded patch to src_file, writing the result to dest_file, which
+ * may be the same stream to patch in place. Anything a separate dest_file
+ * already holds is replaced, unless opts->stream_dest says that it was not
+ * opened for this, such as standard output: it is then written in one pass
+ * from its current position, and never truncated or mapped. The patch is not
+ * modified, so it can be applied any number of times. opts may be NULL to
+ * use the defaults.
+ *
+ * When checksums are requested, they are computed from the source's mapping
+ * and the patch before anything is written, and a mismatch with the expected
+ * values leaves the output untouched. A source that is not a regular file is
+ * checksummed while it streams, so a mismatch is only found at the end.
+ */
+int
+pcips_patch_apply_to(const struct pcips_patch *patch, FILE *src_file,
+	FILE *dest_file, const struct pcips_apply_options *opts)
+{
+	int rc, stream;
+	long i;
+	struct pcips_checksums sums, *want = NULL;
+	struct pcips_stats *stats = opts ? opts->stats : NULL;
+	struct pcips_timer timer;
+
+	stream = src_file != dest_file && opts && opts->stream_dest;
+	if (opts && (opts->verify_src || opts->verify_out || opts->computed))
+		want = opts->computed ? opts->computed : &sums;
+
+	for (i = 0; stats && i < patch->writes.count; ++i)
+		stats->payload_bytes += patch->writes.extents[i].length;
+
+	/* a source that can only be read once is checked as it streams */
+	if (src_file != dest_file && !pcips_file_is_regular(src_file))
+	{
+		if (want)
+			want->src = want->out = 0;
+
+		rc = stream ? 0 : empty_output(dest_file, stats);
+		if (rc)
+			return rc;
+
+		pcips_stats_begin(stats, &timer);
+		rc = apply_stream(patch, src_file, dest_file, want);
+		pcips_stats_end(stats, &timer, PCIPS_PHASE_WRITE);
+		if (!rc && want)
+			rc = verify_checksums(opts, want);
+
+		return rc;
+	}
+
+	if (want)
+	{
+		rc = checksum_file(patch, src_file, want);
+		if (!rc)
+			rc = verify_checksums(opts, want);
+
+		if (rc)
+			return rc;
+	}
+
+	if (src_file != dest_file && !stream)
+	{
+		rc = empty_output(dest_file, stats);
+		if (rc)
+			return rc;
+	}
+
+	if (!stream && pcips_file_is_regular(src_file)
+		&& pcips_file_is_regular(dest_file))
+	{
+		if (src_file == dest_file || (opts && opts->queue_depth > 0))
+			return apply_planned(patch, src_file, dest_file, opts);
+
+		rc = apply_mapped(patch, src_file, dest_file, stats);
+		if (rc >= 0)
+			return rc;
+	}
+
+	pcips_stats_begin(stats, &timer);
+	if (src_file == dest_file)
+		rc = apply_stdio(patch, dest_file);
+	else
+		rc = apply_stream(patch, src_file, dest_file, NULL);
+
+	pcips_stats_end(stats, &timer, PCIPS_PHASE_WRITE);
+	return rc;
+}
+
+/*
+ * Writes the output bytes in [from, to) that come from the source, padded
+ * with zeros past its end like crc_source().
+ */
+static int
+copy_source(struct pcips_sink *dest, const unsigned char *src, long length,
+	long from, long to)
+{
+	int rc = 0;
+	long n;
+
+	if (from < length && from < to)
+	{
+		n = (to < length ? to : length) - from;
+		rc = pcips_sink_write(dest, src + from, n);
+		from += n;
+	}
+
+	if (!rc && to > from)
+		rc = pcips_sink_fill(dest, 0, to - from);
+
+	return rc;
+}
+
+/*
+ * Writes the result of applying a loaded patch to the length bytes at src to
+ * dest. Checksums are verified before anything is written, as with
+ * pcips_patch_apply_to(). Nothing is kept between calls, so any number of
+ * threads may apply patches at once, even the same loaded patch.
+ */
+int
+pcips_patch_apply_buffer(const struct pcips_patch *patch,
+	const unsigned char *src, long length, struct pcips_sink *dest,
+	const struct pcips_apply_options *opts)
+{
+	int rc = 0;
+	long i, pos = 0, end;
+	const struct pcips_extent *e;
+	struct pcips_checksums sums, *want = NULL;
+	struct pcips_stats *stats = opts ? opts->stats : NULL;
+	struct pcips_timer timer;
+
+	if (opts && (opts->verify_src || opts->verify_out || opts->computed))
+	{
+		want = opts->computed ? opts->computed : &sums;
+		checksum_buffer(patch, src, length, want);
+		rc = verify_checksums(opts, want);
+		if (rc)
+			return rc;
+	}
+
+	pcips_stats_begin(stats, &timer);
+	for (i = 0; !rc && i < patch->writes.count; ++i)
+	{
+		e = &patch->writes.extents[i];
+		rc = copy_source(dest, src, length, pos, e->offset);
+		if (rc)
+			break;
+
+		if (e->data)
+			rc = pcips_sink_write(dest, e->data, e->length);
+		else
+			rc = pcips_sink_fill(dest, e->value, e->length);
+
+		PCIPS_STAT_ADD(stats, payload_bytes, e->length);
+		pos = e->offset + e->length;
+	}
+
+	end = length > patch->writes.end ? length : patch->writes.end;
+	if (!rc)
+		rc = copy_source(dest, src, length, pos, end);
+
+	pcips_stats_end(stats, &timer, PCIPS_PHASE_WRITE);
+	return rc ? rc : pcips_sink_check(dest);
+}
+
+/*
+ * Applies the IPS, IPS32 or BPS patch held in memory at patch to the
+ * src_length bytes at src, writing the result to dest.
+ */
+int
+pcips_apply_buffer(const unsigned char *patch, long patch_length,
+	const unsigned char *src, long src_length, struct pcips_sink *dest,
+	const struct pcips_apply_options *opts)
+{
+	int rc;
+	struct pcips_patch *loaded;
+	struct pcips_stats *stats = opts ? opts->stats : NULL;
+	struct pcips_timer timer;
+
+	if (patch_length >= BPS_HEADER_SIZE
+		&& memcmp(patch, BPS_HEADER, BPS_HEADER_SIZE) == 0)
+		return pcips_bps_apply_buffer(patch, patch_length, src,
+			src_length, dest, opts);
+
+	pcips_stats_begin(stats, &timer);
+	rc = pcips_patch_load_buffer(&loaded, patch, patch_length);
+	pcips_stats_end(stats, &timer, PCIPS_PHASE_PARSE);
+	if (rc)
+		return rc;
+
+	PCIPS_STAT_ADD(stats, plain_read, loaded->n_plain);
+	PCIPS_STAT_ADD(stats, rle_read, loaded->n_rle);
+
+	rc = pcips_patch_apply_buffer(loaded, src, src_length, dest, opts);
+	pcips_patch_free(loaded);
+	return rc;
+}
+
+/*
+ * Compares the bytes each extent of a patch would write with the contents of
+ * file, without writing anything. The patch is applied if every extent
+ * matches and the file is long enough, and the file is a clean base if no
+ * extent matches.
+ */
+int
+pcips_patch_check(const struct pcips_patch *patch, FILE *file,
+	enum pcips_patch_state *state)
+{
+	int rc, matches;
+	long i, j, n_matched = 0;
+	const struct pcips_extent *e;
+	struct pcips_map map;
+
+	rc = pcips_map_file(&map, file);
+	if (rc)
+		return rc;
+
+	for (i = 0; i < patch->writes.count; ++i)
+	{
+		e = &patch->writes.extents[i];
+		if (e->offset + e->length > map.length)
+			continue;
+
+		if (e->data)
+		{
+			matches = memcmp(map.data + e->offset, e->data,
+				e->length) == 0;
+		}
 		else
 		{
-			while (size--)
+			for (j = 0; j < e->length; ++j)
 			{
-				c = fgetc(patch);
-				if (EOF == c)
-					return PCIPS_EIO;
-
-				c = fputc(c, dest_file);
-				if (EOF == c)
-					return PCIPS_EIO;
+				if (map.data[e->offset + j] != e->value)
+					break;
 			}
+
+			matches = j == e->length;
 		}
 
-		pos = ftell(dest_file);
-		if (pos > length)
-			length = pos;
+		n_matched += matches;
 	}
 
-	if (size != FOOTER_SIZE || memcmp(buf, IPS_FOOTER, FOOTER_SIZE) != 0)
-		return PCIPS_EFILE;
+	if (n_matched == patch->writes.count && map.length >= patch->writes.end)
+		*state = PCIPS_STATE_APPLIED;
+	else if (0 == n_matched)
+		*state = PCIPS_STATE_CLEAN;
+	else
+		*state = PCIPS_STATE_PARTIAL;
 
+	pcips_unmap(&map);
 	return 0;
 }
+
+int
+pcips_apply_patch(FILE *src_file, FILE *dest_file, FILE *patch_file)
+{
+	int rc;
+	struct pcips_patch *patch;
+
+	rc = pcips_patch_load(&patch, patch_file);
+	if (rc)
+		return rc;
+
+	rc = pcips_patch_apply_to(patch, src_file, dest_file, NULL);
+	pcips_patch_free(patch);
+	return rc;
+}
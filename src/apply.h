@@ -34,6 +34,58 @@
 
 #include <stdio.h>
 
+#include "patch.h"
+#include "sink.h"
+#include "stats.h"
+
+/* CRC-32 of a source file and of the result of applying a patch to it */
+struct pcips_checksums
+{
+	unsigned long src;
+	unsigned long out;
+};
+
+struct pcips_apply_options
+{
+	int queue_depth;
+	int skip_unchanged;
+	int verify_src;
+	int verify_out;
+	int stream_dest;
+	struct pcips_checksums expected;
+	struct pcips_checksums *computed;
+	struct pcips_stats *stats;
+};
+
+enum pcips_patch_state
+{
+	PCIPS_STATE_CLEAN,
+	PCIPS_STATE_PARTIAL,
+	PCIPS_STATE_APPLIED
+};
+
+int
+pcips_patch_check(const struct pcips_patch *patch, FILE *file,
+	enum pcips_patch_state *state);
+
+/*
+ * dest is emptied first unless it is src, which is then patched in place, or
+ * opts->stream_dest is set, in which case it is only written from where it is
+ */
+int
+pcips_patch_apply_to(const struct pcips_patch *patch, FILE *src, FILE *dest,
+	const struct pcips_apply_options *opts);
+
+int
+pcips_patch_apply_buffer(const struct pcips_patch *patch,
+	const unsigned char *src, long length, struct pcips_sink *dest,
+	const struct pcips_apply_options *opts);
+
+int
+pcips_apply_buffer(const unsigned char *patch, long patch_length,
+	const unsigned char *src, long src_length, struct pcips_sink *dest,
+	const struct pcips_apply_options *opts);
+
 int
 pcips_apply_patch(FILE *src, FILE *dest, FILE *patch);
 
@@ -0,0 +1,615 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+/* for realpath() */
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "apply.h"
+#include "batch.h"
+#include "bps.h"
+#include "cache.h"
+#include "err.h"
+#include "patch.h"
+#include "stats.h"
+
+#define MAX_FIELDS 3
+
+/* an entry and the chain of entries sharing files that it belongs to */
+struct slot
+{
+	struct pcips_batch_entry *entry;
+	long chain;
+};
+
+/*
+ * A file an entry reads or writes, known by its device and inode, or by its
+ * name with the directory resolved if it does not exist yet.
+ */
+struct use
+{
+	dev_t dev;
+	ino_t ino;
+	char *name;
+	long entry;
+	int writes;
+};
+
+struct pool
+{
+	pthread_mutex_t lock;
+	struct pcips_cache cache;
+	struct slot *order;
+	long count;
+	long next;
+	const struct pcips_batch_options *opts;
+};
+
+struct batch_worker
+{
+	pthread_t thread;
+	struct pool *pool;
+	struct pcips_apply_options apply;
+	struct pcips_stats stats;
+	int started;
+};
+
+static char *
+copy_path(const char *dir, const char *path)
+{
+	char *copy;
+
+	/* relative patch paths are taken from the manifest's directory */
+	if (!dir || '/' == path[0])
+		dir = "";
+
+	copy = malloc(strlen(dir) + strlen(path) + 2);
+	if (copy)
+		sprintf(copy, "%s%s%s", dir, dir[0] ? "/" : "", path);
+
+	return copy;
+}
+
+static int
+add_entry(struct pcips_batch *batch, const char *patch_dir,
+	char * const *fields, int n, long line)
+{
+	struct pcips_batch_entry *e, *tmp;
+
+	if (batch->count == batch->cap)
+	{
+		batch->cap = batch->cap ? batch->cap * 2 : 64;
+		tmp = realloc(batch->entries, batch->cap * sizeof *tmp);
+		if (!tmp)
+			return PCIPS_ENOMEM;
+
+		batch->entries = tmp;
+	}
+
+	e = &batch->entries[batch->count];
+	memset(e, 0, sizeof *e);
+	e->line = line;
+	e->patch = copy_path(patch_dir, fields[0]);
+	e->src = copy_path(NULL, fields[1]);
+	++batch->count;
+	if (!e->patch || !e->src)
+		return PCIPS_ENOMEM;
+
+	/* naming the source again is the same as patching it in place */
+	if (3 == n && strcmp(fields[1], fields[2]) != 0)
+	{
+		e->dest = copy_path(NULL, fields[2]);
+		if (!e->dest)
+			return PCIPS_ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads a manifest with one entry per line: the patch, the file to apply it
+ * to and, optionally, the file to write, separated by tabs. Without the
+ * third field the file is patched in place. Blank lines and lines starting
+ * with # are skipped, so the manifests written by pcips_create_tree() can be
+ * read as they are. Relative patch paths are taken from patch_dir, if given.
+ * On a malformed line, *bad_line is set to its number.
+ */
+int
+pcips_batch_load(struct pcips_batch *batch, FILE *manifest,
+	const char *patch_dir, long *bad_line)
+{
+	int rc = 0, n;
+	long line_no = 0;
+	char *line = NULL, *fields[MAX_FIELDS + 1], *p;
+	size_t cap = 0;
+	ssize_t len;
+
+	batch->entries = NULL;
+	batch->count = batch->cap = 0;
+
+	while (!rc && (len = getline(&line, &cap, manifest)) != -1)
+	{
+		++line_no;
+		if (len > 0 && '\n' == line[len - 1])
+			line[--len] = '\0';
+
+		if ('\0' == line[0] || '#' == line[0])
+			continue;
+
+		n = 0;
+		fields[n++] = p = line;
+		while (n <= MAX_FIELDS && (p = strchr(p, '\t')))
+		{
+			*p++ = '\0';
+			fields[n++] = p;
+		}
+
+		if (n < 2 || n > MAX_FIELDS || '\0' == fields[0][0]
+			|| '\0' == fields[1][0]
+			|| (3 == n && '\0' == fields[2][0]))
+		{
+			*bad_line = line_no;
+			rc = PCIPS_EFILE;
+			break;
+		}
+
+		rc = add_entry(batch, patch_dir, fields, n, line_no);
+	}
+
+	if (!rc && ferror(manifest))
+		rc = PCIPS_EIO;
+
+	free(line);
+	if (rc)
+		pcips_batch_free(batch);
+
+	return rc;
+}
+
+void
+pcips_batch_free(struct pcips_batch *batch)
+{
+	long i;
+
+	for (i = 0; i < batch->count; ++i)
+	{
+		free(batch->entries[i].patch);
+		free(batch->entries[i].src);
+		free(batch->entries[i].dest);
+	}
+
+	free(batch->entries);
+	batch->entries = NULL;
+	batch->count = batch->cap = 0;
+}
+
+static int
+compare_uses(const void *a, const void *b)
+{
+	const struct use *x = a, *y = b;
+
+	if (!x->name != !y->name)
+		return x->name ? 1 : -1;
+
+	if (x->name)
+		return strcmp(x->name, y->name);
+
+	if (x->dev != y->dev)
+		return x->dev < y->dev ? -1 : 1;
+
+	return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+/*
+ * Names the file at path so that every path to it compares the same: by
+ * device and inode if it exists, or else by the real path of its directory
+ * and its own name, so that an output yet to be written is still matched.
+ */
+static int
+identify(struct use *u, const char *path, long entry, int writes)
+{
+	struct stat st;
+	const char *slash, *base = path;
+	char *dir, *real = NULL;
+	size_t len;
+
+	u->entry = entry;
+	u->writes = writes;
+	u->name = NULL;
+	if (stat(path, &st) == 0)
+	{
+		u->dev = st.st_dev;
+		u->ino = st.st_ino;
+		return 0;
+	}
+
+	slash = strrchr(path, '/');
+	len = slash ? (size_t) (slash - path) + (slash == path) : 1;
+	dir = malloc(len + 1);
+	if (!dir)
+		return PCIPS_ENOMEM;
+
+	if (slash)
+	{
+		memcpy(dir, path, len);
+		dir[len] = '\0';
+		base = slash + 1;
+	}
+	else
+	{
+		strcpy(dir, ".");
+	}
+
+	real = realpath(dir, NULL);
+	free(dir);
+
+	/* a directory that cannot be resolved leaves the path as it is */
+	if (!real)
+		base = path;
+
+	u->name = malloc((real ? strlen(real) + 1 : 0) + strlen(base) + 1);
+	if (u->name)
+		sprintf(u->name, "%s%s%s", real ? real : "",
+			real ? "/" : "", base);
+
+	free(real);
+	return u->name ? 0 : PCIPS_ENOMEM;
+}
+
+/* chains together, each in the order of the manifest */
+static int
+compare_slots(const void *a, const void *b)
+{
+	const struct slot *x = a, *y = b;
+
+	if (x->chain != y->chain)
+		return x->chain < y->chain ? -1 : 1;
+
+	return x->entry->line < y->entry->line ? -1
+		: x->entry->line > y->entry->line;
+}
+
+static long
+find_chain(long *chain, long i)
+{
+	while (chain[i] != i)
+	{
+		chain[i] = chain[chain[i]];
+		i = chain[i];
+	}
+
+	return i;
+}
+
+/*
+ * Puts entries into the same chain when one writes a file that another reads
+ * or writes, however each names it, and sorts them by chain. Entries that
+ * only read the same file, such as one patch applied to many, stay apart.
+ */
+static int
+make_chains(struct pcips_batch *batch, struct slot *order)
+{
+	int rc = 0, writes;
+	long i, j, k, n = 0, *chain;
+	struct use *uses;
+	struct pcips_batch_entry *e;
+
+	chain = malloc((batch->count + 1) * sizeof *chain);
+	uses = malloc((3 * batch->count + 1) * sizeof *uses);
+	if (!chain || !uses)
+	{
+		free(chain);
+		free(uses);
+		return PCIPS_ENOMEM;
+	}
+
+	for (i = 0; !rc && i < batch->count; ++i)
+	{
+		e = &batch->entries[i];
+		chain[i] = i;
+		rc = identify(&uses[n++], e->patch, i, 0);
+		if (!rc)
+			rc = identify(&uses[n++], e->src, i, !e->dest);
+		if (!rc && e->dest)
+			rc = identify(&uses[n++], e->dest, i, 1);
+	}
+
+	if (rc)
+		goto end;
+
+	qsort(uses, n, sizeof *uses, compare_uses);
+	for (i = 0; i < n; i = j)
+	{
+		writes = 0;
+		for (j = i; j < n && compare_uses(&uses[j], &uses[i]) == 0;
+				++j)
+			writes |= uses[j].writes;
+
+		for (k = i + 1; writes && k < j; ++k)
+			chain[find_chain(chain, uses[k].entry)] =
+				find_chain(chain, uses[i].entry);
+	}
+
+	for (i = 0; i < batch->count; ++i)
+	{
+		order[i].entry = &batch->entries[i];
+		order[i].chain = find_chain(chain, i);
+	}
+
+	qsort(order, batch->count, sizeof *order, compare_slots);
+
+end:
+	for (i = 0; i < n; ++i)
+		free(uses[i].name);
+
+	free(uses);
+	free(chain);
+	return rc;
+}
+
+static FILE *
+open_file(struct pcips_batch_entry *e, const char *path, const char *mode)
+{
+	FILE *f;
+
+	f = fopen(path, mode);
+	if (!f)
+	{
+		e->failed = path;
+		e->open_errno = errno;
+	}
+
+	return f;
+}
+
+/*
+ * Applies one entry. IPS patches are parsed once and shared through the
+ * cache by every entry that names them; BPS patches are read by each.
+ */
+static int
+apply_entry(struct pool *p, struct pcips_batch_entry *e,
+	const struct pcips_apply_options *opts)
+{
+	int rc = PCIPS_EIO;
+	FILE *patch_file, *src = NULL, *dest = NULL;
+	struct pcips_cache_entry *cached = NULL;
+	struct pcips_timer timer;
+
+	patch_file = open_file(e, e->patch, "rb");
+	if (!patch_file)
+		return rc;
+
+	src = open_file(e, e->src, e->dest ? "rb" : "rb+");
+	if (!src)
+		goto end;
+
+	dest = e->dest ? open_file(e, e->dest, "wb+") : src;
+	if (!dest)
+		goto end;
+
+	if (pcips_bps_detect(patch_file))
+	{
+		rc = pcips_bps_apply(patch_file, src, dest, opts);
+		goto end;
+	}
+
+	pcips_stats_begin(opts->stats, &timer);
+	rc = pcips_cache_get(&p->cache, e->patch, patch_file, &cached);
+	pcips_stats_end(opts->stats, &timer, PCIPS_PHASE_PARSE);
+	if (!rc)
+		rc = pcips_patch_apply_to(cached->patch, src, dest, opts);
+
+end:
+	if (cached)
+		pcips_cache_release(&p->cache, cached);
+
+	if (dest && dest != src && fclose(dest) == EOF && !rc)
+		rc = PCIPS_EIO;
+
+	if (src && fclose(src) == EOF && !rc)
+		rc = PCIPS_EIO;
+
+	fclose(patch_file);
+	return rc;
+}
+
+/*
+ * Takes a chain of entries at a time from the shared queue, and applies them
+ * in the order of the manifest. Once one fails, the rest of its chain are
+ * skipped, as the files they would read or patch are not what they expect.
+ */
+static void *
+work(void *arg)
+{
+	struct batch_worker *w = arg;
+	struct pool *p = w->pool;
+	struct pcips_batch_entry *e, *failed;
+	long i, end;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&p->lock);
+		i = end = p->next;
+		while (end < p->count && p->order[end].chain
+				== p->order[i].chain)
+			++end;
+
+		p->next = end;
+		pthread_mutex_unlock(&p->lock);
+
+		if (i == end)
+			break;
+
+		for (failed = NULL; i < end; ++i)
+		{
+			e = p->order[i].entry;
+			if (failed)
+			{
+				e->rc = failed->rc;
+				e->skipped = failed->line;
+			}
+			else
+			{
+				e->rc = apply_entry(p, e, &w->apply);
+				if (e->rc)
+					failed = e;
+			}
+
+			pthread_mutex_lock(&p->lock);
+			if (p->opts->report)
+				p->opts->report(p->opts->ctx, e);
+			pthread_mutex_unlock(&p->lock);
+		}
+	}
+
+	return NULL;
+}
+
+static int
+run_pool(struct pool *p)
+{
+	int i, threads = p->opts->threads > 1 ? p->opts->threads : 1;
+	struct pcips_stats *stats = p->opts->apply->stats;
+	struct batch_worker *workers;
+
+	if (threads > p->count)
+		threads = p->count ? p->count : 1;
+
+	workers = calloc(threads, sizeof *workers);
+	if (!workers)
+		return PCIPS_ENOMEM;
+
+	for (i = 0; i < threads; ++i)
+	{
+		workers[i].pool = p;
+		workers[i].apply = *p->opts->apply;
+		if (stats)
+		{
+			pcips_stats_init(&workers[i].stats);
+			workers[i].stats.per_thread = 1;
+			workers[i].apply.stats = &workers[i].stats;
+		}
+
+		if (i > 0)
+		{
+			workers[i].started = !pthread_create(
+				&workers[i].thread, NULL, work, &workers[i]);
+		}
+	}
+
+	work(&workers[0]);
+	for (i = 0; i < threads; ++i)
+	{
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+
+		if (stats)
+			pcips_stats_merge(stats, &workers[i].stats);
+	}
+
+	free(workers);
+	return 0;
+}
+
+/*
+ * Applies every entry of the batch on opts->threads threads. Entries linked
+ * by a file that one of them writes are applied by one thread in the order
+ * of the manifest; others run in any order. Each entry is passed to
+ * opts->report when done, and the error of the first entry to fail is
+ * returned after all have run.
+ */
+int
+pcips_batch_apply(struct pcips_batch *batch,
+	const struct pcips_batch_options *opts)
+{
+	int rc;
+	long i;
+	struct pool p;
+
+	p.order = malloc((batch->count + 1) * sizeof *p.order);
+	if (!p.order)
+		return PCIPS_ENOMEM;
+
+	/* room for every patch, so none is parsed twice */
+	rc = pcips_cache_init(&p.cache, batch->count < INT_MAX
+		? (int) batch->count : INT_MAX);
+	if (rc)
+	{
+		free(p.order);
+		return rc;
+	}
+
+	if (pthread_mutex_init(&p.lock, NULL) != 0)
+	{
+		pcips_cache_free(&p.cache);
+		free(p.order);
+		return PCIPS_ENOMEM;
+	}
+
+	for (i = 0; i < batch->count; ++i)
+	{
+		batch->entries[i].rc = 0;
+		batch->entries[i].failed = NULL;
+		batch->entries[i].open_errno = 0;
+		batch->entries[i].skipped = 0;
+	}
+
+	rc = make_chains(batch, p.order);
+	if (rc)
+	{
+		pthread_mutex_destroy(&p.lock);
+		pcips_cache_free(&p.cache);
+		free(p.order);
+		return rc;
+	}
+
+	p.count = batch->count;
+	p.next = 0;
+	p.opts = opts;
+
+	rc = run_pool(&p);
+
+	for (i = 0; !rc && i < batch->count; ++i)
+		rc = batch->entries[i].rc;
+
+	pthread_mutex_destroy(&p.lock);
+	pcips_cache_free(&p.cache);
+	free(p.order);
+	return rc;
+}
@@ -0,0 +1,88 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#ifndef PCIPS_BATCH_H
+#define PCIPS_BATCH_H
+
+#include <stdio.h>
+
+#include "apply.h"
+
+/*
+ * One line of a manifest: a patch, the file it applies to and the file to
+ * write, or NULL to patch the source in place. When an entry fails, failed is
+ * the path that could not be opened, if any, and open_errno says why. An
+ * entry left out because one before it in its chain failed has the rc of
+ * that entry, and skipped is its line.
+ */
+struct pcips_batch_entry
+{
+	char *patch;
+	char *src;
+	char *dest;
+	long line;
+	int rc;
+	const char *failed;
+	int open_errno;
+	long skipped;
+};
+
+struct pcips_batch
+{
+	struct pcips_batch_entry *entries;
+	long count;
+	long cap;
+};
+
+/* Called as each entry is done, never by two threads at once. */
+typedef void (*pcips_batch_report_fn)(void *ctx,
+	const struct pcips_batch_entry *entry);
+
+struct pcips_batch_options
+{
+	int threads;
+	const struct pcips_apply_options *apply;
+	pcips_batch_report_fn report;
+	void *ctx;
+};
+
+int
+pcips_batch_load(struct pcips_batch *batch, FILE *manifest,
+	const char *patch_dir, long *bad_line);
+
+int
+pcips_batch_apply(struct pcips_batch *batch,
+	const struct pcips_batch_options *opts);
+
+void
+pcips_batch_free(struct pcips_batch *batch);
+
+#endif
@@ -0,0 +1,733 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "bps.h"
+#include "common.h"
+#include "crc32.h"
+#include "err.h"
+#include "map.h"
+#include "sink.h"
+#include "stats.h"
+
+enum bps_action
+{
+	BPS_SOURCE_READ,
+	BPS_TARGET_READ,
+	BPS_SOURCE_COPY,
+	BPS_TARGET_COPY
+};
+
+#define BPS_MAX_NUMBER ((unsigned long) LONG_MAX)
+
+/* shortest run of bytes looked up in the index of earlier data */
+#define MATCH_MIN 4
+
+/* most earlier positions with the same hash compared at each byte */
+#define MATCH_MAX_PROBES 32
+
+/* most positions indexed; larger inputs are indexed at a stride */
+#define INDEX_MAX_SIZE (1L << 24)
+#define HASH_MAX_BITS 22
+
+struct bps_writer
+{
+	struct pcips_sink *out;
+	unsigned long crc;
+	int error;
+};
+
+struct bps_encoder
+{
+	struct bps_writer w;
+	const unsigned char *src;
+	long src_length;
+	const unsigned char *mod;
+	long mod_length;
+	long *head;
+	long *prev;
+	int hash_bits;
+	long stride;
+	long src_slots;
+	long src_rel;
+	long mod_rel;
+};
+
+static void
+put(struct bps_writer *w, const unsigned char *data, size_t n)
+{
+	if (w->error || 0 == n)
+		return;
+
+	w->error = pcips_sink_write(w->out, data, n);
+
+	w->crc = pcips_crc32(w->crc, data, n);
+}
+
+/* Writes a number with the variable-length encoding used by BPS. */
+static void
+put_number(struct bps_writer *w, unsigned long value)
+{
+	unsigned char buf[16];
+	int n = 0;
+
+	for (;;)
+	{
+		buf[n] = value & 0x7F;
+		value >>= 7;
+		if (0 == value)
+		{
+			buf[n++] |= 0x80;
+			break;
+		}
+
+		++n;
+		--value;
+	}
+
+	put(w, buf, n);
+}
+
+static void
+put_crc32(struct bps_writer *w, unsigned long crc)
+{
+	unsigned char buf[4];
+	int i;
+
+	for (i = 0; i < 4; ++i)
+		buf[i] = (crc >> (8 * i)) & 0xFF;
+
+	put(w, buf, 4);
+}
+
+static int
+number_size(unsigned long value)
+{
+	int n = 1;
+
+	while (value >>= 7)
+	{
+		--value;
+		++n;
+	}
+
+	return n;
+}
+
+static unsigned long
+relative(long from, long to)
+{
+	return to < from ? (unsigned long) (from - to) << 1 | 1
+		: (unsigned long) (to - from) << 1;
+}
+
+static unsigned long
+hash(const struct bps_encoder *e, const unsigned char *p)
+{
+	unsigned long key = (unsigned long) p[0] << 24 | p[1] << 16
+		| p[2] << 8 | p[3];
+
+	return ((key * 2654435761UL) & 0xFFFFFFFFUL) >> (32 - e->hash_bits);
+}
+
+/*
+ * Adds the position in the source, or in the modified file if from_mod is
+ * set, to the index of places that copies can be made from.
+ */
+static void
+insert(struct bps_encoder *e, long pos, int from_mod)
+{
+	const unsigned char *p = from_mod ? e->mod : e->src;
+	long length = from_mod ? e->mod_length : e->src_length;
+	long slot;
+	unsigned long h;
+
+	if (pos % e->stride != 0 || pos + MATCH_MIN > length)
+		return;
+
+	slot = pos / e->stride + (from_mod ? e->src_slots : 0);
+	h = hash(e, p + pos);
+	e->prev[slot] = e->head[h];
+	e->head[h] = slot;
+}
+
+static long
+match_length(const unsigned char *a, const unsigned char *b, long max)
+{
+	long n = 0;
+
+	while (n < max && a[n] == b[n])
+		++n;
+
+	return n;
+}
+
+static void
+put_action(struct bps_encoder *e, enum bps_action action, long length)
+{
+	put_number(&e->w, (unsigned long) (length - 1) << 2 | action);
+}
+
+static void
+put_literal(struct bps_encoder *e, long start, long end)
+{
+	if (end > start)
+	{
+		put_action(e, BPS_TARGET_READ, end - start);
+		put(&e->w, e->mod + start, end - start);
+	}
+}
+
+/*
+ * Encodes the modified file as a series of BPS actions. At each position, the
+ * bytes at the same offset in the source are compared first, and then every
+ * earlier position in either file that the index holds with the same leading
+ * bytes. The copy that saves the most patch bytes is taken if it saves any,
+ * and anything not covered by a copy is stored as is.
+ */
+static void
+encode_actions(struct bps_encoder *e)
+{
+	long out = 0, lit = 0, len, max, slot, pos, rel, i;
+	long save, best_len, best_pos, best_back, best_save;
+	int probes;
+	enum bps_action action, best_action;
+	const unsigned char *from;
+
+	for (i = 0; i < e->src_length; i += e->stride)
+		insert(e, i, 0);
+
+	while (out < e->mod_length && !e->w.error)
+	{
+		best_action = BPS_TARGET_READ;
+		best_len = best_pos = best_back = 0;
+		best_save = 1;
+
+		max = e->mod_length - out;
+		if (out < e->src_length)
+		{
+			len = match_length(e->src + out, e->mod + out,
+				e->src_length - out < max
+				? e->src_length - out : max);
+			save = len - number_size((unsigned long) len << 2);
+			if (save > best_save)
+			{
+				best_action = BPS_SOURCE_READ;
+				best_len = len;
+				best_pos = out;
+				best_save = save;
+			}
+		}
+
+		slot = out + MATCH_MIN <= e->mod_length
+			? e->head[hash(e, e->mod + out)] : -1;
+		for (probes = 0; slot >= 0 && probes < MATCH_MAX_PROBES
+			&& best_len < max; slot = e->prev[slot], ++probes)
+		{
+			if (slot < e->src_slots)
+			{
+				action = BPS_SOURCE_COPY;
+				pos = slot * e->stride;
+				from = e->src;
+				len = e->src_length - pos < max
+					? e->src_length - pos : max;
+			}
+			else
+			{
+				action = BPS_TARGET_COPY;
+				pos = (slot - e->src_slots) * e->stride;
+				from = e->mod;
+				len = max;
+			}
+
+			len = match_length(from + pos, e->mod + out, len);
+
+			/* reclaim bytes that were about to be stored as is */
+			i = 0;
+			while (i < out - lit && i < pos
+				&& from[pos - i - 1] == e->mod[out - i - 1])
+				++i;
+
+			rel = BPS_SOURCE_COPY == action
+				? e->src_rel : e->mod_rel;
+			save = len + i
+				- number_size((unsigned long) (len + i) << 2)
+				- number_size(relative(rel, pos - i));
+			if (save > best_save)
+			{
+				best_action = action;
+				best_len = len + i;
+				best_pos = pos - i;
+				best_back = i;
+				best_save = save;
+			}
+		}
+
+		if (BPS_TARGET_READ == best_action)
+		{
+			insert(e, out++, 1);
+			continue;
+		}
+
+		/* a copy that was extended backwards starts before out */
+		put_literal(e, lit, out - best_back);
+		lit = out - best_back;
+		put_action(e, best_action, best_len);
+		if (BPS_SOURCE_COPY == best_action)
+		{
+			put_number(&e->w, relative(e->src_rel, best_pos));
+			e->src_rel = best_pos + best_len;
+		}
+		else if (BPS_TARGET_COPY == best_action)
+		{
+			put_number(&e->w, relative(e->mod_rel, best_pos));
+			e->mod_rel = best_pos + best_len;
+		}
+
+		for (; out < lit + best_len; ++out)
+			insert(e, out, 1);
+
+		lit = out;
+	}
+
+	put_literal(e, lit, out);
+}
+
+/*
+ * Writes a BPS patch that turns src into mod. Unlike IPS, BPS can describe
+ * data that was moved or inserted by copying it from elsewhere in either
+ * file, and it carries the CRC-32 of both files and of the patch itself.
+ */
+int
+pcips_bps_create(struct pcips_sink *patch, const unsigned char *src,
+	long src_length, const unsigned char *mod, long mod_length)
+{
+	int rc;
+	long i, slots;
+	struct bps_encoder e;
+
+	e.w.out = patch;
+	e.w.crc = 0;
+	e.w.error = 0;
+	e.src = src;
+	e.src_length = src_length;
+	e.mod = mod;
+	e.mod_length = mod_length;
+	e.src_rel = e.mod_rel = 0;
+
+	e.stride = (src_length + mod_length) / INDEX_MAX_SIZE + 1;
+	e.src_slots = src_length / e.stride + 1;
+	slots = e.src_slots + mod_length / e.stride + 1;
+	e.hash_bits = 10;
+	while (e.hash_bits < HASH_MAX_BITS && 1L << e.hash_bits < slots)
+		++e.hash_bits;
+
+	e.head = malloc((1L << e.hash_bits) * sizeof *e.head);
+	e.prev = malloc(slots * sizeof *e.prev);
+	if (!e.head || !e.prev)
+	{
+		rc = PCIPS_ENOMEM;
+		goto end;
+	}
+
+	for (i = 0; i < 1L << e.hash_bits; ++i)
+		e.head[i] = -1;
+
+	put(&e.w, (const unsigned char *) BPS_HEADER, BPS_HEADER_SIZE);
+	put_number(&e.w, src_length);
+	put_number(&e.w, mod_length);
+	put_number(&e.w, 0); /* no metadata */
+
+	encode_actions(&e);
+
+	put_crc32(&e.w, pcips_crc32(0, src, src_length));
+	put_crc32(&e.w, pcips_crc32(0, mod, mod_length));
+	put_crc32(&e.w, e.w.crc);
+	rc = e.w.error;
+
+end:
+	free(e.prev);
+	free(e.head);
+	return rc;
+}
+
+struct bps_cursor
+{
+	const unsigned char *pos;
+	const unsigned char *end;
+};
+
+static int
+get_number(struct bps_cursor *c, unsigned long *value)
+{
+	unsigned long data = 0, shift = 1, x;
+
+	for (;;)
+	{
+		if (c->pos == c->end)
+			return PCIPS_EFILE;
+
+		x = *c->pos++;
+		if ((x & 0x7F) > (BPS_MAX_NUMBER - data) / shift)
+			return PCIPS_EFILE;
+
+		data += (x & 0x7F) * shift;
+		if (x & 0x80)
+			break;
+
+		if (shift > BPS_MAX_NUMBER >> 7)
+			return PCIPS_EFILE;
+
+		shift <<= 7;
+		if (shift > BPS_MAX_NUMBER - data)
+			return PCIPS_EFILE;
+
+		data += shift;
+	}
+
+	*value = data;
+	return 0;
+}
+
+static unsigned long
+get_crc32(const unsigned char *p)
+{
+	return (unsigned long) p[0] | (unsigned long) p[1] << 8
+		| (unsigned long) p[2] << 16 | (unsigned long) p[3] << 24;
+}
+
+/* Carries out the actions of a patch, building the output in memory. */
+static int
+run_actions(struct bps_cursor *c, const unsigned char *src, long src_length,
+	unsigned char *out, long out_length)
+{
+	unsigned long data, n;
+	long pos = 0, len, src_rel = 0, out_rel = 0, i, *rel;
+
+	while (c->pos < c->end)
+	{
+		if (get_number(c, &data))
+			return PCIPS_EFILE;
+
+		len = (data >> 2) + 1;
+		if (len > out_length - pos)
+			return PCIPS_EFILE;
+
+		switch (data & 3)
+		{
+		case BPS_SOURCE_READ:
+			if (pos + len > src_length)
+				return PCIPS_EFILE;
+
+			memcpy(out + pos, src + pos, len);
+			break;
+
+		case BPS_TARGET_READ:
+			if (len > c->end - c->pos)
+				return PCIPS_EFILE;
+
+			memcpy(out + pos, c->pos, len);
+			c->pos += len;
+			break;
+
+		default:
+			if (get_number(c, &n))
+				return PCIPS_EFILE;
+
+			rel = BPS_SOURCE_COPY == (data & 3)
+				? &src_rel : &out_rel;
+			if (n & 1)
+				*rel -= n >> 1;
+			else
+				*rel += n >> 1;
+
+			if (BPS_SOURCE_COPY == (data & 3))
+			{
+				if (*rel < 0 || *rel > src_length - len)
+					return PCIPS_EFILE;
+
+				memcpy(out + pos, src + *rel, len);
+			}
+			else if (*rel < 0 || *rel >= pos)
+			{
+				return PCIPS_EFILE;
+			}
+			else if (*rel + len <= pos)
+			{
+				memcpy(out + pos, out + *rel, len);
+			}
+			else
+			{
+				/* overlapping copies repeat their output */
+				for (i = 0; i < len; ++i)
+					out[pos + i] = out[*rel + i];
+			}
+
+			*rel += len;
+			break;
+		}
+
+		pos += len;
+	}
+
+	return pos == out_length ? 0 : PCIPS_EFILE;
+}
+
+/*
+ * Checks the header and the patch's own checksum, and reads the sizes of the
+ * source and the output, leaving c at the first action and c->end at the
+ * footer.
+ */
+static int
+read_patch(struct bps_cursor *c, const unsigned char *patch, long length,
+	unsigned long *src_size, unsigned long *out_size)
+{
+	unsigned long meta_size;
+
+	if (length < BPS_HEADER_SIZE + BPS_FOOTER_SIZE
+		|| memcmp(patch, BPS_HEADER, BPS_HEADER_SIZE) != 0)
+		return PCIPS_EFILE;
+
+	c->end = patch + length - BPS_FOOTER_SIZE;
+	if (get_crc32(c->end + 8) != pcips_crc32(0, patch, length - 4))
+		return PCIPS_ECHECKSUM;
+
+	c->pos = patch + BPS_HEADER_SIZE;
+	if (get_number(c, src_size) || get_number(c, out_size)
+		|| get_number(c, &meta_size)
+		|| meta_size > (unsigned long) (c->end - c->pos))
+		return PCIPS_EFILE;
+
+	c->pos += meta_size;
+	return 0;
+}
+
+/*
+ * Builds the output of a patch in out, checking the source first and the
+ * output afterwards against the checksums in the footer and in opts.
+ */
+static int
+build_output(struct bps_cursor *c, const unsigned char *src, long src_length,
+	unsigned long src_size, unsigned char *out, unsigned long out_size,
+	const struct pcips_apply_options *opts, struct pcips_checksums *sums)
+{
+	int rc;
+
+	sums->src = pcips_crc32(0, src, src_length);
+	sums->out = 0;
+	if ((unsigned long) src_length != src_size
+		|| sums->src != get_crc32(c->end)
+		|| (opts && opts->verify_src
+			&& sums->src != opts->expected.src))
+		return PCIPS_ECHECKSUM;
+
+	rc = run_actions(c, src, src_length, out, out_size);
+	if (rc)
+		return rc;
+
+	sums->out = pcips_crc32(0, out, out_size);
+	if (sums->out != get_crc32(c->end + 4)
+		|| (opts && opts->verify_out
+			&& sums->out != opts->expected.out))
+		return PCIPS_ECHECKSUM;
+
+	return 0;
+}
+
+/*
+ * Replaces the contents of dest with the output, or only writes it from
+ * where dest is if it is a stream that was not opened for this.
+ */
+static int
+write_output(FILE *dest, const unsigned char *out, long length, int stream)
+{
+	int regular = !stream && pcips_file_is_regular(dest);
+
+	if (regular)
+		rewind(dest);
+
+	if (fwrite(out, 1, length, dest) != (size_t) length
+		|| fflush(dest) == EOF)
+		return PCIPS_EIO;
+
+	if (regular && ftruncate(fileno(dest), length) != 0)
+		return PCIPS_EIO;
+
+	return 0;
+}
+
+/* Tells whether a patch is in the BPS format, leaving it at its beginning. */
+int
+pcips_bps_detect(FILE *patch)
+{
+	char header[BPS_HEADER_SIZE];
+	int bps;
+
+	bps = fread(header, 1, BPS_HEADER_SIZE, patch) == BPS_HEADER_SIZE
+		&& memcmp(header, BPS_HEADER, BPS_HEADER_SIZE) == 0;
+
+	rewind(patch);
+	return bps;
+}
+
+/*
+ * Applies a BPS patch to src, writing the result to dest, which may be the
+ * same stream to patch in place. The output is built in memory and checked
+ * against the CRC-32 stored in the patch before any of it is written, as is
+ * the source. opts may be NULL, or give checksums to verify as well, and
+ * opts->stream_dest works as for pcips_patch_apply_to().
+ */
+int
+pcips_bps_apply(FILE *patch, FILE *src, FILE *dest,
+	const struct pcips_apply_options *opts)
+{
+	int rc;
+	unsigned long src_size, out_size;
+	unsigned char *out = NULL;
+	struct pcips_checksums sums;
+	struct pcips_map patch_map, src_map;
+	struct pcips_stats *stats = opts ? opts->stats : NULL;
+	struct pcips_timer timer;
+	struct bps_cursor c;
+
+	pcips_stats_begin(stats, &timer);
+	sums.src = sums.out = 0;
+	src_map.data = NULL;
+	src_map.length = 0;
+	src_map.mapped = 0;
+
+	rc = pcips_map_file(&patch_map, patch);
+	if (rc)
+		return rc;
+
+	rc = read_patch(&c, patch_map.data, patch_map.length, &src_size,
+		&out_size);
+	if (rc)
+		goto end;
+
+	pcips_stats_end(stats, &timer, PCIPS_PHASE_PARSE);
+	pcips_stats_begin(stats, &timer);
+
+	rc = pcips_map_file(&src_map, src);
+	if (rc)
+		goto end;
+
+	out = malloc(out_size ? out_size : 1);
+	if (!out)
+	{
+		rc = PCIPS_ENOMEM;
+		goto end;
+	}
+
+	rc = build_output(&c, src_map.data, src_map.length, src_size, out,
+		out_size, opts, &sums);
+	if (rc)
+		goto end;
+
+	/* the source may be the output, so its mapping must go first */
+	pcips_unmap(&src_map);
+	rc = write_output(dest, out, out_size,
+		src != dest && opts && opts->stream_dest);
+	pcips_stats_end(stats, &timer, PCIPS_PHASE_WRITE);
+	PCIPS_STAT_ADD(stats, payload_bytes, out_size);
+
+end:
+	if (opts && opts->computed)
+		*opts->computed = sums;
+
+	free(out);
+	pcips_unmap(&src_map);
+	pcips_unmap(&patch_map);
+	return rc;
+}
+
+/*
+ * Applies the BPS patch held in memory at patch to the src_length bytes at
+ * src, writing the result to dest. When dest is a buffer with room for the
+ * output, the output is built there directly.
+ */
+int
+pcips_bps_apply_buffer(const unsigned char *patch, long patch_length,
+	const unsigned char *src, long src_length, struct pcips_sink *dest,
+	const struct pcips_apply_options *opts)
+{
+	int rc;
+	unsigned long src_size, out_size;
+	unsigned char *out, *buf = NULL;
+	struct pcips_checksums sums;
+	struct pcips_stats *stats = opts ? opts->stats : NULL;
+	struct pcips_timer timer;
+	struct bps_cursor c;
+
+	pcips_stats_begin(stats, &timer);
+	sums.src = sums.out = 0;
+
+	rc = read_patch(&c, patch, patch_length, &src_size, &out_size);
+	if (rc)
+		goto end;
+
+	pcips_stats_end(stats, &timer, PCIPS_PHASE_PARSE);
+	pcips_stats_begin(stats, &timer);
+
+	out = pcips_sink_reserve(dest, out_size);
+	if (!out)
+	{
+		out = buf = malloc(out_size ? out_size : 1);
+		if (!buf)
+		{
+			rc = PCIPS_ENOMEM;
+			goto end;
+		}
+	}
+
+	rc = build_output(&c, src, src_length, src_size, out, out_size, opts,
+		&sums);
+	if (!rc && buf)
+		rc = pcips_sink_write(dest, buf, out_size);
+
+	if (!rc)
+		rc = pcips_sink_check(dest);
+
+	pcips_stats_end(stats, &timer, PCIPS_PHASE_WRITE);
+	PCIPS_STAT_ADD(stats, payload_bytes, out_size);
+
+end:
+	if (opts && opts->computed)
+		*opts->computed = sums;
+
+	free(buf);
+	return rc;
+}
@@ -0,0 +1,277 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "err.h"
+#include "patch.h"
+
+int
+pcips_cache_init(struct pcips_cache *cache, int max)
+{
+	if (pthread_mutex_init(&cache->lock, NULL) != 0)
+		return PCIPS_ENOMEM;
+
+	if (pthread_cond_init(&cache->loaded, NULL) != 0)
+	{
+		pthread_mutex_destroy(&cache->lock);
+		return PCIPS_ENOMEM;
+	}
+
+	cache->head = cache->tail = NULL;
+	cache->count = 0;
+	cache->max = max;
+	return 0;
+}
+
+static void
+free_entry(struct pcips_cache_entry *e)
+{
+	pcips_patch_free(e->patch);
+	free(e->path);
+	free(e);
+}
+
+static void
+unlink_entry(struct pcips_cache *cache, struct pcips_cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache->head = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache->tail = e->prev;
+
+	e->prev = e->next = NULL;
+	--cache->count;
+}
+
+static void
+push_front(struct pcips_cache *cache, struct pcips_cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = cache->head;
+	if (cache->head)
+		cache->head->prev = e;
+	else
+		cache->tail = e;
+
+	cache->head = e;
+	++cache->count;
+}
+
+/*
+ * Takes an entry out of the cache. One still in use is freed when it is
+ * released instead.
+ */
+static void
+drop(struct pcips_cache *cache, struct pcips_cache_entry *e)
+{
+	unlink_entry(cache, e);
+	e->cached = 0;
+	if (0 == e->refs)
+		free_entry(e);
+}
+
+/* Drops the least recently used entries that are not in use. */
+static void
+trim(struct pcips_cache *cache)
+{
+	struct pcips_cache_entry *e, *prev;
+
+	for (e = cache->tail; e && cache->count > cache->max; e = prev)
+	{
+		prev = e->prev;
+		if (0 == e->refs)
+			drop(cache, e);
+	}
+}
+
+/* Gives up a reference to an entry. The lock must be held. */
+static void
+put(struct pcips_cache *cache, struct pcips_cache_entry *e)
+{
+	if (0 == --e->refs)
+	{
+		if (!e->cached)
+			free_entry(e);
+		else
+			trim(cache);
+	}
+}
+
+static struct pcips_cache_entry *
+find(struct pcips_cache *cache, const char *path, const struct stat *st)
+{
+	struct pcips_cache_entry *e;
+
+	for (e = cache->head; e; e = e->next)
+	{
+		if (strcmp(e->path, path) != 0)
+			continue;
+
+		if (e->size == st->st_size
+			&& e->mtime.tv_sec == st->st_mtim.tv_sec
+			&& e->mtime.tv_nsec == st->st_mtim.tv_nsec)
+			return e;
+
+		/* the file has changed since it was loaded */
+		drop(cache, e);
+		return NULL;
+	}
+
+	return NULL;
+}
+
+/*
+ * Finds the patch at path, which is open as f, loading it if it is not
+ * cached or its file has changed since. The entry stays valid until it is
+ * passed to pcips_cache_release(), even if it is dropped from the cache
+ * meanwhile. The file is parsed without holding the lock, so threads that
+ * miss on different patches load them at the same time, while threads
+ * after the same patch wait for the first one to load it.
+ */
+int
+pcips_cache_get(struct pcips_cache *cache, const char *path, FILE *f,
+	struct pcips_cache_entry **entry)
+{
+	int rc;
+	struct stat st;
+	struct pcips_cache_entry *e;
+
+	if (fstat(fileno(f), &st) != 0)
+		return PCIPS_EIO;
+
+	pthread_mutex_lock(&cache->lock);
+	e = find(cache, path, &st);
+	if (e)
+	{
+		unlink_entry(cache, e);
+		push_front(cache, e);
+		++e->refs;
+
+		while (e->loading)
+			pthread_cond_wait(&cache->loaded, &cache->lock);
+
+		rc = e->error;
+		if (rc)
+			put(cache, e);
+
+		pthread_mutex_unlock(&cache->lock);
+
+		if (!rc)
+			*entry = e;
+
+		return rc;
+	}
+
+	e = malloc(sizeof *e);
+	if (e)
+		e->path = malloc(strlen(path) + 1);
+
+	if (!e || !e->path)
+	{
+		pthread_mutex_unlock(&cache->lock);
+		free(e);
+		return PCIPS_ENOMEM;
+	}
+
+	strcpy(e->path, path);
+	e->mtime = st.st_mtim;
+	e->size = st.st_size;
+	e->patch = NULL;
+	e->refs = 1;
+	e->cached = 1;
+	e->loading = 1;
+	e->error = 0;
+	push_front(cache, e);
+	pthread_mutex_unlock(&cache->lock);
+
+	rc = pcips_patch_load(&e->patch, f);
+
+	pthread_mutex_lock(&cache->lock);
+	e->loading = 0;
+	e->error = rc;
+	if (rc)
+	{
+		/*
+		 * A malformed patch stays cached with its error, as it would
+		 * fail the same way until its file changes. Threads waiting
+		 * on an entry dropped here still hold references to it.
+		 */
+		if (rc != PCIPS_EFILE && e->cached)
+		{
+			unlink_entry(cache, e);
+			e->cached = 0;
+		}
+
+		put(cache, e);
+	}
+	else
+	{
+		trim(cache);
+	}
+
+	pthread_cond_broadcast(&cache->loaded);
+	pthread_mutex_unlock(&cache->lock);
+
+	if (!rc)
+		*entry = e;
+
+	return rc;
+}
+
+void
+pcips_cache_release(struct pcips_cache *cache,
+	struct pcips_cache_entry *entry)
+{
+	pthread_mutex_lock(&cache->lock);
+	put(cache, entry);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void
+pcips_cache_free(struct pcips_cache *cache)
+{
+	while (cache->head)
+		drop(cache, cache->head);
+
+	pthread_cond_destroy(&cache->loaded);
+	pthread_mutex_destroy(&cache->lock);
+}
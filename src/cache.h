@@ -0,0 +1,82 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#ifndef PCIPS_CACHE_H
+#define PCIPS_CACHE_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "patch.h"
+
+/* a loaded patch, valid while its file keeps the same mtime and size */
+struct pcips_cache_entry
+{
+	char *path;
+	struct timespec mtime;
+	off_t size;
+	struct pcips_patch *patch;
+	int refs;
+	int cached;
+	int loading;
+	int error;
+	struct pcips_cache_entry *prev;
+	struct pcips_cache_entry *next;
+};
+
+/* loaded patches shared between threads, most recently used first */
+struct pcips_cache
+{
+	pthread_mutex_t lock;
+	pthread_cond_t loaded;
+	struct pcips_cache_entry *head;
+	struct pcips_cache_entry *tail;
+	int count;
+	int max;
+};
+
+int
+pcips_cache_init(struct pcips_cache *cache, int max);
+
+int
+pcips_cache_get(struct pcips_cache *cache, const char *path, FILE *f,
+	struct pcips_cache_entry **entry);
+
+void
+pcips_cache_release(struct pcips_cache *cache,
+	struct pcips_cache_entry *entry);
+
+void
+pcips_cache_free(struct pcips_cache *cache);
+
+#endif
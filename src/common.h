@@ -35,13 +35,26 @@
 #define IPS_HEADER "PATCH"
 #define IPS_FOOTER "EOF"
 
+/* IPS32 widens offsets to 4 bytes but is otherwise the same */
+#define IPS32_HEADER "IPS32"
+#define IPS32_FOOTER "EEOF"
+
+/* BPS describes copies as well as replaced bytes, and ends with checksums */
+#define BPS_HEADER "BPS1"
+#define BPS_HEADER_SIZE 4
+#define BPS_FOOTER_SIZE 12
+
 #define IPS_MAX_OFFSET 0x00FFFFFFL
+#define IPS32_MAX_OFFSET 0x7FFFFFFFL
 #define IPS_MAX_RECORD 0xFFFF
 
 #define IPS_OFFSET_SIZE 3
+#define IPS32_OFFSET_SIZE 4
 #define IPS_SIZE_SIZE 2
+#define FILE_HEADER_SIZE 5
 #define HEADER_SIZE (IPS_OFFSET_SIZE + IPS_SIZE_SIZE)
 #define FOOTER_SIZE 3
+#define IPS32_FOOTER_SIZE 4
 #define RLE_HEADER_SIZE (HEADER_SIZE + 2)
 #define RLE_RECORD_SIZE (RLE_HEADER_SIZE + 1)
 #define RLE_EXTENSION (RLE_RECORD_SIZE - HEADER_SIZE)
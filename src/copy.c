@@ -0,0 +1,191 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "copy.h"
+#include "err.h"
+#include "stats.h"
+
+#define COPY_BUFFER_SIZE 65536
+
+#ifdef __linux__
+static long
+copy_range(int src_fd, int dest_fd, long copied, long length,
+	struct pcips_stats *stats)
+{
+	loff_t in = copied, out = copied;
+	ssize_t n;
+
+	while (copied < length)
+	{
+		n = copy_file_range(src_fd, &in, dest_fd, &out,
+				length - copied, 0);
+		PCIPS_STAT_ADD(stats, syscalls, 1);
+		if (n <= 0)
+			break;
+
+		copied += n;
+	}
+
+	return copied;
+}
+
+static long
+copy_sendfile(int src_fd, int dest_fd, long copied, long length,
+	struct pcips_stats *stats)
+{
+	off_t in = copied;
+	ssize_t n;
+
+	if (lseek(dest_fd, copied, SEEK_SET) != copied)
+		return copied;
+
+	while (copied < length)
+	{
+		n = sendfile(dest_fd, src_fd, &in, length - copied);
+		PCIPS_STAT_ADD(stats, syscalls, 1);
+		if (n <= 0)
+			break;
+
+		copied += n;
+	}
+
+	return copied;
+}
+#endif
+
+static long
+copy_buffered(int src_fd, int dest_fd, long copied, long length,
+	struct pcips_stats *stats)
+{
+	unsigned char *buf;
+	ssize_t n, w, done;
+
+	buf = malloc(COPY_BUFFER_SIZE);
+	if (!buf)
+		return copied;
+
+	while (copied < length)
+	{
+		n = pread(src_fd, buf, COPY_BUFFER_SIZE, copied);
+		PCIPS_STAT_ADD(stats, syscalls, 1);
+		if (n <= 0)
+			break;
+
+		for (done = 0; done < n; done += w)
+		{
+			w = pwrite(dest_fd, buf + done, n - done,
+				copied + done);
+			PCIPS_STAT_ADD(stats, syscalls, 1);
+			if (w <= 0)
+				goto end;
+		}
+
+		copied += n;
+	}
+
+end:
+	free(buf);
+	return copied;
+}
+
+/*
+ * Copies the first length bytes of src_fd into the empty file dest_fd,
+ * keeping the data inside the kernel where possible. On Linux the copy is
+ * first attempted as a reflink (FICLONE), which shares extents on
+ * filesystems such as Btrfs and XFS, then with copy_file_range and sendfile.
+ * Any remainder is copied through a user-space buffer.
+ */
+int
+pcips_copy_file(int src_fd, int dest_fd, long length,
+	struct pcips_stats *stats)
+{
+	long copied = 0;
+
+#ifdef __linux__
+#ifdef FICLONE
+	PCIPS_STAT_ADD(stats, syscalls, 1);
+	if (ioctl(dest_fd, FICLONE, src_fd) == 0)
+		return 0;
+#endif
+
+	copied = copy_range(src_fd, dest_fd, copied, length, stats);
+	if (copied < length)
+		copied = copy_sendfile(src_fd, dest_fd, copied, length,
+			stats);
+#endif
+
+	if (copied < length)
+		copied = copy_buffered(src_fd, dest_fd, copied, length, stats);
+
+	return copied == length ? 0 : PCIPS_EIO;
+}
+
+/*
+ * Zeroes length bytes of fd at offset by deallocating them, so that the range
+ * becomes a hole on filesystems that support sparse files. The file size is
+ * left unchanged. Returns 0 on success, or -1 if the range must be zeroed by
+ * writing to it instead.
+ */
+int
+pcips_punch_hole(int fd, long offset, long length,
+	struct pcips_stats *stats)
+{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+	PCIPS_STAT_ADD(stats, syscalls, 1);
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+			length) == 0)
+		return 0;
+#else
+	(void) fd;
+	(void) offset;
+	(void) length;
+	(void) stats;
+#endif
+
+	return -1;
+}
@@ -0,0 +1,627 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <string.h>
+
+#include "crc32.h"
+
+#define RUN_BUFFER_SIZE 4096
+
+/*
+ * Lookup tables for slicing-by-8: crc_table[0] is the usual byte-at-a-time
+ * table for the reflected polynomial 0xEDB88320, and crc_table[k] advances a
+ * byte through k further zero bytes.
+ */
+static const unsigned long crc_table[8][256] = {
+	{
+		0x00000000UL, 0x77073096UL, 0xee0e612cUL, 0x990951baUL,
+		0x076dc419UL, 0x706af48fUL, 0xe963a535UL, 0x9e6495a3UL,
+		0x0edb8832UL, 0x79dcb8a4UL, 0xe0d5e91eUL, 0x97d2d988UL,
+		0x09b64c2bUL, 0x7eb17cbdUL, 0xe7b82d07UL, 0x90bf1d91UL,
+		0x1db71064UL, 0x6ab020f2UL, 0xf3b97148UL, 0x84be41deUL,
+		0x1adad47dUL, 0x6ddde4ebUL, 0xf4d4b551UL, 0x83d385c7UL,
+		0x136c9856UL, 0x646ba8c0UL, 0xfd62f97aUL, 0x8a65c9ecUL,
+		0x14015c4fUL, 0x63066cd9UL, 0xfa0f3d63UL, 0x8d080df5UL,
+		0x3b6e20c8UL, 0x4c69105eUL, 0xd56041e4UL, 0xa2677172UL,
+		0x3c03e4d1UL, 0x4b04d447UL, 0xd20d85fdUL, 0xa50ab56bUL,
+		0x35b5a8faUL, 0x42b2986cUL, 0xdbbbc9d6UL, 0xacbcf940UL,
+		0x32d86ce3UL, 0x45df5c75UL, 0xdcd60dcfUL, 0xabd13d59UL,
+		0x26d930acUL, 0x51de003aUL, 0xc8d75180UL, 0xbfd06116UL,
+		0x21b4f4b5UL, 0x56b3c423UL, 0xcfba9599UL, 0xb8bda50fUL,
+		0x2802b89eUL, 0x5f058808UL, 0xc60cd9b2UL, 0xb10be924UL,
+		0x2f6f7c87UL, 0x58684c11UL, 0xc1611dabUL, 0xb6662d3dUL,
+		0x76dc4190UL, 0x01db7106UL, 0x98d220bcUL, 0xefd5102aUL,
+		0x71b18589UL, 0x06b6b51fUL, 0x9fbfe4a5UL, 0xe8b8d433UL,
+		0x7807c9a2UL, 0x0f00f934UL, 0x9609a88eUL, 0xe10e9818UL,
+		0x7f6a0dbbUL, 0x086d3d2dUL, 0x91646c97UL, 0xe6635c01UL,
+		0x6b6b51f4UL, 0x1c6c6162UL, 0x856530d8UL, 0xf262004eUL,
+		0x6c0695edUL, 0x1b01a57bUL, 0x8208f4c1UL, 0xf50fc457UL,
+		0x65b0d9c6UL, 0x12b7e950UL, 0x8bbeb8eaUL, 0xfcb9887cUL,
+		0x62dd1ddfUL, 0x15da2d49UL, 0x8cd37cf3UL, 0xfbd44c65UL,
+		0x4db26158UL, 0x3ab551ceUL, 0xa3bc0074UL, 0xd4bb30e2UL,
+		0x4adfa541UL, 0x3dd895d7UL, 0xa4d1c46dUL, 0xd3d6f4fbUL,
+		0x4369e96aUL, 0x346ed9fcUL, 0xad678846UL, 0xda60b8d0UL,
+		0x44042d73UL, 0x33031de5UL, 0xaa0a4c5fUL, 0xdd0d7cc9UL,
+		0x5005713cUL, 0x270241aaUL, 0xbe0b1010UL, 0xc90c2086UL,
+		0x5768b525UL, 0x206f85b3UL, 0xb966d409UL, 0xce61e49fUL,
+		0x5edef90eUL, 0x29d9c998UL, 0xb0d09822UL, 0xc7d7a8b4UL,
+		0x59b33d17UL, 0x2eb40d81UL, 0xb7bd5c3bUL, 0xc0ba6cadUL,
+		0xedb88320UL, 0x9abfb3b6UL, 0x03b6e20cUL, 0x74b1d29aUL,
+		0xead54739UL, 0x9dd277afUL, 0x04db2615UL, 0x73dc1683UL,
+		0xe3630b12UL, 0x94643b84UL, 0x0d6d6a3eUL, 0x7a6a5aa8UL,
+		0xe40ecf0bUL, 0x9309ff9dUL, 0x0a00ae27UL, 0x7d079eb1UL,
+		0xf00f9344UL, 0x8708a3d2UL, 0x1e01f268UL, 0x6906c2feUL,
+		0xf762575dUL, 0x806567cbUL, 0x196c3671UL, 0x6e6b06e7UL,
+		0xfed41b76UL, 0x89d32be0UL, 0x10da7a5aUL, 0x67dd4accUL,
+		0xf9b9df6fUL, 0x8ebeeff9UL, 0x17b7be43UL, 0x60b08ed5UL,
+		0xd6d6a3e8UL, 0xa1d1937eUL, 0x38d8c2c4UL, 0x4fdff252UL,
+		0xd1bb67f1UL, 0xa6bc5767UL, 0x3fb506ddUL, 0x48b2364bUL,
+		0xd80d2bdaUL, 0xaf0a1b4cUL, 0x36034af6UL, 0x41047a60UL,
+		0xdf60efc3UL, 0xa867df55UL, 0x316e8eefUL, 0x4669be79UL,
+		0xcb61b38cUL, 0xbc66831aUL, 0x256fd2a0UL, 0x5268e236UL,
+		0xcc0c7795UL, 0xbb0b4703UL, 0x220216b9UL, 0x5505262fUL,
+		0xc5ba3bbeUL, 0xb2bd0b28UL, 0x2bb45a92UL, 0x5cb36a04UL,
+		0xc2d7ffa7UL, 0xb5d0cf31UL, 0x2cd99e8bUL, 0x5bdeae1dUL,
+		0x9b64c2b0UL, 0xec63f226UL, 0x756aa39cUL, 0x026d930aUL,
+		0x9c0906a9UL, 0xeb0e363fUL, 0x72076785UL, 0x05005713UL,
+		0x95bf4a82UL, 0xe2b87a14UL, 0x7bb12baeUL, 0x0cb61b38UL,
+		0x92d28e9bUL, 0xe5d5be0dUL, 0x7cdcefb7UL, 0x0bdbdf21UL,
+		0x86d3d2d4UL, 0xf1d4e242UL, 0x68ddb3f8UL, 0x1fda836eUL,
+		0x81be16cdUL, 0xf6b9265bUL, 0x6fb077e1UL, 0x18b74777UL,
+		0x88085ae6UL, 0xff0f6a70UL, 0x66063bcaUL, 0x11010b5cUL,
+		0x8f659effUL, 0xf862ae69UL, 0x616bffd3UL, 0x166ccf45UL,
+		0xa00ae278UL, 0xd70dd2eeUL, 0x4e048354UL, 0x3903b3c2UL,
+		0xa7672661UL, 0xd06016f7UL, 0x4969474dUL, 0x3e6e77dbUL,
+		0xaed16a4aUL, 0xd9d65adcUL, 0x40df0b66UL, 0x37d83bf0UL,
+		0xa9bcae53UL, 0xdebb9ec5UL, 0x47b2cf7fUL, 0x30b5ffe9UL,
+		0xbdbdf21cUL, 0xcabac28aUL, 0x53b39330UL, 0x24b4a3a6UL,
+		0xbad03605UL, 0xcdd70693UL, 0x54de5729UL, 0x23d967bfUL,
+		0xb3667a2eUL, 0xc4614ab8UL, 0x5d681b02UL, 0x2a6f2b94UL,
+		0xb40bbe37UL, 0xc30c8ea1UL, 0x5a05df1bUL, 0x2d02ef8dUL
+	},
+	{
+		0x00000000UL, 0x191b3141UL, 0x32366282UL, 0x2b2d53c3UL,
+		0x646cc504UL, 0x7d77f445UL, 0x565aa786UL, 0x4f4196c7UL,
+		0xc8d98a08UL, 0xd1c2bb49UL, 0xfaefe88aUL, 0xe3f4d9cbUL,
+		0xacb54f0cUL, 0xb5ae7e4dUL, 0x9e832d8eUL, 0x87981ccfUL,
+		0x4ac21251UL, 0x53d92310UL, 0x78f470d3UL, 0x61ef4192UL,
+		0x2eaed755UL, 0x37b5e614UL, 0x1c98b5d7UL, 0x05838496UL,
+		0x821b9859UL, 0x9b00a918UL, 0xb02dfadbUL, 0xa936cb9aUL,
+		0xe6775d5dUL, 0xff6c6c1cUL, 0xd4413fdfUL, 0xcd5a0e9eUL,
+		0x958424a2UL, 0x8c9f15e3UL, 0xa7b24620UL, 0xbea97761UL,
+		0xf1e8e1a6UL, 0xe8f3d0e7UL, 0xc3de8324UL, 0xdac5b265UL,
+		0x5d5daeaaUL, 0x44469febUL, 0x6f6bcc28UL, 0x7670fd69UL,
+		0x39316baeUL, 0x202a5aefUL, 0x0b07092cUL, 0x121c386dUL,
+		0xdf4636f3UL, 0xc65d07b2UL, 0xed705471UL, 0xf46b6530UL,
+		0xbb2af3f7UL, 0xa231c2b6UL, 0x891c9175UL, 0x9007a034UL,
+		0x179fbcfbUL, 0x0e848dbaUL, 0x25a9de79UL, 0x3cb2ef38UL,
+		0x73f379ffUL, 0x6ae848beUL, 0x41c51b7dUL, 0x58de2a3cUL,
+		0xf0794f05UL, 0xe9627e44UL, 0xc24f2d87UL, 0xdb541cc6UL,
+		0x94158a01UL, 0x8d0ebb40UL, 0xa623e883UL, 0xbf38d9c2UL,
+		0x38a0c50dUL, 0x21bbf44cUL, 0x0a96a78fUL, 0x138d96ceUL,
+		0x5ccc0009UL, 0x45d73148UL, 0x6efa628bUL, 0x77e153caUL,
+		0xbabb5d54UL, 0xa3a06c15UL, 0x888d3fd6UL, 0x91960e97UL,
+		0xded79850UL, 0xc7cca911UL, 0xece1fad2UL, 0xf5facb93UL,
+		0x7262d75cUL, 0x6b79e61dUL, 0x4054b5deUL, 0x594f849fUL,
+		0x160e1258UL, 0x0f152319UL, 0x243870daUL, 0x3d23419bUL,
+		0x65fd6ba7UL, 0x7ce65ae6UL, 0x57cb0925UL, 0x4ed03864UL,
+		0x0191aea3UL, 0x188a9fe2UL, 0x33a7cc21UL, 0x2abcfd60UL,
+		0xad24e1afUL, 0xb43fd0eeUL, 0x9f12832dUL, 0x8609b26cUL,
+		0xc94824abUL, 0xd05315eaUL, 0xfb7e4629UL, 0xe2657768UL,
+		0x2f3f79f6UL, 0x362448b7UL, 0x1d091b74UL, 0x04122a35UL,
+		0x4b53bcf2UL, 0x52488db3UL, 0x7965de70UL, 0x607eef31UL,
+		0xe7e6f3feUL, 0xfefdc2bfUL, 0xd5d0917cUL, 0xcccba03dUL,
+		0x838a36faUL, 0x9a9107bbUL, 0xb1bc5478UL, 0xa8a76539UL,
+		0x3b83984bUL, 0x2298a90aUL, 0x09b5fac9UL, 0x10aecb88UL,
+		0x5fef5d4fUL, 0x46f46c0eUL, 0x6dd93fcdUL, 0x74c20e8cUL,
+		0xf35a1243UL, 0xea412302UL, 0xc16c70c1UL, 0xd8774180UL,
+		0x9736d747UL, 0x8e2de606UL, 0xa500b5c5UL, 0xbc1b8484UL,
+		0x71418a1aUL, 0x685abb5bUL, 0x4377e898UL, 0x5a6cd9d9UL,
+		0x152d4f1eUL, 0x0c367e5fUL, 0x271b2d9cUL, 0x3e001cddUL,
+		0xb9980012UL, 0xa0833153UL, 0x8bae6290UL, 0x92b553d1UL,
+		0xddf4c516UL, 0xc4eff457UL, 0xefc2a794UL, 0xf6d996d5UL,
+		0xae07bce9UL, 0xb71c8da8UL, 0x9c31de6bUL, 0x852aef2aUL,
+		0xca6b79edUL, 0xd37048acUL, 0xf85d1b6fUL, 0xe1462a2eUL,
+		0x66de36e1UL, 0x7fc507a0UL, 0x54e85463UL, 0x4df36522UL,
+		0x02b2f3e5UL, 0x1ba9c2a4UL, 0x30849167UL, 0x299fa026UL,
+		0xe4c5aeb8UL, 0xfdde9ff9UL, 0xd6f3cc3aUL, 0xcfe8fd7bUL,
+		0x80a96bbcUL, 0x99b25afdUL, 0xb29f093eUL, 0xab84387fUL,
+		0x2c1c24b0UL, 0x350715f1UL, 0x1e2a4632UL, 0x07317773UL,
+		0x4870e1b4UL, 0x516bd0f5UL, 0x7a468336UL, 0x635db277UL,
+		0xcbfad74eUL, 0xd2e1e60fUL, 0xf9ccb5ccUL, 0xe0d7848dUL,
+		0xaf96124aUL, 0xb68d230bUL, 0x9da070c8UL, 0x84bb4189UL,
+		0x03235d46UL, 0x1a386c07UL, 0x31153fc4UL, 0x280e0e85UL,
+		0x674f9842UL, 0x7e54a903UL, 0x5579fac0UL, 0x4c62cb81UL,
+		0x8138c51fUL, 0x9823f45eUL, 0xb30ea79dUL, 0xaa1596dcUL,
+		0xe554001bUL, 0xfc4f315aUL, 0xd7626299UL, 0xce7953d8UL,
+		0x49e14f17UL, 0x50fa7e56UL, 0x7bd72d95UL, 0x62cc1cd4UL,
+		0x2d8d8a13UL, 0x3496bb52UL, 0x1fbbe891UL, 0x06a0d9d0UL,
+		0x5e7ef3ecUL, 0x4765c2adUL, 0x6c48916eUL, 0x7553a02fUL,
+		0x3a1236e8UL, 0x230907a9UL, 0x0824546aUL, 0x113f652bUL,
+		0x96a779e4UL, 0x8fbc48a5UL, 0xa4911b66UL, 0xbd8a2a27UL,
+		0xf2cbbce0UL, 0xebd08da1UL, 0xc0fdde62UL, 0xd9e6ef23UL,
+		0x14bce1bdUL, 0x0da7d0fcUL, 0x268a833fUL, 0x3f91b27eUL,
+		0x70d024b9UL, 0x69cb15f8UL, 0x42e6463bUL, 0x5bfd777aUL,
+		0xdc656bb5UL, 0xc57e5af4UL, 0xee530937UL, 0xf7483876UL,
+		0xb809aeb1UL, 0xa1129ff0UL, 0x8a3fcc33UL, 0x9324fd72UL
+	},
+	{
+		0x00000000UL, 0x01c26a37UL, 0x0384d46eUL, 0x0246be59UL,
+		0x0709a8dcUL, 0x06cbc2ebUL, 0x048d7cb2UL, 0x054f1685UL,
+		0x0e1351b8UL, 0x0fd13b8fUL, 0x0d9785d6UL, 0x0c55efe1UL,
+		0x091af964UL, 0x08d89353UL, 0x0a9e2d0aUL, 0x0b5c473dUL,
+		0x1c26a370UL, 0x1de4c947UL, 0x1fa2771eUL, 0x1e601d29UL,
+		0x1b2f0bacUL, 0x1aed619bUL, 0x18abdfc2UL, 0x1969b5f5UL,
+		0x1235f2c8UL, 0x13f798ffUL, 0x11b126a6UL, 0x10734c91UL,
+		0x153c5a14UL, 0x14fe3023UL, 0x16b88e7aUL, 0x177ae44dUL,
+		0x384d46e0UL, 0x398f2cd7UL, 0x3bc9928eUL, 0x3a0bf8b9UL,
+		0x3f44ee3cUL, 0x3e86840bUL, 0x3cc03a52UL, 0x3d025065UL,
+		0x365e1758UL, 0x379c7d6fUL, 0x35dac336UL, 0x3418a901UL,
+		0x3157bf84UL, 0x3095d5b3UL, 0x32d36beaUL, 0x331101ddUL,
+		0x246be590UL, 0x25a98fa7UL, 0x27ef31feUL, 0x262d5bc9UL,
+		0x23624d4cUL, 0x22a0277bUL, 0x20e69922UL, 0x2124f315UL,
+		0x2a78b428UL, 0x2bbade1fUL, 0x29fc6046UL, 0x283e0a71UL,
+		0x2d711cf4UL, 0x2cb376c3UL, 0x2ef5c89aUL, 0x2f37a2adUL,
+		0x709a8dc0UL, 0x7158e7f7UL, 0x731e59aeUL, 0x72dc3399UL,
+		0x7793251cUL, 0x76514f2bUL, 0x7417f172UL, 0x75d59b45UL,
+		0x7e89dc78UL, 0x7f4bb64fUL, 0x7d0d0816UL, 0x7ccf6221UL,
+		0x798074a4UL, 0x78421e93UL, 0x7a04a0caUL, 0x7bc6cafdUL,
+		0x6cbc2eb0UL, 0x6d7e4487UL, 0x6f38fadeUL, 0x6efa90e9UL,
+		0x6bb5866cUL, 0x6a77ec5bUL, 0x68315202UL, 0x69f33835UL,
+		0x62af7f08UL, 0x636d153fUL, 0x612bab66UL, 0x60e9c151UL,
+		0x65a6d7d4UL, 0x6464bde3UL, 0x662203baUL, 0x67e0698dUL,
+		0x48d7cb20UL, 0x4915a117UL, 0x4b531f4eUL, 0x4a917579UL,
+		0x4fde63fcUL, 0x4e1c09cbUL, 0x4c5ab792UL, 0x4d98dda5UL,
+		0x46c49a98UL, 0x4706f0afUL, 0x45404ef6UL, 0x448224c1UL,
+		0x41cd3244UL, 0x400f5873UL, 0x4249e62aUL, 0x438b8c1dUL,
+		0x54f16850UL, 0x55330267UL, 0x5775bc3eUL, 0x56b7d609UL,
+		0x53f8c08cUL, 0x523aaabbUL, 0x507c14e2UL, 0x51be7ed5UL,
+		0x5ae239e8UL, 0x5b2053dfUL, 0x5966ed86UL, 0x58a487b1UL,
+		0x5deb9134UL, 0x5c29fb03UL, 0x5e6f455aUL, 0x5fad2f6dUL,
+		0xe1351b80UL, 0xe0f771b7UL, 0xe2b1cfeeUL, 0xe373a5d9UL,
+		0xe63cb35cUL, 0xe7fed96bUL, 0xe5b86732UL, 0xe47a0d05UL,
+		0xef264a38UL, 0xeee4200fUL, 0xeca29e56UL, 0xed60f461UL,
+		0xe82fe2e4UL, 0xe9ed88d3UL, 0xebab368aUL, 0xea695cbdUL,
+		0xfd13b8f0UL, 0xfcd1d2c7UL, 0xfe976c9eUL, 0xff5506a9UL,
+		0xfa1a102cUL, 0xfbd87a1bUL, 0xf99ec442UL, 0xf85cae75UL,
+		0xf300e948UL, 0xf2c2837fUL, 0xf0843d26UL, 0xf1465711UL,
+		0xf4094194UL, 0xf5cb2ba3UL, 0xf78d95faUL, 0xf64fffcdUL,
+		0xd9785d60UL, 0xd8ba3757UL, 0xdafc890eUL, 0xdb3ee339UL,
+		0xde71f5bcUL, 0xdfb39f8bUL, 0xddf521d2UL, 0xdc374be5UL,
+		0xd76b0cd8UL, 0xd6a966efUL, 0xd4efd8b6UL, 0xd52db281UL,
+		0xd062a404UL, 0xd1a0ce33UL, 0xd3e6706aUL, 0xd2241a5dUL,
+		0xc55efe10UL, 0xc49c9427UL, 0xc6da2a7eUL, 0xc7184049UL,
+		0xc25756ccUL, 0xc3953cfbUL, 0xc1d382a2UL, 0xc011e895UL,
+		0xcb4dafa8UL, 0xca8fc59fUL, 0xc8c97bc6UL, 0xc90b11f1UL,
+		0xcc440774UL, 0xcd866d43UL, 0xcfc0d31aUL, 0xce02b92dUL,
+		0x91af9640UL, 0x906dfc77UL, 0x922b422eUL, 0x93e92819UL,
+		0x96a63e9cUL, 0x976454abUL, 0x9522eaf2UL, 0x94e080c5UL,
+		0x9fbcc7f8UL, 0x9e7eadcfUL, 0x9c381396UL, 0x9dfa79a1UL,
+		0x98b56f24UL, 0x99770513UL, 0x9b31bb4aUL, 0x9af3d17dUL,
+		0x8d893530UL, 0x8c4b5f07UL, 0x8e0de15eUL, 0x8fcf8b69UL,
+		0x8a809decUL, 0x8b42f7dbUL, 0x89044982UL, 0x88c623b5UL,
+		0x839a6488UL, 0x82580ebfUL, 0x801eb0e6UL, 0x81dcdad1UL,
+		0x8493cc54UL, 0x8551a663UL, 0x8717183aUL, 0x86d5720dUL,
+		0xa9e2d0a0UL, 0xa820ba97UL, 0xaa6604ceUL, 0xaba46ef9UL,
+		0xaeeb787cUL, 0xaf29124bUL, 0xad6fac12UL, 0xacadc625UL,
+		0xa7f18118UL, 0xa633eb2fUL, 0xa4755576UL, 0xa5b73f41UL,
+		0xa0f829c4UL, 0xa13a43f3UL, 0xa37cfdaaUL, 0xa2be979dUL,
+		0xb5c473d0UL, 0xb40619e7UL, 0xb640a7beUL, 0xb782cd89UL,
+		0xb2cddb0cUL, 0xb30fb13bUL, 0xb1490f62UL, 0xb08b6555UL,
+		0xbbd72268UL, 0xba15485fUL, 0xb853f606UL, 0xb9919c31UL,
+		0xbcde8ab4UL, 0xbd1ce083UL, 0xbf5a5edaUL, 0xbe9834edUL
+	},
+	{
+		0x00000000UL, 0xb8bc6765UL, 0xaa09c88bUL, 0x12b5afeeUL,
+		0x8f629757UL, 0x37def032UL, 0x256b5fdcUL, 0x9dd738b9UL,
+		0xc5b428efUL, 0x7d084f8aUL, 0x6fbde064UL, 0xd7018701UL,
+		0x4ad6bfb8UL, 0xf26ad8ddUL, 0xe0df7733UL, 0x58631056UL,
+		0x5019579fUL, 0xe8a530faUL, 0xfa109f14UL, 0x42acf871UL,
+		0xdf7bc0c8UL, 0x67c7a7adUL, 0x75720843UL, 0xcdce6f26UL,
+		0x95ad7f70UL, 0x2d111815UL, 0x3fa4b7fbUL, 0x8718d09eUL,
+		0x1acfe827UL, 0xa2738f42UL, 0xb0c620acUL, 0x087a47c9UL,
+		0xa032af3eUL, 0x188ec85bUL, 0x0a3b67b5UL, 0xb28700d0UL,
+		0x2f503869UL, 0x97ec5f0cUL, 0x8559f0e2UL, 0x3de59787UL,
+		0x658687d1UL, 0xdd3ae0b4UL, 0xcf8f4f5aUL, 0x7733283fUL,
+		0xeae41086UL, 0x525877e3UL, 0x40edd80dUL, 0xf851bf68UL,
+		0xf02bf8a1UL, 0x48979fc4UL, 0x5a22302aUL, 0xe29e574fUL,
+		0x7f496ff6UL, 0xc7f50893UL, 0xd540a77dUL, 0x6dfcc018UL,
+		0x359fd04eUL, 0x8d23b72bUL, 0x9f9618c5UL, 0x272a7fa0UL,
+		0xbafd4719UL, 0x0241207cUL, 0x10f48f92UL, 0xa848e8f7UL,
+		0x9b14583dUL, 0x23a83f58UL, 0x311d90b6UL, 0x89a1f7d3UL,
+		0x1476cf6aUL, 0xaccaa80fUL, 0xbe7f07e1UL, 0x06c36084UL,
+		0x5ea070d2UL, 0xe61c17b7UL, 0xf4a9b859UL, 0x4c15df3cUL,
+		0xd1c2e785UL, 0x697e80e0UL, 0x7bcb2f0eUL, 0xc377486bUL,
+		0xcb0d0fa2UL, 0x73b168c7UL, 0x6104c729UL, 0xd9b8a04cUL,
+		0x446f98f5UL, 0xfcd3ff90UL, 0xee66507eUL, 0x56da371bUL,
+		0x0eb9274dUL, 0xb6054028UL, 0xa4b0efc6UL, 0x1c0c88a3UL,
+		0x81dbb01aUL, 0x3967d77fUL, 0x2bd27891UL, 0x936e1ff4UL,
+		0x3b26f703UL, 0x839a9066UL, 0x912f3f88UL, 0x299358edUL,
+		0xb4446054UL, 0x0cf80731UL, 0x1e4da8dfUL, 0xa6f1cfbaUL,
+		0xfe92dfecUL, 0x462eb889UL, 0x549b1767UL, 0xec277002UL,
+		0x71f048bbUL, 0xc94c2fdeUL, 0xdbf98030UL, 0x6345e755UL,
+		0x6b3fa09cUL, 0xd383c7f9UL, 0xc1366817UL, 0x798a0f72UL,
+		0xe45d37cbUL, 0x5ce150aeUL, 0x4e54ff40UL, 0xf6e89825UL,
+		0xae8b8873UL, 0x1637ef16UL, 0x048240f8UL, 0xbc3e279dUL,
+		0x21e91f24UL, 0x99557841UL, 0x8be0d7afUL, 0x335cb0caUL,
+		0xed59b63bUL, 0x55e5d15eUL, 0x47507eb0UL, 0xffec19d5UL,
+		0x623b216cUL, 0xda874609UL, 0xc832e9e7UL, 0x708e8e82UL,
+		0x28ed9ed4UL, 0x9051f9b1UL, 0x82e4565fUL, 0x3a58313aUL,
+		0xa78f0983UL, 0x1f336ee6UL, 0x0d86c108UL, 0xb53aa66dUL,
+		0xbd40e1a4UL, 0x05fc86c1UL, 0x1749292fUL, 0xaff54e4aUL,
+		0x322276f3UL, 0x8a9e1196UL, 0x982bbe78UL, 0x2097d91dUL,
+		0x78f4c94bUL, 0xc048ae2eUL, 0xd2fd01c0UL, 0x6a4166a5UL,
+		0xf7965e1cUL, 0x4f2a3979UL, 0x5d9f9697UL, 0xe523f1f2UL,
+		0x4d6b1905UL, 0xf5d77e60UL, 0xe762d18eUL, 0x5fdeb6ebUL,
+		0xc2098e52UL, 0x7ab5e937UL, 0x680046d9UL, 0xd0bc21bcUL,
+		0x88df31eaUL, 0x3063568fUL, 0x22d6f961UL, 0x9a6a9e04UL,
+		0x07bda6bdUL, 0xbf01c1d8UL, 0xadb46e36UL, 0x15080953UL,
+		0x1d724e9aUL, 0xa5ce29ffUL, 0xb77b8611UL, 0x0fc7e174UL,
+		0x9210d9cdUL, 0x2aacbea8UL, 0x38191146UL, 0x80a57623UL,
+		0xd8c66675UL, 0x607a0110UL, 0x72cfaefeUL, 0xca73c99bUL,
+		0x57a4f122UL, 0xef189647UL, 0xfdad39a9UL, 0x45115eccUL,
+		0x764dee06UL, 0xcef18963UL, 0xdc44268dUL, 0x64f841e8UL,
+		0xf92f7951UL, 0x41931e34UL, 0x5326b1daUL, 0xeb9ad6bfUL,
+		0xb3f9c6e9UL, 0x0b45a18cUL, 0x19f00e62UL, 0xa14c6907UL,
+		0x3c9b51beUL, 0x842736dbUL, 0x96929935UL, 0x2e2efe50UL,
+		0x2654b999UL, 0x9ee8defcUL, 0x8c5d7112UL, 0x34e11677UL,
+		0xa9362eceUL, 0x118a49abUL, 0x033fe645UL, 0xbb838120UL,
+		0xe3e09176UL, 0x5b5cf613UL, 0x49e959fdUL, 0xf1553e98UL,
+		0x6c820621UL, 0xd43e6144UL, 0xc68bceaaUL, 0x7e37a9cfUL,
+		0xd67f4138UL, 0x6ec3265dUL, 0x7c7689b3UL, 0xc4caeed6UL,
+		0x591dd66fUL, 0xe1a1b10aUL, 0xf3141ee4UL, 0x4ba87981UL,
+		0x13cb69d7UL, 0xab770eb2UL, 0xb9c2a15cUL, 0x017ec639UL,
+		0x9ca9fe80UL, 0x241599e5UL, 0x36a0360bUL, 0x8e1c516eUL,
+		0x866616a7UL, 0x3eda71c2UL, 0x2c6fde2cUL, 0x94d3b949UL,
+		0x090481f0UL, 0xb1b8e695UL, 0xa30d497bUL, 0x1bb12e1eUL,
+		0x43d23e48UL, 0xfb6e592dUL, 0xe9dbf6c3UL, 0x516791a6UL,
+		0xccb0a91fUL, 0x740cce7aUL, 0x66b96194UL, 0xde0506f1UL
+	},
+	{
+		0x00000000UL, 0x3d6029b0UL, 0x7ac05360UL, 0x47a07ad0UL,
+		0xf580a6c0UL, 0xc8e08f70UL, 0x8f40f5a0UL, 0xb220dc10UL,
+		0x30704bc1UL, 0x0d106271UL, 0x4ab018a1UL, 0x77d03111UL,
+		0xc5f0ed01UL, 0xf890c4b1UL, 0xbf30be61UL, 0x825097d1UL,
+		0x60e09782UL, 0x5d80be32UL, 0x1a20c4e2UL, 0x2740ed52UL,
+		0x95603142UL, 0xa80018f2UL, 0xefa06222UL, 0xd2c04b92UL,
+		0x5090dc43UL, 0x6df0f5f3UL, 0x2a508f23UL, 0x1730a693UL,
+		0xa5107a83UL, 0x98705333UL, 0xdfd029e3UL, 0xe2b00053UL,
+		0xc1c12f04UL, 0xfca106b4UL, 0xbb017c64UL, 0x866155d4UL,
+		0x344189c4UL, 0x0921a074UL, 0x4e81daa4UL, 0x73e1f314UL,
+		0xf1b164c5UL, 0xccd14d75UL, 0x8b7137a5UL, 0xb6111e15UL,
+		0x0431c205UL, 0x3951ebb5UL, 0x7ef19165UL, 0x4391b8d5UL,
+		0xa121b886UL, 0x9c419136UL, 0xdbe1ebe6UL, 0xe681c256UL,
+		0x54a11e46UL, 0x69c137f6UL, 0x2e614d26UL, 0x13016496UL,
+		0x9151f347UL, 0xac31daf7UL, 0xeb91a027UL, 0xd6f18997UL,
+		0x64d15587UL, 0x59b17c37UL, 0x1e1106e7UL, 0x23712f57UL,
+		0x58f35849UL, 0x659371f9UL, 0x22330b29UL, 0x1f532299UL,
+		0xad73fe89UL, 0x9013d739UL, 0xd7b3ade9UL, 0xead38459UL,
+		0x68831388UL, 0x55e33a38UL, 0x124340e8UL, 0x2f236958UL,
+		0x9d03b548UL, 0xa0639cf8UL, 0xe7c3e628UL, 0xdaa3cf98UL,
+		0x3813cfcbUL, 0x0573e67bUL, 0x42d39cabUL, 0x7fb3b51bUL,
+		0xcd93690bUL, 0xf0f340bbUL, 0xb7533a6bUL, 0x8a3313dbUL,
+		0x0863840aUL, 0x3503adbaUL, 0x72a3d76aUL, 0x4fc3fedaUL,
+		0xfde322caUL, 0xc0830b7aUL, 0x872371aaUL, 0xba43581aUL,
+		0x9932774dUL, 0xa4525efdUL, 0xe3f2242dUL, 0xde920d9dUL,
+		0x6cb2d18dUL, 0x51d2f83dUL, 0x167282edUL, 0x2b12ab5dUL,
+		0xa9423c8cUL, 0x9422153cUL, 0xd3826fecUL, 0xeee2465cUL,
+		0x5cc29a4cUL, 0x61a2b3fcUL, 0x2602c92cUL, 0x1b62e09cUL,
+		0xf9d2e0cfUL, 0xc4b2c97fUL, 0x8312b3afUL, 0xbe729a1fUL,
+		0x0c52460fUL, 0x31326fbfUL, 0x7692156fUL, 0x4bf23cdfUL,
+		0xc9a2ab0eUL, 0xf4c282beUL, 0xb362f86eUL, 0x8e02d1deUL,
+		0x3c220dceUL, 0x0142247eUL, 0x46e25eaeUL, 0x7b82771eUL,
+		0xb1e6b092UL, 0x8c869922UL, 0xcb26e3f2UL, 0xf646ca42UL,
+		0x44661652UL, 0x79063fe2UL, 0x3ea64532UL, 0x03c66c82UL,
+		0x8196fb53UL, 0xbcf6d2e3UL, 0xfb56a833UL, 0xc6368183UL,
+		0x74165d93UL, 0x49767423UL, 0x0ed60ef3UL, 0x33b62743UL,
+		0xd1062710UL, 0xec660ea0UL, 0xabc67470UL, 0x96a65dc0UL,
+		0x248681d0UL, 0x19e6a860UL, 0x5e46d2b0UL, 0x6326fb00UL,
+		0xe1766cd1UL, 0xdc164561UL, 0x9bb63fb1UL, 0xa6d61601UL,
+		0x14f6ca11UL, 0x2996e3a1UL, 0x6e369971UL, 0x5356b0c1UL,
+		0x70279f96UL, 0x4d47b626UL, 0x0ae7ccf6UL, 0x3787e546UL,
+		0x85a73956UL, 0xb8c710e6UL, 0xff676a36UL, 0xc2074386UL,
+		0x4057d457UL, 0x7d37fde7UL, 0x3a978737UL, 0x07f7ae87UL,
+		0xb5d77297UL, 0x88b75b27UL, 0xcf1721f7UL, 0xf2770847UL,
+		0x10c70814UL, 0x2da721a4UL, 0x6a075b74UL, 0x576772c4UL,
+		0xe547aed4UL, 0xd8278764UL, 0x9f87fdb4UL, 0xa2e7d404UL,
+		0x20b743d5UL, 0x1dd76a65UL, 0x5a7710b5UL, 0x67173905UL,
+		0xd537e515UL, 0xe857cca5UL, 0xaff7b675UL, 0x92979fc5UL,
+		0xe915e8dbUL, 0xd475c16bUL, 0x93d5bbbbUL, 0xaeb5920bUL,
+		0x1c954e1bUL, 0x21f567abUL, 0x66551d7bUL, 0x5b3534cbUL,
+		0xd965a31aUL, 0xe4058aaaUL, 0xa3a5f07aUL, 0x9ec5d9caUL,
+		0x2ce505daUL, 0x11852c6aUL, 0x562556baUL, 0x6b457f0aUL,
+		0x89f57f59UL, 0xb49556e9UL, 0xf3352c39UL, 0xce550589UL,
+		0x7c75d999UL, 0x4115f029UL, 0x06b58af9UL, 0x3bd5a349UL,
+		0xb9853498UL, 0x84e51d28UL, 0xc34567f8UL, 0xfe254e48UL,
+		0x4c059258UL, 0x7165bbe8UL, 0x36c5c138UL, 0x0ba5e888UL,
+		0x28d4c7dfUL, 0x15b4ee6fUL, 0x521494bfUL, 0x6f74bd0fUL,
+		0xdd54611fUL, 0xe03448afUL, 0xa794327fUL, 0x9af41bcfUL,
+		0x18a48c1eUL, 0x25c4a5aeUL, 0x6264df7eUL, 0x5f04f6ceUL,
+		0xed242adeUL, 0xd044036eUL, 0x97e479beUL, 0xaa84500eUL,
+		0x4834505dUL, 0x755479edUL, 0x32f4033dUL, 0x0f942a8dUL,
+		0xbdb4f69dUL, 0x80d4df2dUL, 0xc774a5fdUL, 0xfa148c4dUL,
+		0x78441b9cUL, 0x4524322cUL, 0x028448fcUL, 0x3fe4614cUL,
+		0x8dc4bd5cUL, 0xb0a494ecUL, 0xf704ee3cUL, 0xca64c78cUL
+	},
+	{
+		0x00000000UL, 0xcb5cd3a5UL, 0x4dc8a10bUL, 0x869472aeUL,
+		0x9b914216UL, 0x50cd91b3UL, 0xd659e31dUL, 0x1d0530b8UL,
+		0xec53826dUL, 0x270f51c8UL, 0xa19b2366UL, 0x6ac7f0c3UL,
+		0x77c2c07bUL, 0xbc9e13deUL, 0x3a0a6170UL, 0xf156b2d5UL,
+		0x03d6029bUL, 0xc88ad13eUL, 0x4e1ea390UL, 0x85427035UL,
+		0x9847408dUL, 0x531b9328UL, 0xd58fe186UL, 0x1ed33223UL,
+		0xef8580f6UL, 0x24d95353UL, 0xa24d21fdUL, 0x6911f258UL,
+		0x7414c2e0UL, 0xbf481145UL, 0x39dc63ebUL, 0xf280b04eUL,
+		0x07ac0536UL, 0xccf0d693UL, 0x4a64a43dUL, 0x81387798UL,
+		0x9c3d4720UL, 0x57619485UL, 0xd1f5e62bUL, 0x1aa9358eUL,
+		0xebff875bUL, 0x20a354feUL, 0xa6372650UL, 0x6d6bf5f5UL,
+		0x706ec54dUL, 0xbb3216e8UL, 0x3da66446UL, 0xf6fab7e3UL,
+		0x047a07adUL, 0xcf26d408UL, 0x49b2a6a6UL, 0x82ee7503UL,
+		0x9feb45bbUL, 0x54b7961eUL, 0xd223e4b0UL, 0x197f3715UL,
+		0xe82985c0UL, 0x23755665UL, 0xa5e124cbUL, 0x6ebdf76eUL,
+		0x73b8c7d6UL, 0xb8e41473UL, 0x3e7066ddUL, 0xf52cb578UL,
+		0x0f580a6cUL, 0xc404d9c9UL, 0x4290ab67UL, 0x89cc78c2UL,
+		0x94c9487aUL, 0x5f959bdfUL, 0xd901e971UL, 0x125d3ad4UL,
+		0xe30b8801UL, 0x28575ba4UL, 0xaec3290aUL, 0x659ffaafUL,
+		0x789aca17UL, 0xb3c619b2UL, 0x35526b1cUL, 0xfe0eb8b9UL,
+		0x0c8e08f7UL, 0xc7d2db52UL, 0x4146a9fcUL, 0x8a1a7a59UL,
+		0x971f4ae1UL, 0x5c439944UL, 0xdad7ebeaUL, 0x118b384fUL,
+		0xe0dd8a9aUL, 0x2b81593fUL, 0xad152b91UL, 0x6649f834UL,
+		0x7b4cc88cUL, 0xb0101b29UL, 0x36846987UL, 0xfdd8ba22UL,
+		0x08f40f5aUL, 0xc3a8dcffUL, 0x453cae51UL, 0x8e607df4UL,
+		0x93654d4cUL, 0x58399ee9UL, 0xdeadec47UL, 0x15f13fe2UL,
+		0xe4a78d37UL, 0x2ffb5e92UL, 0xa96f2c3cUL, 0x6233ff99UL,
+		0x7f36cf21UL, 0xb46a1c84UL, 0x32fe6e2aUL, 0xf9a2bd8fUL,
+		0x0b220dc1UL, 0xc07ede64UL, 0x46eaaccaUL, 0x8db67f6fUL,
+		0x90b34fd7UL, 0x5bef9c72UL, 0xdd7beedcUL, 0x16273d79UL,
+		0xe7718facUL, 0x2c2d5c09UL, 0xaab92ea7UL, 0x61e5fd02UL,
+		0x7ce0cdbaUL, 0xb7bc1e1fUL, 0x31286cb1UL, 0xfa74bf14UL,
+		0x1eb014d8UL, 0xd5ecc77dUL, 0x5378b5d3UL, 0x98246676UL,
+		0x852156ceUL, 0x4e7d856bUL, 0xc8e9f7c5UL, 0x03b52460UL,
+		0xf2e396b5UL, 0x39bf4510UL, 0xbf2b37beUL, 0x7477e41bUL,
+		0x6972d4a3UL, 0xa22e0706UL, 0x24ba75a8UL, 0xefe6a60dUL,
+		0x1d661643UL, 0xd63ac5e6UL, 0x50aeb748UL, 0x9bf264edUL,
+		0x86f75455UL, 0x4dab87f0UL, 0xcb3ff55eUL, 0x006326fbUL,
+		0xf135942eUL, 0x3a69478bUL, 0xbcfd3525UL, 0x77a1e680UL,
+		0x6aa4d638UL, 0xa1f8059dUL, 0x276c7733UL, 0xec30a496UL,
+		0x191c11eeUL, 0xd240c24bUL, 0x54d4b0e5UL, 0x9f886340UL,
+		0x828d53f8UL, 0x49d1805dUL, 0xcf45f2f3UL, 0x04192156UL,
+		0xf54f9383UL, 0x3e134026UL, 0xb8873288UL, 0x73dbe12dUL,
+		0x6eded195UL, 0xa5820230UL, 0x2316709eUL, 0xe84aa33bUL,
+		0x1aca1375UL, 0xd196c0d0UL, 0x5702b27eUL, 0x9c5e61dbUL,
+		0x815b5163UL, 0x4a0782c6UL, 0xcc93f068UL, 0x07cf23cdUL,
+		0xf6999118UL, 0x3dc542bdUL, 0xbb513013UL, 0x700de3b6UL,
+		0x6d08d30eUL, 0xa65400abUL, 0x20c07205UL, 0xeb9ca1a0UL,
+		0x11e81eb4UL, 0xdab4cd11UL, 0x5c20bfbfUL, 0x977c6c1aUL,
+		0x8a795ca2UL, 0x41258f07UL, 0xc7b1fda9UL, 0x0ced2e0cUL,
+		0xfdbb9cd9UL, 0x36e74f7cUL, 0xb0733dd2UL, 0x7b2fee77UL,
+		0x662adecfUL, 0xad760d6aUL, 0x2be27fc4UL, 0xe0beac61UL,
+		0x123e1c2fUL, 0xd962cf8aUL, 0x5ff6bd24UL, 0x94aa6e81UL,
+		0x89af5e39UL, 0x42f38d9cUL, 0xc467ff32UL, 0x0f3b2c97UL,
+		0xfe6d9e42UL, 0x35314de7UL, 0xb3a53f49UL, 0x78f9ececUL,
+		0x65fcdc54UL, 0xaea00ff1UL, 0x28347d5fUL, 0xe368aefaUL,
+		0x16441b82UL, 0xdd18c827UL, 0x5b8cba89UL, 0x90d0692cUL,
+		0x8dd55994UL, 0x46898a31UL, 0xc01df89fUL, 0x0b412b3aUL,
+		0xfa1799efUL, 0x314b4a4aUL, 0xb7df38e4UL, 0x7c83eb41UL,
+		0x6186dbf9UL, 0xaada085cUL, 0x2c4e7af2UL, 0xe712a957UL,
+		0x15921919UL, 0xdececabcUL, 0x585ab812UL, 0x93066bb7UL,
+		0x8e035b0fUL, 0x455f88aaUL, 0xc3cbfa04UL, 0x089729a1UL,
+		0xf9c19b74UL, 0x329d48d1UL, 0xb4093a7fUL, 0x7f55e9daUL,
+		0x6250d962UL, 0xa90c0ac7UL, 0x2f987869UL, 0xe4c4abccUL
+	},
+	{
+		0x00000000UL, 0xa6770bb4UL, 0x979f1129UL, 0x31e81a9dUL,
+		0xf44f2413UL, 0x52382fa7UL, 0x63d0353aUL, 0xc5a73e8eUL,
+		0x33ef4e67UL, 0x959845d3UL, 0xa4705f4eUL, 0x020754faUL,
+		0xc7a06a74UL, 0x61d761c0UL, 0x503f7b5dUL, 0xf64870e9UL,
+		0x67de9cceUL, 0xc1a9977aUL, 0xf0418de7UL, 0x56368653UL,
+		0x9391b8ddUL, 0x35e6b369UL, 0x040ea9f4UL, 0xa279a240UL,
+		0x5431d2a9UL, 0xf246d91dUL, 0xc3aec380UL, 0x65d9c834UL,
+		0xa07ef6baUL, 0x0609fd0eUL, 0x37e1e793UL, 0x9196ec27UL,
+		0xcfbd399cUL, 0x69ca3228UL, 0x582228b5UL, 0xfe552301UL,
+		0x3bf21d8fUL, 0x9d85163bUL, 0xac6d0ca6UL, 0x0a1a0712UL,
+		0xfc5277fbUL, 0x5a257c4fUL, 0x6bcd66d2UL, 0xcdba6d66UL,
+		0x081d53e8UL, 0xae6a585cUL, 0x9f8242c1UL, 0x39f54975UL,
+		0xa863a552UL, 0x0e14aee6UL, 0x3ffcb47bUL, 0x998bbfcfUL,
+		0x5c2c8141UL, 0xfa5b8af5UL, 0xcbb39068UL, 0x6dc49bdcUL,
+		0x9b8ceb35UL, 0x3dfbe081UL, 0x0c13fa1cUL, 0xaa64f1a8UL,
+		0x6fc3cf26UL, 0xc9b4c492UL, 0xf85cde0fUL, 0x5e2bd5bbUL,
+		0x440b7579UL, 0xe27c7ecdUL, 0xd3946450UL, 0x75e36fe4UL,
+		0xb044516aUL, 0x16335adeUL, 0x27db4043UL, 0x81ac4bf7UL,
+		0x77e43b1eUL, 0xd19330aaUL, 0xe07b2a37UL, 0x460c2183UL,
+		0x83ab1f0dUL, 0x25dc14b9UL, 0x14340e24UL, 0xb2430590UL,
+		0x23d5e9b7UL, 0x85a2e203UL, 0xb44af89eUL, 0x123df32aUL,
+		0xd79acda4UL, 0x71edc610UL, 0x4005dc8dUL, 0xe672d739UL,
+		0x103aa7d0UL, 0xb64dac64UL, 0x87a5b6f9UL, 0x21d2bd4dUL,
+		0xe47583c3UL, 0x42028877UL, 0x73ea92eaUL, 0xd59d995eUL,
+		0x8bb64ce5UL, 0x2dc14751UL, 0x1c295dccUL, 0xba5e5678UL,
+		0x7ff968f6UL, 0xd98e6342UL, 0xe86679dfUL, 0x4e11726bUL,
+		0xb8590282UL, 0x1e2e0936UL, 0x2fc613abUL, 0x89b1181fUL,
+		0x4c162691UL, 0xea612d25UL, 0xdb8937b8UL, 0x7dfe3c0cUL,
+		0xec68d02bUL, 0x4a1fdb9fUL, 0x7bf7c102UL, 0xdd80cab6UL,
+		0x1827f438UL, 0xbe50ff8cUL, 0x8fb8e511UL, 0x29cfeea5UL,
+		0xdf879e4cUL, 0x79f095f8UL, 0x48188f65UL, 0xee6f84d1UL,
+		0x2bc8ba5fUL, 0x8dbfb1ebUL, 0xbc57ab76UL, 0x1a20a0c2UL,
+		0x8816eaf2UL, 0x2e61e146UL, 0x1f89fbdbUL, 0xb9fef06fUL,
+		0x7c59cee1UL, 0xda2ec555UL, 0xebc6dfc8UL, 0x4db1d47cUL,
+		0xbbf9a495UL, 0x1d8eaf21UL, 0x2c66b5bcUL, 0x8a11be08UL,
+		0x4fb68086UL, 0xe9c18b32UL, 0xd82991afUL, 0x7e5e9a1bUL,
+		0xefc8763cUL, 0x49bf7d88UL, 0x78576715UL, 0xde206ca1UL,
+		0x1b87522fUL, 0xbdf0599bUL, 0x8c184306UL, 0x2a6f48b2UL,
+		0xdc27385bUL, 0x7a5033efUL, 0x4bb82972UL, 0xedcf22c6UL,
+		0x28681c48UL, 0x8e1f17fcUL, 0xbff70d61UL, 0x198006d5UL,
+		0x47abd36eUL, 0xe1dcd8daUL, 0xd034c247UL, 0x7643c9f3UL,
+		0xb3e4f77dUL, 0x1593fcc9UL, 0x247be654UL, 0x820cede0UL,
+		0x74449d09UL, 0xd23396bdUL, 0xe3db8c20UL, 0x45ac8794UL,
+		0x800bb91aUL, 0x267cb2aeUL, 0x1794a833UL, 0xb1e3a387UL,
+		0x20754fa0UL, 0x86024414UL, 0xb7ea5e89UL, 0x119d553dUL,
+		0xd43a6bb3UL, 0x724d6007UL, 0x43a57a9aUL, 0xe5d2712eUL,
+		0x139a01c7UL, 0xb5ed0a73UL, 0x840510eeUL, 0x22721b5aUL,
+		0xe7d525d4UL, 0x41a22e60UL, 0x704a34fdUL, 0xd63d3f49UL,
+		0xcc1d9f8bUL, 0x6a6a943fUL, 0x5b828ea2UL, 0xfdf58516UL,
+		0x3852bb98UL, 0x9e25b02cUL, 0xafcdaab1UL, 0x09baa105UL,
+		0xfff2d1ecUL, 0x5985da58UL, 0x686dc0c5UL, 0xce1acb71UL,
+		0x0bbdf5ffUL, 0xadcafe4bUL, 0x9c22e4d6UL, 0x3a55ef62UL,
+		0xabc30345UL, 0x0db408f1UL, 0x3c5c126cUL, 0x9a2b19d8UL,
+		0x5f8c2756UL, 0xf9fb2ce2UL, 0xc813367fUL, 0x6e643dcbUL,
+		0x982c4d22UL, 0x3e5b4696UL, 0x0fb35c0bUL, 0xa9c457bfUL,
+		0x6c636931UL, 0xca146285UL, 0xfbfc7818UL, 0x5d8b73acUL,
+		0x03a0a617UL, 0xa5d7ada3UL, 0x943fb73eUL, 0x3248bc8aUL,
+		0xf7ef8204UL, 0x519889b0UL, 0x6070932dUL, 0xc6079899UL,
+		0x304fe870UL, 0x9638e3c4UL, 0xa7d0f959UL, 0x01a7f2edUL,
+		0xc400cc63UL, 0x6277c7d7UL, 0x539fdd4aUL, 0xf5e8d6feUL,
+		0x647e3ad9UL, 0xc209316dUL, 0xf3e12bf0UL, 0x55962044UL,
+		0x90311ecaUL, 0x3646157eUL, 0x07ae0fe3UL, 0xa1d90457UL,
+		0x579174beUL, 0xf1e67f0aUL, 0xc00e6597UL, 0x66796e23UL,
+		0xa3de50adUL, 0x05a95b19UL, 0x34414184UL, 0x92364a30UL
+	},
+	{
+		0x00000000UL, 0xccaa009eUL, 0x4225077dUL, 0x8e8f07e3UL,
+		0x844a0efaUL, 0x48e00e64UL, 0xc66f0987UL, 0x0ac50919UL,
+		0xd3e51bb5UL, 0x1f4f1b2bUL, 0x91c01cc8UL, 0x5d6a1c56UL,
+		0x57af154fUL, 0x9b0515d1UL, 0x158a1232UL, 0xd92012acUL,
+		0x7cbb312bUL, 0xb01131b5UL, 0x3e9e3656UL, 0xf23436c8UL,
+		0xf8f13fd1UL, 0x345b3f4fUL, 0xbad438acUL, 0x767e3832UL,
+		0xaf5e2a9eUL, 0x63f42a00UL, 0xed7b2de3UL, 0x21d12d7dUL,
+		0x2b142464UL, 0xe7be24faUL, 0x69312319UL, 0xa59b2387UL,
+		0xf9766256UL, 0x35dc62c8UL, 0xbb53652bUL, 0x77f965b5UL,
+		0x7d3c6cacUL, 0xb1966c32UL, 0x3f196bd1UL, 0xf3b36b4fUL,
+		0x2a9379e3UL, 0xe639797dUL, 0x68b67e9eUL, 0xa41c7e00UL,
+		0xaed97719UL, 0x62737787UL, 0xecfc7064UL, 0x205670faUL,
+		0x85cd537dUL, 0x496753e3UL, 0xc7e85400UL, 0x0b42549eUL,
+		0x01875d87UL, 0xcd2d5d19UL, 0x43a25afaUL, 0x8f085a64UL,
+		0x562848c8UL, 0x9a824856UL, 0x140d4fb5UL, 0xd8a74f2bUL,
+		0xd2624632UL, 0x1ec846acUL, 0x9047414fUL, 0x5ced41d1UL,
+		0x299dc2edUL, 0xe537c273UL, 0x6bb8c590UL, 0xa712c50eUL,
+		0xadd7cc17UL, 0x617dcc89UL, 0xeff2cb6aUL, 0x2358cbf4UL,
+		0xfa78d958UL, 0x36d2d9c6UL, 0xb85dde25UL, 0x74f7debbUL,
+		0x7e32d7a2UL, 0xb298d73cUL, 0x3c17d0dfUL, 0xf0bdd041UL,
+		0x5526f3c6UL, 0x998cf358UL, 0x1703f4bbUL, 0xdba9f425UL,
+		0xd16cfd3cUL, 0x1dc6fda2UL, 0x9349fa41UL, 0x5fe3fadfUL,
+		0x86c3e873UL, 0x4a69e8edUL, 0xc4e6ef0eUL, 0x084cef90UL,
+		0x0289e689UL, 0xce23e617UL, 0x40ace1f4UL, 0x8c06e16aUL,
+		0xd0eba0bbUL, 0x1c41a025UL, 0x92cea7c6UL, 0x5e64a758UL,
+		0x54a1ae41UL, 0x980baedfUL, 0x1684a93cUL, 0xda2ea9a2UL,
+		0x030ebb0eUL, 0xcfa4bb90UL, 0x412bbc73UL, 0x8d81bcedUL,
+		0x8744b5f4UL, 0x4beeb56aUL, 0xc561b289UL, 0x09cbb217UL,
+		0xac509190UL, 0x60fa910eUL, 0xee7596edUL, 0x22df9673UL,
+		0x281a9f6aUL, 0xe4b09ff4UL, 0x6a3f9817UL, 0xa6959889UL,
+		0x7fb58a25UL, 0xb31f8abbUL, 0x3d908d58UL, 0xf13a8dc6UL,
+		0xfbff84dfUL, 0x37558441UL, 0xb9da83a2UL, 0x7570833cUL,
+		0x533b85daUL, 0x9f918544UL, 0x111e82a7UL, 0xddb48239UL,
+		0xd7718b20UL, 0x1bdb8bbeUL, 0x95548c5dUL, 0x59fe8cc3UL,
+		0x80de9e6fUL, 0x4c749ef1UL, 0xc2fb9912UL, 0x0e51998cUL,
+		0x04949095UL, 0xc83e900bUL, 0x46b197e8UL, 0x8a1b9776UL,
+		0x2f80b4f1UL, 0xe32ab46fUL, 0x6da5b38cUL, 0xa10fb312UL,
+		0xabcaba0bUL, 0x6760ba95UL, 0xe9efbd76UL, 0x2545bde8UL,
+		0xfc65af44UL, 0x30cfafdaUL, 0xbe40a839UL, 0x72eaa8a7UL,
+		0x782fa1beUL, 0xb485a120UL, 0x3a0aa6c3UL, 0xf6a0a65dUL,
+		0xaa4de78cUL, 0x66e7e712UL, 0xe868e0f1UL, 0x24c2e06fUL,
+		0x2e07e976UL, 0xe2ade9e8UL, 0x6c22ee0bUL, 0xa088ee95UL,
+		0x79a8fc39UL, 0xb502fca7UL, 0x3b8dfb44UL, 0xf727fbdaUL,
+		0xfde2f2c3UL, 0x3148f25dUL, 0xbfc7f5beUL, 0x736df520UL,
+		0xd6f6d6a7UL, 0x1a5cd639UL, 0x94d3d1daUL, 0x5879d144UL,
+		0x52bcd85dUL, 0x9e16d8c3UL, 0x1099df20UL, 0xdc33dfbeUL,
+		0x0513cd12UL, 0xc9b9cd8cUL, 0x4736ca6fUL, 0x8b9ccaf1UL,
+		0x8159c3e8UL, 0x4df3c376UL, 0xc37cc495UL, 0x0fd6c40bUL,
+		0x7aa64737UL, 0xb60c47a9UL, 0x3883404aUL, 0xf42940d4UL,
+		0xfeec49cdUL, 0x32464953UL, 0xbcc94eb0UL, 0x70634e2eUL,
+		0xa9435c82UL, 0x65e95c1cUL, 0xeb665bffUL, 0x27cc5b61UL,
+		0x2d095278UL, 0xe1a352e6UL, 0x6f2c5505UL, 0xa386559bUL,
+		0x061d761cUL, 0xcab77682UL, 0x44387161UL, 0x889271ffUL,
+		0x825778e6UL, 0x4efd7878UL, 0xc0727f9bUL, 0x0cd87f05UL,
+		0xd5f86da9UL, 0x19526d37UL, 0x97dd6ad4UL, 0x5b776a4aUL,
+		0x51b26353UL, 0x9d1863cdUL, 0x1397642eUL, 0xdf3d64b0UL,
+		0x83d02561UL, 0x4f7a25ffUL, 0xc1f5221cUL, 0x0d5f2282UL,
+		0x079a2b9bUL, 0xcb302b05UL, 0x45bf2ce6UL, 0x89152c78UL,
+		0x50353ed4UL, 0x9c9f3e4aUL, 0x121039a9UL, 0xdeba3937UL,
+		0xd47f302eUL, 0x18d530b0UL, 0x965a3753UL, 0x5af037cdUL,
+		0xff6b144aUL, 0x33c114d4UL, 0xbd4e1337UL, 0x71e413a9UL,
+		0x7b211ab0UL, 0xb78b1a2eUL, 0x39041dcdUL, 0xf5ae1d53UL,
+		0x2c8e0fffUL, 0xe0240f61UL, 0x6eab0882UL, 0xa201081cUL,
+		0xa8c40105UL, 0x646e019bUL, 0xeae10678UL, 0x264b06e6UL
+	}
+};
+
+/*
+ * Continues the CRC-32 (as used by zlib, PNG and the crc32 utility) of a
+ * stream with n more bytes. Start with a crc of 0. Eight bytes are folded in
+ * per step, loaded one at a time so that the result does not depend on byte
+ * order or alignment.
+ */
+unsigned long
+pcips_crc32(unsigned long crc, const unsigned char *data, size_t n)
+{
+	crc = ~crc & 0xffffffffUL;
+
+	while (n >= 8)
+	{
+		crc ^= (unsigned long) data[0]
+			| (unsigned long) data[1] << 8
+			| (unsigned long) data[2] << 16
+			| (unsigned long) data[3] << 24;
+
+		crc = crc_table[7][crc & 0xff]
+			^ crc_table[6][(crc >> 8) & 0xff]
+			^ crc_table[5][(crc >> 16) & 0xff]
+			^ crc_table[4][crc >> 24]
+			^ crc_table[3][data[4]]
+			^ crc_table[2][data[5]]
+			^ crc_table[1][data[6]]
+			^ crc_table[0][data[7]];
+
+		data += 8;
+		n -= 8;
+	}
+
+	while (n-- > 0)
+		crc = crc_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+	return ~crc & 0xffffffffUL;
+}
+
+/* Continues a CRC-32 with n copies of value. */
+unsigned long
+pcips_crc32_run(unsigned long crc, int value, long n)
+{
+	unsigned char buf[RUN_BUFFER_SIZE];
+	size_t chunk;
+
+	memset(buf, value, n < RUN_BUFFER_SIZE ? n : RUN_BUFFER_SIZE);
+	while (n > 0)
+	{
+		chunk = n < RUN_BUFFER_SIZE ? n : RUN_BUFFER_SIZE;
+		crc = pcips_crc32(crc, buf, chunk);
+		n -= chunk;
+	}
+
+	return crc;
+}
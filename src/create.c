@@ -29,18 +29,30 @@
  *  THE USE OF OR OTHER DEALINGS IN THE WORK.
  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "bps.h"
 #include "common.h"
 #include "create.h"
+#include "encode.h"
 #include "err.h"
+#include "format.h"
+#include "index.h"
+#include "map.h"
+#include "scan.h"
+#include "sink.h"
+#include "stats.h"
 
 #define RLE_TRADEOFF_SIZE (HEADER_SIZE + RLE_RECORD_SIZE)
+#define MIN_RANGE_SIZE 65536L
 
 struct ips_record
 {
+	const struct pcips_format *fmt;
+	struct pcips_stats *stats;
 	long offset;
 	unsigned int size;
 	unsigned int rle_size;
@@ -48,55 +60,59 @@ struct ips_record
 	int rle_data;
 };
 
-static int
-write_record(FILE *f, const struct ips_record *rec)
+struct span_list
 {
-	long offset;
-	unsigned int size;
-	unsigned char header[HEADER_SIZE];
-
-	offset = rec->offset;
-	header[0] = (offset & 0xFF0000L) >> 16;
-	header[1] = (offset & 0x00FF00L) >> 8;
-	header[2] = (offset & 0x0000FFL);
-
-	size = rec->size;
-	header[3] = (size & 0xFF00) >> 8;
-	header[4] = (size & 0x00FF);
-
-	if (fwrite(header, sizeof header, 1, f) != 1)
-		return PCIPS_EIO;
+	struct pcips_span *spans;
+	long count;
+	long cap;
+};
 
-	if (0 == size) /* RLE record */
-	{
-		unsigned char rle[RLE_EXTENSION];
+struct diff_cursor
+{
+	const unsigned char *src;
+	long src_length;
+	const unsigned char *mod;
+	long mod_length;
+	long start;
+	long end;
+	const struct span_list *list;
+	long next;
+	const struct pcips_index *index;
+	struct pcips_stats *stats;
+};
 
-		size = rec->rle_size;
-		rle[0] = (size & 0xFF00) >> 8;
-		rle[1] = (size & 0x00FF);
-		rle[2] = rec->rle_data;
+struct diff_worker
+{
+	pthread_t thread;
+	const struct diff_cursor *cur;
+	long lo;
+	long hi;
+	struct span_list list;
+	long compared;
+	int started;
+	int rc;
+};
 
-		if (fwrite(rle, sizeof rle, 1, f) != 1)
-			return PCIPS_EIO;
-	}
-	else
-	{
-		if (fwrite(rec->data, sizeof rec->data[0], size, f) != size)
-			return PCIPS_EIO;
-	}
+static int
+write_record(struct pcips_sink *out, const struct ips_record *rec)
+{
+	if (0 == rec->size) /* RLE record */
+		return pcips_write_rle(out, rec->fmt, rec->offset,
+				rec->rle_data, rec->rle_size, rec->stats);
 
-	return 0;
+	return pcips_write_plain(out, rec->fmt, rec->offset, rec->data,
+			rec->size, rec->stats);
 }
 
 static int
-commit_non_rle_portion(FILE *f, struct ips_record *rec)
+commit_non_rle_portion(struct pcips_sink *out, struct ips_record *rec)
 {
 	int rc = 0;
 
 	if (rec->size != rec->rle_size)
 	{
 		rec->size -= rec->rle_size;
-		rc = write_record(f, rec);
+		rc = write_record(out, rec);
 		rec->offset += rec->size;
 	}
 
@@ -104,9 +120,9 @@ commit_non_rle_portion(FILE *f, struct ips_record *rec)
 }
 
 static int
-strip_to_rle(FILE *f, struct ips_record *rec)
+strip_to_rle(struct pcips_sink *out, struct ips_record *rec)
 {
-	int rc = commit_non_rle_portion(f, rec);
+	int rc = commit_non_rle_portion(out, rec);
 
 	if (!rc)
 	{
@@ -118,14 +134,14 @@ strip_to_rle(FILE *f, struct ips_record *rec)
 }
 
 static int
-bail_to_rle(FILE *f, struct ips_record *rec)
+bail_to_rle(struct pcips_sink *out, struct ips_record *rec)
 {
-	int rc = commit_non_rle_portion(f, rec);
+	int rc = commit_non_rle_portion(out, rec);
 
 	if (!rc)
 	{
 		rec->size = 0;
-		rc = write_record(f, rec);
+		rc = write_record(out, rec);
 
 		rec->offset += rec->rle_size;
 	}
@@ -133,44 +149,260 @@ bail_to_rle(FILE *f, struct ips_record *rec)
 	return rc;
 }
 
-int
-pcips_create_patch(FILE *src, FILE *modified, FILE *patch, long src_length)
+static int
+add_span(struct span_list *list, long start, long end)
 {
-	int rc = 0, c, src_c, mod_c, in_patch = 0;
-	long pos = 0;
-	unsigned char src_look_ahead[HEADER_SIZE], mod_look_ahead[HEADER_SIZE];
-	struct ips_record rec;
+	struct pcips_span *tmp;
 
-	rewind(src);
-	rewind(modified);
+	if (list->count && list->spans[list->count - 1].end == start)
+	{
+		list->spans[list->count - 1].end = end;
+		return 0;
+	}
 
-	rec.data = malloc(IPS_MAX_RECORD);
-	if (!rec.data)
+	if (list->count == list->cap)
+	{
+		list->cap = list->cap ? list->cap * 2 : 64;
+		tmp = realloc(list->spans, list->cap * sizeof *tmp);
+		if (!tmp)
+			return PCIPS_ENOMEM;
+
+		list->spans = tmp;
+	}
+
+	list->spans[list->count].start = start;
+	list->spans[list->count].end = end;
+	++list->count;
+	return 0;
+}
+
+static int
+scan_range(struct diff_worker *w, long pos, long hi)
+{
+	const unsigned char *src = w->cur->src, *mod = w->cur->mod;
+	long end;
+
+	w->compared += hi - pos;
+	while (pos < hi)
+	{
+		pos += pcips_mismatch(src + pos, mod + pos, hi - pos);
+		if (pos == hi)
+			break;
+
+		end = pos + pcips_match(src + pos, mod + pos, hi - pos);
+		if (add_span(&w->list, pos, end) != 0)
+			return PCIPS_ENOMEM;
+
+		pos = end;
+	}
+
+	return 0;
+}
+
+static void *
+find_spans(void *arg)
+{
+	struct diff_worker *w = arg;
+	const struct pcips_index *idx = w->cur->index;
+	long pos, end;
+
+	if (!idx)
+	{
+		w->rc = scan_range(w, w->lo, w->hi);
+		return NULL;
+	}
+
+	/* blocks that hash the same as the source's are left unread there */
+	for (pos = w->lo; !w->rc && pos < w->hi; pos = end)
+	{
+		end = pos - pos % idx->block_size + idx->block_size;
+		if (end > w->hi)
+			end = w->hi;
+
+		if (!pcips_index_match(idx, pos, w->cur->mod + pos, end - pos))
+			w->rc = scan_range(w, pos, end);
+	}
+
+	return NULL;
+}
+
+/*
+ * Splits the compared region into one range per thread and collects the runs
+ * of differing bytes in each range concurrently. The per-range lists are then
+ * stitched together in order, merging runs that meet at a range boundary, so
+ * the result is exactly what a serial scan would find.
+ */
+static int
+collect_spans(struct span_list *out, const struct diff_cursor *cur,
+	int threads)
+{
+	int i, rc = 0;
+	long j, common, range;
+	struct diff_worker *workers;
+
+	common = cur->src_length < cur->mod_length
+		? cur->src_length : cur->mod_length;
+
+	range = (common + threads - 1) / threads;
+	if (range < MIN_RANGE_SIZE)
+		range = MIN_RANGE_SIZE;
+
+	/* ranges start on a block, so each block is checked as a whole */
+	if (cur->index)
+		range += (cur->index->block_size
+			- range % cur->index->block_size)
+			% cur->index->block_size;
+
+	threads = (common + range - 1) / range;
+
+	workers = calloc(threads ? threads : 1, sizeof *workers);
+	if (!workers)
 		return PCIPS_ENOMEM;
 
-	c = fputs(IPS_HEADER, patch);
-	if (EOF == c)
+	for (i = 0; i < threads; ++i)
 	{
-		rc = PCIPS_EIO;
-		goto end;
+		workers[i].cur = cur;
+		workers[i].lo = i * range;
+		workers[i].hi = i * range + range;
+		if (workers[i].hi > common)
+			workers[i].hi = common;
+
+		if (i > 0)
+			workers[i].started = !pthread_create(&workers[i].thread,
+							NULL, find_spans, &workers[i]);
 	}
 
-	while ((mod_c = fgetc(modified)) != EOF)
+	if (threads)
+		find_spans(&workers[0]);
+
+	for (i = 0; i < threads; ++i)
 	{
-		int match = 0;
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+		else if (i > 0)
+			find_spans(&workers[i]);
+
+		if (!rc)
+			rc = workers[i].rc;
+
+		PCIPS_STAT_ADD(cur->stats, bytes_compared,
+			workers[i].compared);
 
-		if (pos < src_length)
+		for (j = 0; !rc && j < workers[i].list.count; ++j)
 		{
-			src_c = fgetc(src);
-			if (EOF == src_c)
-			{
-				rc = PCIPS_EIO;
-				goto end;
-			}
+			rc = add_span(out, workers[i].list.spans[j].start,
+				workers[i].list.spans[j].end);
+		}
+
+		free(workers[i].list.spans);
+	}
+
+	if (!rc && cur->mod_length > common)
+		rc = add_span(out, common, cur->mod_length);
+
+	free(workers);
+	return rc;
+}
+
+/*
+ * Locates the run of differing bytes that contains or follows pos. Bytes past
+ * the end of the source always differ.
+ */
+static void
+find_span(struct diff_cursor *cur, long pos)
+{
+	long common, from = pos;
+
+	if (cur->list)
+	{
+		while (cur->next < cur->list->count
+			&& cur->list->spans[cur->next].end <= pos)
+			++cur->next;
+
+		if (cur->next < cur->list->count)
+		{
+			cur->start = cur->list->spans[cur->next].start;
+			cur->end = cur->list->spans[cur->next].end;
+		}
+		else
+		{
+			cur->start = cur->end = cur->mod_length;
+		}
+
+		return;
+	}
+
+	common = cur->src_length < cur->mod_length
+		? cur->src_length : cur->mod_length;
+
+	if (pos < common)
+	{
+		pos += pcips_mismatch(cur->src + pos, cur->mod + pos,
+				common - pos);
+	}
+
+	cur->start = pos;
+	if (pos < common)
+		cur->end = pos + pcips_match(cur->src + pos, cur->mod + pos,
+					common - pos);
+	else
+		cur->end = cur->mod_length;
+
+	if (from < common)
+		PCIPS_STAT_ADD(cur->stats, bytes_compared,
+			(cur->end < common ? cur->end : common) - from);
+
+	if (cur->end == common)
+		cur->end = cur->mod_length;
+}
+
+static int
+differs(struct diff_cursor *cur, long pos)
+{
+	if (pos >= cur->end)
+		find_span(cur, pos);
+
+	return pos >= cur->start;
+}
+
+/*
+ * The original greedy encoder. It walks the modified file one byte at a time
+ * while a record is open, using a short look-ahead to decide whether to
+ * bridge small unchanged gaps or to split runs into RLE records, and skips
+ * directly from one difference to the next otherwise.
+ */
+static int
+encode_greedy(struct pcips_sink *patch, const struct pcips_format *fmt,
+	struct diff_cursor *cur)
+{
+	int rc = 0, mod_c, in_patch = 0;
+	long pos = 0;
+	const unsigned char *src_look_ahead, *mod_look_ahead;
+	struct ips_record rec;
+
+	rec.fmt = fmt;
+	rec.stats = cur->stats;
+	rec.data = malloc(IPS_MAX_RECORD);
+	if (!rec.data)
+		return PCIPS_ENOMEM;
+
+	while (pos < cur->mod_length)
+	{
+		int match;
+
+		if (!in_patch)
+		{
+			/* skip straight to the next difference */
+			if (!differs(cur, pos))
+				pos = cur->start;
 
-			match = mod_c == src_c;
+			if (pos >= cur->mod_length)
+				break;
 		}
 
+		mod_c = cur->mod[pos];
+		match = !differs(cur, pos);
+
 		if (!match)
 		{
 			if (!in_patch)
@@ -238,10 +470,16 @@ pcips_create_patch(FILE *src, FILE *modified, FILE *patch, long src_length)
 				else
 					limit = 0;
 
-				mod_count = fread(mod_look_ahead, 1, limit,
-						modified);
-				src_count = fread(src_look_ahead, 1, limit,
-						src);
+				mod_count = limit;
+				if (cur->mod_length - pos - 1 < mod_count)
+					mod_count = cur->mod_length - pos - 1;
+
+				src_count = limit;
+				if (cur->src_length - pos - 1 < src_count)
+					src_count = cur->src_length - pos - 1;
+
+				mod_look_ahead = cur->mod + pos + 1;
+				src_look_ahead = cur->src + pos + 1;
 
 				n = src_count < mod_count ? src_count : mod_count;
 				rpt = 1;
@@ -254,6 +492,10 @@ pcips_create_patch(FILE *src, FILE *modified, FILE *patch, long src_length)
 						break;
 				}
 
+				PCIPS_STAT_ADD(cur->stats, seeks, 1);
+				PCIPS_STAT_ADD(cur->stats, bytes_compared,
+					i < n ? i + 1 : n);
+
 				/* will it cost more to start a new record? */
 				if ((!rpt || mod_c != rec.rle_data)
 					&& rec.rle_size > RLE_TRADEOFF_SIZE)
@@ -266,10 +508,6 @@ pcips_create_patch(FILE *src, FILE *modified, FILE *patch, long src_length)
 					rec.rle_data = -1;
 
 					pos += i;
-					fseek(src, i - src_count, SEEK_CUR);
-					fseek(modified, i - mod_count,
-						SEEK_CUR);
-
 					in_patch = 0;
 				}
 				else if (i != n || n < mod_count)
@@ -299,11 +537,11 @@ pcips_create_patch(FILE *src, FILE *modified, FILE *patch, long src_length)
 						mod_look_ahead, i + 1);
 					rec.size += i + 1;
 
+					/* unchanged bytes bridging two runs */
+					PCIPS_STAT_ADD(cur->stats,
+						padding_bytes, i + 1);
+
 					pos += i + 1;
-					fseek(src, i - src_count + 1,
-						SEEK_CUR);
-					fseek(modified, i - mod_count + 1,
-						SEEK_CUR);
 				}
 				else
 				{
@@ -335,16 +573,149 @@ pcips_create_patch(FILE *src, FILE *modified, FILE *patch, long src_length)
 			rc = bail_to_rle(patch, &rec);
 		else
 			rc = write_record(patch, &rec);
+	}
+
+end:
+	free(rec.data);
+	return rc;
+}
+
+/*
+ * Writes a patch that turns the src_length bytes at src into the mod_length
+ * bytes at mod. Nothing is kept between calls, so any number of threads may
+ * create patches at once. opts may be NULL to use the defaults.
+ */
+int
+pcips_create_buffer(const unsigned char *src, long src_length,
+	const unsigned char *mod, long mod_length, struct pcips_sink *patch,
+	const struct pcips_create_options *opts)
+{
+	int rc = 0;
+	long i, changed = 0, payload = 0;
+	const struct pcips_format *fmt = &pcips_ips;
+	struct pcips_stats *stats = opts ? opts->stats : NULL;
+	struct pcips_timer timer;
+	struct diff_cursor cur;
+	struct span_list spans;
+
+	if (opts && opts->format)
+		fmt = opts->format;
+
+	pcips_stats_begin(stats, &timer);
+	if (opts && opts->bps)
+	{
+		rc = pcips_bps_create(patch, src, src_length, mod, mod_length);
+		pcips_stats_end(stats, &timer, PCIPS_PHASE_DIFF);
+		return rc ? rc : pcips_sink_check(patch);
+	}
+
+	if (mod_length > fmt->max_offset)
+		return PCIPS_EFILE;
+
+	cur.src = src;
+	cur.src_length = src_length;
+	cur.mod = mod;
+	cur.mod_length = mod_length;
+	cur.start = cur.end = 0;
+	cur.list = NULL;
+	cur.next = 0;
+	cur.stats = stats;
 
+	/* an index of some other length does not describe src */
+	cur.index = opts && opts->index && opts->index->length == src_length
+		? opts->index : NULL;
+
+	spans.spans = NULL;
+	spans.count = spans.cap = 0;
+
+	if (opts && (opts->threads > 1 || opts->optimal || cur.index))
+	{
+		rc = collect_spans(&spans, &cur,
+				opts->threads > 1 ? opts->threads : 1);
 		if (rc)
 			goto end;
+
+		cur.list = &spans;
+	}
+
+	rc = pcips_sink_write(patch, fmt->header, FILE_HEADER_SIZE);
+	if (rc)
+		goto end;
+
+	if (opts && opts->optimal)
+	{
+		pcips_stats_end(stats, &timer, PCIPS_PHASE_DIFF);
+		pcips_stats_begin(stats, &timer);
+		if (stats)
+			payload = stats->payload_bytes;
+
+		rc = pcips_encode_spans(patch, fmt, cur.mod, 0, spans.spans,
+					spans.count, stats);
+		pcips_stats_end(stats, &timer, PCIPS_PHASE_WRITE);
+
+		/* whatever the records hold beyond the spans is unchanged */
+		for (i = 0; stats && i < spans.count; ++i)
+			changed += spans.spans[i].end - spans.spans[i].start;
+
+		PCIPS_STAT_ADD(stats, padding_bytes,
+			stats->payload_bytes - payload - changed);
+	}
+	else
+	{
+		/* the greedy encoder writes records as it finds them */
+		rc = encode_greedy(patch, fmt, &cur);
+		pcips_stats_end(stats, &timer, PCIPS_PHASE_DIFF);
 	}
 
-	c = fputs(IPS_FOOTER, patch);
-	if (EOF == c)
-		rc = PCIPS_EIO;
+	if (!rc)
+		rc = pcips_sink_write(patch, fmt->footer, fmt->footer_size);
+
+	if (!rc)
+		rc = pcips_sink_check(patch);
 
 end:
-	free(rec.data);
+	free(spans.spans);
+	return rc;
+}
+
+int
+pcips_create_patch(FILE *src, FILE *modified, FILE *patch, long src_length,
+	const struct pcips_create_options *opts)
+{
+	int rc;
+	struct pcips_map src_map, mod_map;
+	struct pcips_sink sink;
+	struct pcips_stats *stats = opts ? opts->stats : NULL;
+	struct pcips_timer timer;
+	unsigned char buf[PCIPS_SINK_BUFFER_SIZE];
+
+	rc = pcips_map_file(&src_map, src);
+	if (rc)
+		return rc;
+
+	rc = pcips_map_file(&mod_map, modified);
+	if (rc)
+	{
+		pcips_unmap(&src_map);
+		return rc;
+	}
+
+	/* BPS records the whole source, so only IPS is held to src_length */
+	if (src_map.length < src_length || (opts && opts->bps))
+		src_length = src_map.length;
+
+	pcips_sink_stream(&sink, patch, buf, sizeof buf, stats);
+	rc = pcips_create_buffer(src_map.data, src_length, mod_map.data,
+		mod_map.length, &sink, opts);
+
+	if (!rc)
+	{
+		pcips_stats_begin(stats, &timer);
+		rc = pcips_sink_flush(&sink);
+		pcips_stats_end(stats, &timer, PCIPS_PHASE_WRITE);
+	}
+
+	pcips_unmap(&mod_map);
+	pcips_unmap(&src_map);
 	return rc;
 }
@@ -34,7 +34,28 @@
 
 #include <stdio.h>
 
+#include "format.h"
+#include "index.h"
+#include "sink.h"
+#include "stats.h"
+
+struct pcips_create_options
+{
+	int threads;
+	int optimal;
+	const struct pcips_format *format;
+	int bps;
+	const struct pcips_index *index;
+	struct pcips_stats *stats;
+};
+
+int
+pcips_create_buffer(const unsigned char *src, long src_length,
+	const unsigned char *mod, long mod_length, struct pcips_sink *patch,
+	const struct pcips_create_options *opts);
+
 int
-pcips_create_patch(FILE *src, FILE *modified, FILE *patch, long src_length);
+pcips_create_patch(FILE *src, FILE *modified, FILE *patch, long src_length,
+	const struct pcips_create_options *opts);
 
 #endif
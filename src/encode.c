@@ -0,0 +1,346 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "encode.h"
+#include "err.h"
+#include "format.h"
+#include "sink.h"
+
+/* number of recent DP states that a record can reach back to */
+#define WINDOW_SIZE (IPS_MAX_RECORD + 1L)
+
+enum choice
+{
+	CHOICE_SKIP,
+	CHOICE_PLAIN,
+	CHOICE_RLE
+};
+
+struct encoder
+{
+	const struct pcips_format *fmt;
+	struct pcips_stats *stats;
+	long *cost;
+	long *queue;
+	unsigned char *must;
+	unsigned char *choice;
+	unsigned short *length;
+	long cap;
+};
+
+int
+pcips_write_plain(struct pcips_sink *out, const struct pcips_format *fmt,
+	long offset, const unsigned char *data, unsigned int size,
+	struct pcips_stats *stats)
+{
+	int rc;
+	unsigned char header[IPS32_OFFSET_SIZE + IPS_SIZE_SIZE];
+
+	pcips_format_put_offset(fmt, header, offset);
+	header[fmt->offset_size] = (size & 0xFF00) >> 8;
+	header[fmt->offset_size + 1] = (size & 0x00FF);
+
+	rc = pcips_sink_write(out, header, RECORD_HEADER_SIZE(fmt));
+	if (!rc)
+		rc = pcips_sink_write(out, data, size);
+
+	if (rc)
+		return rc;
+
+	PCIPS_STAT_ADD(stats, plain_written, 1);
+	PCIPS_STAT_ADD(stats, payload_bytes, size);
+	return 0;
+}
+
+int
+pcips_write_rle(struct pcips_sink *out, const struct pcips_format *fmt,
+	long offset, int value, unsigned int count, struct pcips_stats *stats)
+{
+	int rc;
+	unsigned char record[IPS32_OFFSET_SIZE + RLE_EXTENSION
+		+ IPS_SIZE_SIZE];
+	unsigned char *p = record + fmt->offset_size;
+
+	pcips_format_put_offset(fmt, record, offset);
+	p[0] = 0;
+	p[1] = 0;
+	p[2] = (count & 0xFF00) >> 8;
+	p[3] = (count & 0x00FF);
+	p[4] = value;
+
+	rc = pcips_sink_write(out, record, RLE_SIZE(fmt));
+	if (rc)
+		return rc;
+
+	PCIPS_STAT_ADD(stats, rle_written, 1);
+	PCIPS_STAT_ADD(stats, payload_bytes, count);
+	return 0;
+}
+
+static int
+reserve(struct encoder *enc, long n)
+{
+	void *tmp;
+
+	if (n <= enc->cap)
+		return 0;
+
+	tmp = realloc(enc->must, n);
+	if (!tmp)
+		return PCIPS_ENOMEM;
+	enc->must = tmp;
+
+	tmp = realloc(enc->choice, n + 1);
+	if (!tmp)
+		return PCIPS_ENOMEM;
+	enc->choice = tmp;
+
+	tmp = realloc(enc->length, (n + 1) * sizeof enc->length[0]);
+	if (!tmp)
+		return PCIPS_ENOMEM;
+	enc->length = tmp;
+
+	enc->cap = n;
+	return 0;
+}
+
+/*
+ * Emits the records chosen for a cluster of n bytes. The choices are walked
+ * backwards from the end, so the end of each record is collected first and
+ * the records are then written front to back.
+ */
+static int
+emit(struct pcips_sink *out, const struct encoder *enc,
+	const unsigned char *data, long offset, long n)
+{
+	int rc = 0;
+	long i, k, len, *ends, count = 0, total;
+
+	for (i = n; i > 0; i -= len)
+	{
+		len = CHOICE_SKIP == enc->choice[i] ? 1 : enc->length[i];
+		if (enc->choice[i] != CHOICE_SKIP)
+			++count;
+	}
+
+	ends = malloc((count ? count : 1) * sizeof *ends);
+	if (!ends)
+		return PCIPS_ENOMEM;
+
+	total = count;
+	for (i = n; i > 0; i -= len)
+	{
+		len = CHOICE_SKIP == enc->choice[i] ? 1 : enc->length[i];
+		if (enc->choice[i] != CHOICE_SKIP)
+			ends[--count] = i;
+	}
+
+	for (k = 0; !rc && k < total; ++k)
+	{
+		i = ends[k];
+		len = enc->length[i];
+
+		if (CHOICE_RLE == enc->choice[i])
+			rc = pcips_write_rle(out, enc->fmt, offset + i - len,
+					data[i - len], len, enc->stats);
+		else
+			rc = pcips_write_plain(out, enc->fmt, offset + i - len,
+					data + i - len, len, enc->stats);
+	}
+
+	free(ends);
+	return rc;
+}
+
+/*
+ * Chooses the cheapest set of records that covers every byte marked in
+ * enc->must for the n bytes of data starting at offset, then writes them.
+ *
+ * cost[i] is the smallest patch size that covers the marked bytes in [0, i)
+ * using records that end at or before i. It never decreases with i, since any
+ * covering of [0, i + 1) can be cut at i without growing. A plain record
+ * [j, i) costs cost[j] + h + (i - j), where h is the size of a record header
+ * (5 bytes in IPS, 6 in IPS32), so the best j is the minimum of cost[j] - j
+ * over the last 65535 positions, kept in a monotonic queue. An RLE record
+ * [j, i) costs cost[j] + h + 3 and requires data[j, i) to be a single
+ * repeated byte, so the best j is simply the earliest one allowed. Bytes that
+ * are not marked may be skipped for free. Each step is O(1), so the whole
+ * cluster is encoded in O(n) time and the result is optimal under the IPS
+ * size model.
+ */
+static int
+encode_cluster(struct pcips_sink *out, struct encoder *enc,
+	const unsigned char *data, long offset, long n)
+{
+	long i, j, c, run = 0, head = 0, tail = 0;
+	long *cost = enc->cost, *queue = enc->queue;
+	long header_size = RECORD_HEADER_SIZE(enc->fmt);
+	long rle_size = RLE_SIZE(enc->fmt);
+
+	cost[0] = 0;
+	for (i = 1; i <= n; ++i)
+	{
+		/* admit j = i - 1 as a plain record start */
+		j = i - 1;
+		c = cost[j % WINDOW_SIZE] - j;
+		while (tail > head
+			&& cost[queue[(tail - 1) % WINDOW_SIZE] % WINDOW_SIZE]
+				- queue[(tail - 1) % WINDOW_SIZE] >= c)
+			--tail;
+		queue[tail++ % WINDOW_SIZE] = j;
+
+		if (head < tail && queue[head % WINDOW_SIZE] < i - IPS_MAX_RECORD)
+			++head;
+
+		if (i > 1 && data[i - 1] == data[i - 2])
+			++run;
+		else
+			run = 1;
+
+		if (enc->must[i - 1])
+		{
+			j = queue[head % WINDOW_SIZE];
+			c = cost[j % WINDOW_SIZE] + header_size + (i - j);
+			enc->choice[i] = CHOICE_PLAIN;
+			enc->length[i] = i - j;
+		}
+		else
+		{
+			c = cost[(i - 1) % WINDOW_SIZE];
+			enc->choice[i] = CHOICE_SKIP;
+		}
+
+		j = i - (run < IPS_MAX_RECORD ? run : IPS_MAX_RECORD);
+		if (cost[j % WINDOW_SIZE] + rle_size < c)
+		{
+			c = cost[j % WINDOW_SIZE] + rle_size;
+			enc->choice[i] = CHOICE_RLE;
+			enc->length[i] = i - j;
+		}
+
+		cost[i % WINDOW_SIZE] = c;
+	}
+
+	return emit(out, enc, data, offset, n);
+}
+
+/*
+ * A gap of unchanged bytes between two spans can be dropped from the search
+ * when no optimal patch would cover it: that is, when it is long enough that
+ * splitting a plain record around it costs nothing, and a single RLE record
+ * could not cover it together with its neighbours.
+ */
+static int
+can_split(const struct pcips_format *fmt, const unsigned char *data,
+	long base, long gap_start, long gap_end)
+{
+	long i;
+
+	if (gap_end - gap_start < RECORD_HEADER_SIZE(fmt))
+		return 0;
+
+	for (i = gap_start - 1; i < gap_end; ++i)
+	{
+		if (data[i - base] != data[i + 1 - base])
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the smallest set of records, in format fmt, that changes every byte
+ * in the given spans to its value in data. data[0] holds the byte at offset
+ * base, and the spans must be sorted and must not overlap. Bytes between
+ * spans are known to be unchanged already and are only written when that
+ * makes the patch smaller, for example to bridge two records or to extend an
+ * RLE run.
+ */
+int
+pcips_encode_spans(struct pcips_sink *out, const struct pcips_format *fmt,
+	const unsigned char *data, long base, const struct pcips_span *spans,
+	long count, struct pcips_stats *stats)
+{
+	int rc = 0;
+	long first, last, i, start;
+	struct encoder enc;
+
+	memset(&enc, 0, sizeof enc);
+	enc.fmt = fmt;
+	enc.stats = stats;
+	enc.cost = malloc(WINDOW_SIZE * sizeof enc.cost[0]);
+	enc.queue = malloc(WINDOW_SIZE * sizeof enc.queue[0]);
+	if (!enc.cost || !enc.queue)
+	{
+		rc = PCIPS_ENOMEM;
+		goto end;
+	}
+
+	for (first = 0; first < count; first = last + 1)
+	{
+		for (last = first; last + 1 < count; ++last)
+		{
+			if (can_split(fmt, data, base, spans[last].end,
+					spans[last + 1].start))
+				break;
+		}
+
+		start = spans[first].start;
+		rc = reserve(&enc, spans[last].end - start);
+		if (rc)
+			goto end;
+
+		memset(enc.must, 0, spans[last].end - start);
+		for (i = first; i <= last; ++i)
+		{
+			memset(enc.must + spans[i].start - start, 1,
+				spans[i].end - spans[i].start);
+		}
+
+		rc = encode_cluster(out, &enc, data + start - base, start,
+				spans[last].end - start);
+		if (rc)
+			goto end;
+	}
+
+end:
+	free(enc.cost);
+	free(enc.queue);
+	free(enc.must);
+	free(enc.choice);
+	free(enc.length);
+	return rc;
+}
@@ -51,6 +51,12 @@ pcips_strerror(enum pcips_error error)
 	case PCIPS_EFILE:
 		return "file format error";
 
+	case PCIPS_ECHECKSUM:
+		return "checksum mismatch";
+
+	case PCIPS_ENOSPC:
+		return "output buffer too small";
+
 	default:
 		return "unknown error";
 	}
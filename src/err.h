@@ -38,7 +38,9 @@ enum pcips_error
 	PCIPS_ENOMEM,
 	PCIPS_EARGS,
 	PCIPS_EIO,
-	PCIPS_EFILE
+	PCIPS_EFILE,
+	PCIPS_ECHECKSUM,
+	PCIPS_ENOSPC
 };
 
 const char *
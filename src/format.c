@@ -0,0 +1,73 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <string.h>
+
+#include "format.h"
+
+const struct pcips_format pcips_ips = {
+	IPS_HEADER, IPS_FOOTER, FOOTER_SIZE, IPS_OFFSET_SIZE, IPS_MAX_OFFSET
+};
+
+const struct pcips_format pcips_ips32 = {
+	IPS32_HEADER, IPS32_FOOTER, IPS32_FOOTER_SIZE, IPS32_OFFSET_SIZE,
+	IPS32_MAX_OFFSET
+};
+
+/*
+ * Returns the format whose header is in the first FILE_HEADER_SIZE bytes of
+ * header, or NULL if it is not a patch.
+ */
+const struct pcips_format *
+pcips_format_detect(const unsigned char *header)
+{
+	if (memcmp(header, IPS_HEADER, FILE_HEADER_SIZE) == 0)
+		return &pcips_ips;
+
+	if (memcmp(header, IPS32_HEADER, FILE_HEADER_SIZE) == 0)
+		return &pcips_ips32;
+
+	return NULL;
+}
+
+/* Stores a record offset in big-endian order, as wide as fmt requires. */
+void
+pcips_format_put_offset(const struct pcips_format *fmt, unsigned char *buf,
+	long offset)
+{
+	int i;
+
+	for (i = fmt->offset_size - 1; i >= 0; --i)
+	{
+		buf[i] = offset & 0xFF;
+		offset >>= 8;
+	}
+}
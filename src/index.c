@@ -0,0 +1,211 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "err.h"
+#include "index.h"
+#include "sha256.h"
+
+#define INDEX_MAGIC "PCIDX"
+#define INDEX_MAGIC_SIZE 5
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE (INDEX_MAGIC_SIZE + 1 + 8 + 8 + 4 + 4)
+
+static void
+put_number(unsigned char *p, unsigned long value, int size)
+{
+	while (size--)
+	{
+		p[size] = (unsigned char) value;
+		value >>= 8;
+	}
+}
+
+static unsigned long
+get_number(const unsigned char *p, int size)
+{
+	unsigned long value = 0;
+
+	while (size--)
+		value = value << 8 | *p++;
+
+	return value;
+}
+
+static void
+init(struct pcips_index *idx, long length, long block_size)
+{
+	idx->length = length;
+	idx->block_size = block_size;
+	idx->n_blocks = (length + block_size - 1) / block_size;
+	idx->hashes = NULL;
+}
+
+static void
+set_mtime(struct pcips_index *idx, const struct stat *st)
+{
+	idx->mtime_sec = st->st_mtim.tv_sec;
+	idx->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/*
+ * Hashes the length bytes at data, which hold the contents of base, in
+ * blocks of block_size bytes.
+ */
+int
+pcips_index_build(struct pcips_index *idx, FILE *base,
+	const unsigned char *data, long length, long block_size)
+{
+	long i, n;
+	struct stat st;
+
+	if (block_size < 1 || fstat(fileno(base), &st) != 0)
+		return PCIPS_EARGS;
+
+	init(idx, length, block_size);
+	set_mtime(idx, &st);
+	idx->hashes = malloc(idx->n_blocks * PCIPS_SHA256_SIZE + 1);
+	if (!idx->hashes)
+		return PCIPS_ENOMEM;
+
+	for (i = 0; i < idx->n_blocks; ++i)
+	{
+		n = length - i * block_size;
+		if (n > block_size)
+			n = block_size;
+
+		pcips_sha256(data + i * block_size, n,
+			idx->hashes + i * PCIPS_SHA256_SIZE);
+	}
+
+	return 0;
+}
+
+/*
+ * Reads the index in f, which must describe base as it is now. Returns
+ * PCIPS_EFILE if it does not, so that the caller can build a new one.
+ */
+int
+pcips_index_load(struct pcips_index *idx, FILE *f, FILE *base)
+{
+	unsigned char header[INDEX_HEADER_SIZE];
+	long length, block_size, size;
+	struct stat st;
+
+	if (fstat(fileno(base), &st) != 0)
+		return PCIPS_EIO;
+
+	if (fread(header, 1, sizeof header, f) != sizeof header
+		|| memcmp(header, INDEX_MAGIC, INDEX_MAGIC_SIZE) != 0
+		|| header[INDEX_MAGIC_SIZE] != INDEX_VERSION)
+		return PCIPS_EFILE;
+
+	length = (long) get_number(header + 6, 8);
+	block_size = (long) get_number(header + 26, 4);
+	if (length != st.st_size || block_size < 1
+		|| (long) get_number(header + 14, 8) != st.st_mtim.tv_sec
+		|| (long) get_number(header + 22, 4) != st.st_mtim.tv_nsec)
+		return PCIPS_EFILE;
+
+	init(idx, length, block_size);
+	set_mtime(idx, &st);
+	size = idx->n_blocks * PCIPS_SHA256_SIZE;
+	idx->hashes = malloc(size + 1);
+	if (!idx->hashes)
+		return PCIPS_ENOMEM;
+
+	/* a short or overlong index was not written by us */
+	if (fread(idx->hashes, 1, size + 1, f) != (size_t) size)
+	{
+		pcips_index_free(idx);
+		return PCIPS_EFILE;
+	}
+
+	return 0;
+}
+
+int
+pcips_index_save(const struct pcips_index *idx, FILE *f)
+{
+	unsigned char header[INDEX_HEADER_SIZE];
+
+	memcpy(header, INDEX_MAGIC, INDEX_MAGIC_SIZE);
+	header[INDEX_MAGIC_SIZE] = INDEX_VERSION;
+	put_number(header + 6, idx->length, 8);
+	put_number(header + 14, idx->mtime_sec, 8);
+	put_number(header + 22, idx->mtime_nsec, 4);
+	put_number(header + 26, idx->block_size, 4);
+
+	if (fwrite(header, 1, sizeof header, f) != sizeof header
+		|| fwrite(idx->hashes, PCIPS_SHA256_SIZE, idx->n_blocks, f)
+			!= (size_t) idx->n_blocks)
+		return PCIPS_EIO;
+
+	return 0;
+}
+
+/*
+ * Tells whether the n bytes at data are the same as the indexed file's block
+ * starting at offset, going by their hashes. offset must be the start of a
+ * block; bytes that do not cover exactly one block never match.
+ */
+int
+pcips_index_match(const struct pcips_index *idx, long offset,
+	const unsigned char *data, long n)
+{
+	unsigned char hash[PCIPS_SHA256_SIZE];
+	long block = offset / idx->block_size, size;
+
+	if (offset % idx->block_size != 0 || block >= idx->n_blocks)
+		return 0;
+
+	size = idx->length - offset;
+	if (size > idx->block_size)
+		size = idx->block_size;
+
+	if (n != size)
+		return 0;
+
+	pcips_sha256(data, n, hash);
+	return memcmp(hash, idx->hashes + block * PCIPS_SHA256_SIZE,
+		PCIPS_SHA256_SIZE) == 0;
+}
+
+void
+pcips_index_free(struct pcips_index *idx)
+{
+	free(idx->hashes);
+	idx->hashes = NULL;
+}
@@ -0,0 +1,75 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#ifndef PCIPS_INDEX_H
+#define PCIPS_INDEX_H
+
+#include <stdio.h>
+
+#include "sha256.h"
+
+/* added to the path of a file to name its index */
+#define PCIPS_INDEX_SUFFIX ".pcidx"
+#define PCIPS_INDEX_BLOCK 4096L
+
+/*
+ * The SHA-256 of each block of a file, so that another file can be compared
+ * with it without reading it. The file's size and modification time are kept
+ * to tell when the index no longer describes it.
+ */
+struct pcips_index
+{
+	long length;
+	long mtime_sec;
+	long mtime_nsec;
+	long block_size;
+	long n_blocks;
+	unsigned char *hashes;
+};
+
+int
+pcips_index_build(struct pcips_index *idx, FILE *base,
+	const unsigned char *data, long length, long block_size);
+
+int
+pcips_index_load(struct pcips_index *idx, FILE *f, FILE *base);
+
+int
+pcips_index_save(const struct pcips_index *idx, FILE *f);
+
+int
+pcips_index_match(const struct pcips_index *idx, long offset,
+	const unsigned char *data, long n);
+
+void
+pcips_index_free(struct pcips_index *idx);
+
+#endif
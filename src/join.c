@@ -29,108 +29,406 @@
  *  THE USE OF OR OTHER DEALINGS IN THE WORK.
  */
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "encode.h"
 #include "err.h"
 #include "join.h"
+#include "overlay.h"
+#include "patch.h"
+#include "reader.h"
+#include "sink.h"
+#include "stats.h"
+
+#define JOIN_BATCH 64
+
+/*
+ * Writes the surviving bytes of an overlay as a patch. Adjacent extents are
+ * merged into a single span and re-encoded, which also finds RLE runs that
+ * cross the boundaries of the original records.
+ */
+static int
+write_overlay(struct pcips_sink *dest, const struct pcips_format *fmt,
+	const struct pcips_overlay *o, struct pcips_stats *stats)
+{
+	int rc = 0;
+	long i, j, pos, length, last = 0, cap = 0;
+	unsigned char *buf = NULL, *tmp;
+	const struct pcips_extent *e;
+	struct pcips_span span;
+
+	for (i = 0; !rc && i < o->count; i = j)
+	{
+		span.start = o->extents[i].offset;
+		span.end = span.start + o->extents[i].length;
+		for (j = i + 1; j < o->count
+			&& o->extents[j].offset == span.end; ++j)
+			span.end += o->extents[j].length;
+
+		length = span.end - span.start;
+		if (length > cap)
+		{
+			tmp = realloc(buf, length);
+			if (!tmp)
+			{
+				rc = PCIPS_ENOMEM;
+				break;
+			}
+
+			buf = tmp;
+			cap = length;
+		}
+
+		for (pos = 0, e = o->extents + i; e < o->extents + j; ++e)
+		{
+			if (e->data)
+				memcpy(buf + pos, e->data, e->length);
+			else
+				memset(buf + pos, e->value, e->length);
+
+			pos += e->length;
+		}
+
+		rc = pcips_encode_spans(dest, fmt, buf, span.start, &span, 1,
+			stats);
+		last = span.end;
+	}
+
+	free(buf);
+
+	/* an empty record past the last write still extends the output */
+	if (!rc && o->end > last)
+		rc = pcips_write_rle(dest, fmt, o->end, 0, 0, stats);
+
+	return rc;
+}
+
+/*
+ * Joins patches by composing them into a single loaded patch, so that bytes
+ * written by more than one input are only kept from the last of them. The
+ * result is equivalent to the inputs applied in order, but contains only the
+ * bytes that the combined patch actually changes.
+ */
+static int
+join_compact(FILE *dest, const char * const *src_paths, int n,
+	const struct pcips_format *fmt, struct pcips_stats *stats)
+{
+	int rc = 0, i;
+	struct pcips_patch *patch = NULL;
+	struct pcips_timer timer;
+	struct pcips_sink sink;
+	unsigned char buf[PCIPS_SINK_BUFFER_SIZE];
+	FILE *src;
+
+	pcips_stats_begin(stats, &timer);
+
+	for (i = 0; !rc && i < n; ++i)
+	{
+		src = fopen(src_paths[i], "rb");
+		if (!src)
+		{
+			rc = PCIPS_EARGS;
+			break;
+		}
+
+		if (patch)
+			rc = pcips_patch_append(patch, src);
+		else
+			rc = pcips_patch_load(&patch, src);
+
+		fclose(src);
+	}
+
+	if (patch)
+	{
+		PCIPS_STAT_ADD(stats, plain_read, patch->n_plain);
+		PCIPS_STAT_ADD(stats, rle_read, patch->n_rle);
+	}
+
+	pcips_stats_end(stats, &timer, PCIPS_PHASE_PARSE);
+	pcips_stats_begin(stats, &timer);
+
+	if (!fmt)
+		fmt = patch ? patch->format : &pcips_ips;
+
+	pcips_sink_stream(&sink, dest, buf, sizeof buf, stats);
+	if (!rc)
+		rc = pcips_sink_write(&sink, fmt->header, FILE_HEADER_SIZE);
+
+	if (!rc && patch)
+		rc = write_overlay(&sink, fmt, &patch->writes, stats);
+
+	if (!rc)
+		rc = pcips_sink_write(&sink, fmt->footer, fmt->footer_size);
+
+	if (!rc)
+		rc = pcips_sink_flush(&sink);
+
+	pcips_stats_end(stats, &timer, PCIPS_PHASE_WRITE);
+
+	pcips_patch_free(patch);
+	return rc;
+}
+
+/*
+ * Picks the format of a joined patch: IPS32 if any input is IPS32, since its
+ * offsets may not fit in IPS, and IPS otherwise. Inputs that cannot be read
+ * are left for the join itself to report.
+ */
+static const struct pcips_format *
+join_format(const char * const *src_paths, int n, struct pcips_stats *stats)
+{
+	int i;
+	unsigned char header[FILE_HEADER_SIZE];
+	const struct pcips_format *fmt = &pcips_ips, *f;
+	FILE *src;
+
+	for (i = 0; i < n; ++i)
+	{
+		src = fopen(src_paths[i], "rb");
+		if (!src)
+			continue;
+
+		PCIPS_STAT_ADD(stats, syscalls, 1);
+		if (fread(header, 1, FILE_HEADER_SIZE, src)
+			== FILE_HEADER_SIZE)
+		{
+			f = pcips_format_detect(header);
+			if (f && f->offset_size > fmt->offset_size)
+				fmt = f;
+		}
+
+		fclose(src);
+	}
+
+	return fmt;
+}
+
+/*
+ * Rewrites the n_records records of an input with the wider offsets of fmt,
+ * so that an IPS patch can be joined into an IPS32 one. The new records are
+ * stored in a buffer that the caller must free.
+ */
+static int
+widen_records(struct pcips_reader *r, const struct pcips_format *fmt,
+	long n_records, unsigned char **out, long *size)
+{
+	int rc;
+	long extra = fmt->offset_size - r->format->offset_size;
+	unsigned char *p;
+	struct pcips_record rec;
+
+	*size = r->start - FILE_HEADER_SIZE + n_records * extra;
+	*out = malloc(*size ? *size : 1);
+	if (!*out)
+		return PCIPS_ENOMEM;
+
+	rc = pcips_reader_rewind(r);
+	if (rc)
+		return rc;
+
+	for (p = *out; (rc = pcips_reader_next(r, &rec)) > 0;
+		p += rec.raw_size + extra)
+	{
+		pcips_format_put_offset(fmt, p, rec.offset);
+		memcpy(p + fmt->offset_size, rec.raw + r->format->offset_size,
+			rec.raw_size - r->format->offset_size);
+	}
+
+	return rc < 0 ? r->error : 0;
+}
+
+/*
+ * Collects slices of mapped input patches so that the joined patch can be
+ * written with a few large writev() calls, without copying any payloads.
+ */
+static int
+flush_slices(int fd, struct iovec *iov, int count, struct pcips_stats *stats)
+{
+	ssize_t n;
+
+	while (count > 0)
+	{
+		n = writev(fd, iov, count);
+		PCIPS_STAT_ADD(stats, syscalls, 1);
+		if (n < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			return PCIPS_EIO;
+		}
+
+		while (count > 0 && (size_t) n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			++iov;
+			--count;
+		}
+
+		if (count > 0)
+		{
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
 
 int
-pcips_join_patches(FILE *dest, const char * const *src_paths, int n)
+pcips_join_patches(FILE *dest, const char * const *src_paths, int n,
+	const struct pcips_join_options *opts)
 {
-	int rc, i, c;
-	unsigned int size;
-	unsigned char buf[HEADER_SIZE];
+	int rc = 0, i, fd, count, pending = 0;
+	long n_records, size;
+	const struct pcips_format *fmt = opts ? opts->format : NULL;
+	struct pcips_stats *stats = opts ? opts->stats : NULL;
+	struct pcips_timer timer;
+	struct pcips_reader readers[JOIN_BATCH];
+	unsigned char *widened[JOIN_BATCH];
+	struct iovec iov[JOIN_BATCH + 2], *first = iov;
+	struct pcips_record rec;
+	FILE *src;
+
+	if (opts && opts->compact)
+		return join_compact(dest, src_paths, n, fmt, stats);
 
-	rc = fputs(IPS_HEADER, dest);
-	if (EOF == rc)
+	if (!fmt)
+		fmt = join_format(src_paths, n, stats);
+
+	if (fflush(dest) == EOF)
 		return PCIPS_EIO;
 
-	rc = 0;
+	fd = fileno(dest);
+	iov[0].iov_base = (void *) fmt->header;
+	iov[0].iov_len = FILE_HEADER_SIZE;
+	if (0 == n)
+	{
+		iov[1].iov_base = (void *) fmt->footer;
+		iov[1].iov_len = fmt->footer_size;
+		return flush_slices(fd, iov, 2, stats);
+	}
+
+	/*
+	 * The records of each input are validated but not copied: since joining
+	 * is plain concatenation, everything between an input's header and
+	 * footer is forwarded to the output as a single slice of its mapping.
+	 * Only IPS inputs joined into an IPS32 patch have to be rewritten.
+	 */
 	for (i = 0; i < n; ++i)
 	{
-		FILE *src = fopen(src_paths[i], "rb");
+		pcips_stats_begin(stats, &timer);
+		src = fopen(src_paths[i], "rb");
 		if (!src)
 		{
 			rc = PCIPS_EARGS;
 			break;
 		}
 
-		size = fread(buf, 1, HEADER_SIZE, src);
-		if (size != HEADER_SIZE
-			|| memcmp(buf, IPS_HEADER, HEADER_SIZE) != 0)
+		rc = pcips_reader_load(&readers[pending], src);
+		fclose(src);
+		if (rc)
+			break;
+
+		/* every record is forwarded as it is */
+		n_records = 0;
+		while ((rc = pcips_reader_next(&readers[pending], &rec)) > 0)
 		{
-			rc = PCIPS_EFILE;
-			fclose(src);
+			++n_records;
+			if (stats && rec.size)
+			{
+				++stats->plain_read;
+				++stats->plain_written;
+				stats->payload_bytes += rec.size;
+			}
+			else if (stats)
+			{
+				++stats->rle_read;
+				++stats->rle_written;
+				stats->payload_bytes += rec.rle_size;
+			}
+		}
+
+		widened[pending] = NULL;
+		if (0 == rc && readers[pending].format != fmt)
+		{
+			if (readers[pending].format->offset_size
+				> fmt->offset_size)
+				rc = PCIPS_EFILE;
+			else
+				rc = widen_records(&readers[pending], fmt,
+					n_records, &widened[pending], &size);
+		}
+		else if (rc < 0)
+		{
+			rc = readers[pending].error;
+		}
+
+		if (rc)
+		{
+			free(widened[pending]);
+			pcips_reader_close(&readers[pending]);
 			break;
 		}
 
-		while ((size = fread(buf, 1, HEADER_SIZE, src)) == HEADER_SIZE)
+		if (widened[pending])
+		{
+			iov[pending + 1].iov_base = widened[pending];
+			iov[pending + 1].iov_len = size;
+		}
+		else
 		{
-			size = buf[IPS_OFFSET_SIZE];
-			size <<= 8;
-			size |= buf[IPS_OFFSET_SIZE + 1];
+			iov[pending + 1].iov_base =
+				readers[pending].buf + FILE_HEADER_SIZE;
+			iov[pending + 1].iov_len =
+				readers[pending].start - FILE_HEADER_SIZE;
+		}
 
-			c = fwrite(buf, HEADER_SIZE, 1, dest);
-			if (c != 1)
-			{
-				rc = PCIPS_EIO;
-				break;
-			}
+		++pending;
+		pcips_stats_end(stats, &timer, PCIPS_PHASE_PARSE);
 
-			if (0 == size) /* RLE record */
+		if (JOIN_BATCH == pending || i + 1 == n)
+		{
+			pcips_stats_begin(stats, &timer);
+			/* the header only goes out with the first batch */
+			count = pending + (iov + 1 - first);
+			if (i + 1 == n)
 			{
-				c = fread(buf, RLE_EXTENSION, 1, src);
-				if (c != 1)
-				{
-					rc = PCIPS_EFILE;
-					break;
-				}
-
-				c = fwrite(buf, RLE_EXTENSION, 1, dest);
-				if (c != 1)
-				{
-					rc = PCIPS_EFILE;
-					break;
-				}
-
-				continue;
+				iov[pending + 1].iov_base =
+					(void *) fmt->footer;
+				iov[pending + 1].iov_len = fmt->footer_size;
+				++count;
 			}
 
-			while (size--)
+			rc = flush_slices(fd, first, count, stats);
+			pcips_stats_end(stats, &timer, PCIPS_PHASE_WRITE);
+			first = iov + 1;
+
+			while (pending)
 			{
-				c = fgetc(src);
-				if (EOF == c)
-				{
-					rc = PCIPS_EFILE;
-					break;
-				}
-
-				c = fputc(c, dest);
-				if (EOF == c)
-				{
-					rc = PCIPS_EIO;
-					break;
-				}
+				--pending;
+				free(widened[pending]);
+				pcips_reader_close(&readers[pending]);
 			}
-		}
 
-		if (!rc && (size != FOOTER_SIZE
-				|| memcmp(buf, IPS_FOOTER, FOOTER_SIZE) != 0))
-			rc = PCIPS_EFILE;
-
-		fclose(src);
-		if (rc)
-			break;
+			if (rc)
+				break;
+		}
 	}
 
-	if (rc)
-		return rc;
-
-	rc = fputs(IPS_FOOTER, dest);
-	if (EOF == rc)
-		return PCIPS_EIO;
+	while (pending)
+	{
+		--pending;
+		free(widened[pending]);
+		pcips_reader_close(&readers[pending]);
+	}
 
-	return 0;
+	return rc;
 }
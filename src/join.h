@@ -34,7 +34,18 @@
 
 #include <stdio.h>
 
+#include "format.h"
+#include "stats.h"
+
+struct pcips_join_options
+{
+	int compact;
+	const struct pcips_format *format;
+	struct pcips_stats *stats;
+};
+
 int
-pcips_join_patches(FILE *dest, const char * const *src_paths, int n);
+pcips_join_patches(FILE *dest, const char * const *src_paths, int n,
+	const struct pcips_join_options *opts);
 
 #endif
@@ -30,40 +30,334 @@
  */
 
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include "apply.h"
 #include "common.h"
-#include "create.h"
-#include "join.h"
-#include "err.h"
+#include "map.h"
+#include "pcips.h"
 
 #define VERSION "0.0.2"
 #define PROG_INFO "pcips " VERSION
-#define USAGE "USAGE\n\
+
+/* split up to stay within the string length limit of ANSI C */
+static const char * const usage[] = {
+	"USAGE\n\
 \tApply a patch:\n\
-\t\tpcips [options] -a patch_file source_file [output_file]\n\n\
+\t\tpcips [options] -a patch_file [-a patch_file ...] source_file \
+[output_file]\n\n\
+\t\tUse - for source_file or output_file to read stdin or write stdout\n\n\
 \tCreate a patch file:\n\
-\t\tpcips -c patch_file source_file modified_file\n\n\
+\t\tpcips [options] -c patch_file source_file modified_file\n\
+\t\tpcips [options] -r -c patch_dir source_dir modified_dir\n\n\
 \tJoin multiple patch files into one:\n\
-\t\tpcips -j output_file input1 [input2 ...]\n\n\
-OPTIONS\n\
-\t-f\n\
-\t\tIgnore IPS file size limit of 16MB and apply patches anyway\n\n\
-\t-i\n\
-\t\tPatch source_file in place, overwriting it\n"
+\t\tpcips [options] -j output_file input1 [input2 ...]\n\n\
+\tApply the patches listed in a manifest:\n\
+\t\tpcips [options] -B manifest\n\n",
+
+	"OPTIONS\n",
+
+	"\t-B manifest\n\
+\t\tApply each patch to the source_file and optional output_file on\n\
+\t\tthe same line of manifest, separated by tabs, -T files at a time\n\n",
+
+	"\t-b\n\
+\t\tCreate a BPS patch, which can also describe moved or inserted data\n\n",
+
+	"\t-C\n\
+\t\tReport whether a patch is applied to source_file, without writing\n\n",
+
+	"\t-f\n\
+\t\tIgnore IPS file size limit of 16MB and apply patches anyway\n\n",
+
+	"\t-i\n\
+\t\tPatch source_file in place, overwriting it\n\n",
+
+	"\t-O\n\
+\t\tCreate or join into the smallest possible patch (slower)\n\n",
+
+	"\t-L\n\
+\t\tCreate or join into an IPS32 patch, for files over 16MB\n\n",
+
+	"\t-k\n\
+\t\tPrint the CRC-32 of the source and output files when applying\n\n",
+
+	"\t-Q depth\n\
+\t\tWrite applied patches through io_uring with this queue depth\n\n",
+
+	"\t-r\n\
+\t\tCreate a patch for each file that differs between two directories\n\n",
+
+	"\t-R crc32\n\
+\t\tCheck that the patched output has this CRC-32 (in hex)\n\n",
+
+	"\t-s\n\
+\t\tOnly write the parts of an applied patch that differ from the file\n\n",
+
+	"\t-S crc32\n\
+\t\tCheck that source_file has this CRC-32 (in hex) before applying\n\n",
+
+	"\t-T threads\n\
+\t\tCompare files using this many threads when creating patches\n\n",
+
+	"\t--stats[=json]\n\
+\t\tPrint counters and the time spent in each phase to stderr\n\n",
+
+	"\t--index\n\
+\t\tCompare with block hashes of source_file kept in source_file.pcidx,\n\
+\t\twhich is written if it is missing or out of date\n\n",
+
+	"\t--serve socket\n\
+\t\tServe jobs sent to this Unix socket with --connect, running -T\n\
+\t\tthreads at a time, until interrupted\n\n",
+
+	"\t--connect socket\n\
+\t\tSend the job to a server started with --serve instead of running it\n"
+};
+
+enum stats_mode
+{
+	STATS_OFF,
+	STATS_TEXT,
+	STATS_JSON
+};
+
+struct long_options
+{
+	enum stats_mode stats;
+	int index;
+	const char *serve;
+	const char *connect;
+};
 
 enum pcips_mode
 {
 	MODE_UNSET,
 	MODE_APPLY,
 	MODE_CREATE,
-	MODE_JOIN
+	MODE_JOIN,
+	MODE_BATCH
 };
 
+static void
+print_usage(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof usage / sizeof usage[0]; ++i)
+		fputs(usage[i], stderr);
+
+	fputc('\n', stderr);
+}
+
+/*
+ * Loads the patches given with -a and composes them in order, so that a
+ * chain of patches is applied with a single pass over the output.
+ */
+static int
+load_patches(struct pcips_patch **patch, char * const *paths, int n)
+{
+	int rc = 0, i;
+	FILE *f;
+
+	for (i = 0; !rc && i < n; ++i)
+	{
+		f = fopen(paths[i], "rb");
+		if (!f)
+		{
+			fprintf(stderr, "Error opening %s: %s\n", paths[i],
+				strerror(errno));
+			return PCIPS_EARGS;
+		}
+
+		if (*patch)
+			rc = pcips_patch_append(*patch, f);
+		else
+			rc = pcips_patch_load(patch, f);
+
+		fclose(f);
+		if (rc)
+			fprintf(stderr, "Error reading patch %s: %s\n",
+				paths[i], pcips_strerror(rc));
+	}
+
+	return rc;
+}
+
+/*
+ * Takes an option that needs a value, given either as --name=value or as
+ * --name value. Returns 1 if argv[*i] is the option, 0 if it is not, or -1 if
+ * its value is missing.
+ */
+static int
+take_value(const char *name, int argc, char *argv[], int *i,
+	const char **value)
+{
+	size_t n = strlen(name);
+
+	if (strncmp(argv[*i], name, n) != 0)
+		return 0;
+
+	if ('=' == argv[*i][n])
+	{
+		*value = argv[*i] + n + 1;
+		return 1;
+	}
+
+	if (argv[*i][n] != '\0')
+		return 0;
+
+	if (*i + 1 == argc)
+		return -1;
+
+	*value = argv[++*i];
+	return 1;
+}
+
+/*
+ * Takes the long options out of the arguments, since getopt() only handles
+ * short options. Anything after -- is left alone. Returns the index of an
+ * invalid option, or 0.
+ */
+static int
+take_long_options(int *argc, char *argv[], struct long_options *lo)
+{
+	int i, j, rc;
+
+	for (i = j = 1; i < *argc; ++i)
+	{
+		if (strcmp(argv[i], "--") == 0)
+		{
+			while (i < *argc)
+				argv[j++] = argv[i++];
+
+			break;
+		}
+
+		if (strncmp(argv[i], "--", 2) != 0)
+		{
+			argv[j++] = argv[i];
+			continue;
+		}
+
+		if (strcmp(argv[i], "--stats") == 0)
+			lo->stats = STATS_TEXT;
+		else if (strcmp(argv[i], "--stats=json") == 0)
+			lo->stats = STATS_JSON;
+		else if (strcmp(argv[i], "--index") == 0)
+			lo->index = 1;
+		else if ((rc = take_value("--serve", *argc, argv, &i,
+				&lo->serve)) != 0
+			|| (rc = take_value("--connect", *argc, argv, &i,
+				&lo->connect)) != 0)
+			rc = rc < 0 ? i : 0;
+		else
+			rc = i;
+
+		if (rc)
+			return rc;
+	}
+
+	*argc = j;
+	argv[j] = NULL;
+	return 0;
+}
+
+/*
+ * Opens the patch given with -a if it is a BPS patch, which cannot be
+ * combined with others, and leaves *bps NULL if it is not.
+ */
+static int
+open_bps(FILE **bps, char * const *paths, int n)
+{
+	*bps = fopen(paths[0], "rb");
+	if (!*bps)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", paths[0],
+			strerror(errno));
+		return PCIPS_EARGS;
+	}
+
+	if (!pcips_bps_detect(*bps))
+	{
+		fclose(*bps);
+		*bps = NULL;
+		return 0;
+	}
+
+	if (n > 1)
+	{
+		fprintf(stderr, "Error: BPS patches cannot be chained.\n");
+		return PCIPS_EARGS;
+	}
+
+	return 0;
+}
+
+static int
+apply(const struct pcips_patch *patch, FILE *bps, FILE *src, FILE *dest,
+	const struct pcips_apply_options *opts)
+{
+	if (bps)
+		return pcips_bps_apply(bps, src, dest, opts);
+
+	return pcips_patch_apply_to(patch, src, dest, opts);
+}
+
+/* Reports how much of a patch has been applied to a file. */
+static int
+check_patch(const struct pcips_patch *patch, FILE *file)
+{
+	int rc;
+	enum pcips_patch_state state;
+
+	rc = pcips_patch_check(patch, file, &state);
+	if (rc)
+	{
+		fprintf(stderr, "Error checking patch: %s\n",
+			pcips_strerror(rc));
+		return rc;
+	}
+
+	switch (state)
+	{
+	case PCIPS_STATE_APPLIED:
+		puts("already applied");
+		break;
+
+	case PCIPS_STATE_PARTIAL:
+		puts("partially applied");
+		break;
+
+	case PCIPS_STATE_CLEAN:
+		puts("clean base");
+		break;
+	}
+
+	return 0;
+}
+
+static int
+parse_crc32(const char *s, unsigned long *crc)
+{
+	char *end;
+
+	*crc = strtoul(s, &end, 16);
+	if ('\0' == *s || *end != '\0' || *crc > 0xffffffffUL)
+		return -1;
+
+	return 0;
+}
+
+static int
+is_stdio(const char *path)
+{
+	return strcmp(path, "-") == 0;
+}
+
 static long
 file_length(FILE *f)
 {
@@ -78,40 +372,428 @@ file_length(FILE *f)
 	return result;
 }
 
+/* written to by signal handlers to stop the server */
+static int stop_pipe[2] = { -1, -1 };
+
+static void
+request_stop(int sig)
+{
+	char c = 0;
+
+	(void) sig;
+	if (write(stop_pipe[1], &c, 1) < 0)
+		return;
+}
+
+/*
+ * Runs a server for --serve until it is interrupted or terminated. Clients
+ * that go away while their output is being written must not end it, so
+ * SIGPIPE is ignored.
+ */
+static int
+serve(const char *socket_path, int workers)
+{
+	int rc;
+	struct sigaction sa;
+	struct pcips_serve_options opts;
+
+	if (pipe(stop_pipe) != 0)
+	{
+		fprintf(stderr, "Error starting server: %s\n",
+			strerror(errno));
+		return PCIPS_EIO;
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = request_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	opts.workers = workers;
+	opts.cache_size = 0;
+	opts.stop_fd = stop_pipe[0];
+
+	rc = pcips_serve(socket_path, &opts);
+	if (rc)
+		fprintf(stderr, "Error serving on %s: %s\n", socket_path,
+			PCIPS_EIO == rc ? strerror(errno)
+			: pcips_strerror(rc));
+
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+	return rc;
+}
+
+/* Makes a path usable by a server that runs in another directory. */
+static char *
+absolute_path(const char *path)
+{
+	char *cwd = NULL, *tmp, *result;
+	size_t size = 256;
+
+	if ('/' == path[0])
+	{
+		result = malloc(strlen(path) + 1);
+		if (result)
+			strcpy(result, path);
+
+		return result;
+	}
+
+	for (;;)
+	{
+		tmp = realloc(cwd, size);
+		if (!tmp)
+		{
+			free(cwd);
+			return NULL;
+		}
+
+		cwd = tmp;
+		if (getcwd(cwd, size))
+			break;
+
+		if (errno != ERANGE)
+		{
+			free(cwd);
+			return NULL;
+		}
+
+		size *= 2;
+	}
+
+	result = malloc(strlen(cwd) + strlen(path) + 2);
+	if (result)
+		sprintf(result, "%s/%s", cwd, path);
+
+	free(cwd);
+	return result;
+}
+
+/*
+ * Loads the index kept next to the source file given with --index, or builds
+ * it and saves it there for next time if it is missing or out of date.
+ */
+static int
+open_index(struct pcips_index *idx, const char *path, FILE *base)
+{
+	int rc, save_rc;
+	char *idx_path;
+	FILE *f;
+	struct pcips_map map;
+
+	idx_path = malloc(strlen(path) + sizeof PCIPS_INDEX_SUFFIX);
+	if (!idx_path)
+		return PCIPS_ENOMEM;
+
+	sprintf(idx_path, "%s%s", path, PCIPS_INDEX_SUFFIX);
+	f = fopen(idx_path, "rb");
+	rc = f ? pcips_index_load(idx, f, base) : PCIPS_EFILE;
+	if (f)
+		fclose(f);
+
+	if (rc != PCIPS_EFILE)
+		goto end;
+
+	rc = pcips_map_file(&map, base);
+	if (rc)
+		goto end;
+
+	rc = pcips_index_build(idx, base, map.data, map.length,
+		PCIPS_INDEX_BLOCK);
+	pcips_unmap(&map);
+	if (rc)
+		goto end;
+
+	/* the patch can still be created without saving the index */
+	f = fopen(idx_path, "wb");
+	save_rc = f ? pcips_index_save(idx, f) : PCIPS_EIO;
+	if (f && fclose(f) != 0)
+		save_rc = PCIPS_EIO;
+
+	if (save_rc)
+	{
+		fprintf(stderr, "Warning: could not save %s\n", idx_path);
+		if (f)
+			remove(idx_path);
+	}
+
+end:
+	free(idx_path);
+	return rc;
+}
+
+static void
+print_tree_error(void *ctx, const char *path, int error)
+{
+	(void) ctx;
+	fprintf(stderr, "Error creating patch for %s: %s\n", path,
+		pcips_strerror(error));
+}
+
+/*
+ * Sends a job to the server given with --connect. paths are the ones the job
+ * names, in the order the server expects them; the source and output of a
+ * patch being applied may be -, in which case standard input or output is
+ * passed to the server instead.
+ */
+static int
+submit(const char *socket_path, const char *job, const char *flags,
+	char * const *paths, int n)
+{
+	int rc = 0, i, fds[2], n_fds = 0;
+	const char **fields;
+	char msg[1024];
+
+	fields = calloc(n + 2, sizeof *fields);
+	if (!fields)
+		return PCIPS_ENOMEM;
+
+	fields[0] = job;
+	fields[1] = flags;
+	for (i = 0; !rc && i < n; ++i)
+	{
+		if (is_stdio(paths[i]) && strcmp(job, PCIPS_JOB_APPLY) == 0
+			&& i > 0)
+		{
+			fields[i + 2] = "-";
+			fds[n_fds++] = 1 == i ? STDIN_FILENO : STDOUT_FILENO;
+			continue;
+		}
+
+		fields[i + 2] = absolute_path(paths[i]);
+		if (!fields[i + 2])
+			rc = PCIPS_ENOMEM;
+	}
+
+	if (!rc)
+	{
+		/* whatever is buffered must be out before the server writes */
+		fflush(stdout);
+		rc = pcips_serve_submit(socket_path, fields, n + 2, fds,
+			n_fds, msg, sizeof msg);
+		if (rc)
+			fprintf(stderr, "%s\n", msg[0] ? msg
+				: pcips_strerror(rc));
+	}
+
+	for (i = 0; i < n; ++i)
+	{
+		if (fields[i + 2] && strcmp(fields[i + 2], "-") != 0)
+			free((char *) fields[i + 2]);
+	}
+
+	free(fields);
+	return rc;
+}
+
+static void
+print_batch_result(void *ctx, const struct pcips_batch_entry *e)
+{
+	const char *out = e->dest ? e->dest : e->src;
+
+	(void) ctx;
+	if (!e->rc)
+		printf("%s: patched\n", out);
+	else if (e->skipped)
+		fprintf(stderr, "Skipped %s on %s: line %ld failed\n",
+			e->patch, out, e->skipped);
+	else if (e->failed)
+		fprintf(stderr, "Error opening %s: %s\n", e->failed,
+			strerror(e->open_errno));
+	else
+		fprintf(stderr, "Error applying %s to %s: %s\n", e->patch, out,
+			pcips_strerror(e->rc));
+}
+
+/*
+ * Applies the entries of the manifest given with -B, which may be - to read
+ * standard input. Relative patch paths in it are taken from the manifest's
+ * directory, and the other paths from the current one.
+ */
+static int
+apply_batch(const char *path, int in_place, int threads,
+	const struct pcips_apply_options *apply_opts)
+{
+	int rc;
+	long i, bad_line = 0;
+	char *dir = NULL, *slash;
+	FILE *f;
+	struct pcips_batch batch;
+	struct pcips_batch_options opts;
+
+	f = is_stdio(path) ? stdin : fopen(path, "r");
+	if (!f)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", path,
+			strerror(errno));
+		return PCIPS_EARGS;
+	}
+
+	slash = is_stdio(path) ? NULL : strrchr(path, '/');
+	if (slash)
+	{
+		/* a manifest in / keeps the slash */
+		i = slash == path ? 1 : slash - path;
+		dir = malloc(i + 1);
+		if (!dir)
+		{
+			rc = PCIPS_ENOMEM;
+			goto end;
+		}
+
+		memcpy(dir, path, i);
+		dir[i] = '\0';
+	}
+
+	rc = pcips_batch_load(&batch, f, dir, &bad_line);
+	if (rc)
+	{
+		if (bad_line)
+			fprintf(stderr, "Error in %s line %ld: expected a "
+				"patch, a source and an optional output, "
+				"separated by tabs\n", path, bad_line);
+		else
+			fprintf(stderr, "Error reading %s: %s\n", path,
+				pcips_strerror(rc));
+
+		goto end;
+	}
+
+	for (i = 0; !in_place && i < batch.count; ++i)
+	{
+		if (!batch.entries[i].dest)
+		{
+			fprintf(stderr, "Error: %s line %ld patches in place; "
+				"you must use -i.\n", path,
+				batch.entries[i].line);
+			rc = PCIPS_EARGS;
+			break;
+		}
+	}
+
+	opts.threads = threads;
+	opts.apply = apply_opts;
+	opts.report = print_batch_result;
+	opts.ctx = NULL;
+	if (!rc)
+		rc = pcips_batch_apply(&batch, &opts);
+
+	pcips_batch_free(&batch);
+
+end:
+	if (f != stdin)
+		fclose(f);
+
+	free(dir);
+	return rc;
+}
+
 int
 main(int argc, char *argv[])
 {
 	int rc = 0, c, ignore_limit = 0, in_place = 0, remaining_args;
+	int n_patches = 0, check = 0, workers = 0, tree = 0;
 	enum pcips_mode mode = MODE_UNSET;
-	char *patch_path = NULL, *src_path, *dest_path;
+	char **patch_paths, *src_path, *dest_path, *end, flags[8], *flag;
 	FILE *patch_file = NULL, *src_file = NULL, *dest_file = NULL;
+	FILE *bps_file = NULL;
+	struct pcips_patch *patch = NULL;
+	struct pcips_apply_options apply_opts;
+	struct pcips_checksums sums;
+	struct pcips_create_options create_opts;
+	struct pcips_join_options join_opts;
+	struct pcips_tree_options tree_opts;
+	struct pcips_index index;
+	struct pcips_stats stats, *stats_ptr = NULL;
+	struct pcips_timer timer;
+	struct long_options lo;
+	const struct pcips_format *format = &pcips_ips;
+
+	lo.stats = STATS_OFF;
+	lo.index = 0;
+	lo.serve = lo.connect = NULL;
+	c = take_long_options(&argc, argv, &lo);
+	if (c)
+	{
+		fprintf(stderr, "Invalid argument: %s\n\n", argv[c]);
+		print_usage();
+		return PCIPS_EARGS;
+	}
+
+	if (lo.stats != STATS_OFF)
+	{
+		pcips_stats_init(&stats);
+		stats_ptr = &stats;
+	}
+
+	apply_opts.queue_depth = 0;
+	apply_opts.skip_unchanged = 0;
+	apply_opts.verify_src = 0;
+	apply_opts.verify_out = 0;
+	apply_opts.stream_dest = 0;
+	apply_opts.computed = NULL;
+	apply_opts.stats = stats_ptr;
+	create_opts.threads = 1;
+	create_opts.optimal = 0;
+	create_opts.format = NULL;
+	create_opts.bps = 0;
+	create_opts.index = NULL;
+	create_opts.stats = stats_ptr;
+	join_opts.compact = 0;
+	join_opts.format = NULL;
+	join_opts.stats = stats_ptr;
+
+	/* room for the source and output paths sent with --connect */
+	patch_paths = malloc((argc + 2) * sizeof *patch_paths);
+	if (!patch_paths)
+		return PCIPS_ENOMEM;
 
 	opterr = 0;
-	while ((c = getopt(argc, argv, "a:c:fij")) != -1)
+	while ((c = getopt(argc, argv, "a:B:bc:CfijkLOQ:rR:sS:T:")) != -1)
 	{
 		switch (c)
 		{
 		case 'a':
 		case 'c':
-			if (mode != MODE_UNSET)
+			/* several -a options apply a chain of patches */
+			if (mode != MODE_UNSET
+				&& !('a' == c && MODE_APPLY == mode))
 			{
 				fprintf(stderr,
-					"Error: more than one processing mode selected.\n\n%s\n",
-					USAGE);
+					"Error: more than one processing mode selected.\n\n");
+				print_usage();
 				rc = PCIPS_EARGS;
 				goto end;
 			}
 
 			mode = 'a' == c ? MODE_APPLY : MODE_CREATE;
+			patch_paths[n_patches++] = optarg;
+			break;
 
-			patch_path = malloc(strlen(optarg) + 1);
-			if (!patch_path)
+		case 'B':
+			if (mode != MODE_UNSET)
 			{
-				rc = PCIPS_ENOMEM;
+				fprintf(stderr,
+					"Error: more than one processing mode selected.\n\n");
+				print_usage();
+				rc = PCIPS_EARGS;
 				goto end;
 			}
 
-			strcpy(patch_path, optarg);
+			mode = MODE_BATCH;
+			patch_paths[n_patches++] = optarg;
+			break;
+
+		case 'b':
+			create_opts.bps = 1;
+			break;
+
+		case 'C':
+			check = 1;
 			break;
 
 		case 'f':
@@ -122,12 +804,82 @@ main(int argc, char *argv[])
 			in_place = 1;
 			break;
 
+		case 'O':
+			create_opts.optimal = 1;
+			join_opts.compact = 1;
+			break;
+
+		case 'Q':
+			apply_opts.queue_depth = strtol(optarg, &end, 10);
+			if (*end != '\0' || apply_opts.queue_depth < 1)
+			{
+				fprintf(stderr, "Invalid queue depth: %s\n\n",
+					optarg);
+				print_usage();
+				rc = PCIPS_EARGS;
+				goto end;
+			}
+			break;
+
+		case 'k':
+			apply_opts.computed = &sums;
+			break;
+
+		case 'r':
+			tree = 1;
+			break;
+
+		case 'R':
+		case 'S':
+			if (parse_crc32(optarg, 'S' == c
+					? &apply_opts.expected.src
+					: &apply_opts.expected.out) != 0)
+			{
+				fprintf(stderr, "Invalid CRC-32: %s\n\n",
+					optarg);
+				print_usage();
+				rc = PCIPS_EARGS;
+				goto end;
+			}
+
+			if ('S' == c)
+				apply_opts.verify_src = 1;
+			else
+				apply_opts.verify_out = 1;
+
+			apply_opts.computed = &sums;
+			break;
+
+		case 's':
+			apply_opts.skip_unchanged = 1;
+			break;
+
+		case 'L':
+			format = &pcips_ips32;
+			create_opts.format = format;
+			join_opts.format = format;
+			break;
+
+		case 'T':
+			create_opts.threads = strtol(optarg, &end, 10);
+			if (*end != '\0' || create_opts.threads < 1)
+			{
+				fprintf(stderr, "Invalid thread count: %s\n\n",
+					optarg);
+				print_usage();
+				rc = PCIPS_EARGS;
+				goto end;
+			}
+
+			workers = create_opts.threads;
+			break;
+
 		case 'j':
 			if (mode != MODE_UNSET)
 			{
 				fprintf(stderr,
-					"Error: more than one processing mode selected.\n\n%s\n",
-					USAGE);
+					"Error: more than one processing mode selected.\n\n");
+				print_usage();
 				rc = PCIPS_EARGS;
 				goto end;
 			}
@@ -136,16 +888,16 @@ main(int argc, char *argv[])
 			break;
 
 		case '?':
-			fprintf(stderr, "Invalid argument: -%c\n\n%s\n",
-				optopt, USAGE);
+			fprintf(stderr, "Invalid argument: -%c\n\n", optopt);
+			print_usage();
 			rc = PCIPS_EARGS;
 			goto end;
 			break;
 
 		case ':':
 			fprintf(stderr,
-				"Option -%c requires an argument\n\n%s\n",
-				optopt, USAGE);
+				"Option -%c requires an argument\n\n", optopt);
+			print_usage();
 			rc = PCIPS_EARGS;
 			goto end;
 			break;
@@ -156,16 +908,62 @@ main(int argc, char *argv[])
 	}
 
 	remaining_args = argc - optind;
+	if (lo.serve)
+	{
+		if (mode != MODE_UNSET || remaining_args)
+		{
+			print_usage();
+			rc = PCIPS_EARGS;
+		}
+		else
+		{
+			rc = serve(lo.serve, workers);
+		}
+
+		goto end;
+	}
+
+	if (tree && mode != MODE_CREATE)
+	{
+		fprintf(stderr, "Error: -r can only be used with -c.\n\n");
+		print_usage();
+		rc = PCIPS_EARGS;
+		goto end;
+	}
+
+	if (lo.index && (mode != MODE_CREATE || tree || lo.connect))
+	{
+		fprintf(stderr, "Error: --index can only be used with -c, "
+			"without -r or --connect.\n\n");
+		print_usage();
+		rc = PCIPS_EARGS;
+		goto end;
+	}
+
+	/* the options a server can be asked for */
+	flag = flags;
+	*flag++ = '-';
+	if (create_opts.optimal)
+		*flag++ = 'O';
+	if (&pcips_ips32 == format)
+		*flag++ = 'L';
+	if (create_opts.bps)
+		*flag++ = 'b';
+	if (apply_opts.skip_unchanged)
+		*flag++ = 's';
+	*flag = '\0';
+
 	switch (mode)
 	{
 	case MODE_UNSET:
-		fprintf(stderr, "%s\n\n%s\n", PROG_INFO, USAGE);
+		fprintf(stderr, "%s\n\n", PROG_INFO);
+		print_usage();
 		break;
 
 	case MODE_APPLY:
 		if (0 == remaining_args || remaining_args > 2)
 		{
-			fprintf(stderr, "%s\n", USAGE);
+			print_usage();
 			rc = PCIPS_EARGS;
 			break;
 		}
@@ -176,7 +974,38 @@ main(int argc, char *argv[])
 		else
 			dest_path = src_path;
 
-		src_file = fopen(src_path, "rb+");
+		if (lo.connect)
+		{
+			if (n_patches > 1 || check || apply_opts.computed)
+			{
+				fprintf(stderr, "Error: chains, -C, -k, -R "
+					"and -S cannot be sent to a "
+					"server.\n");
+				rc = PCIPS_EARGS;
+				break;
+			}
+
+			if (strcmp(src_path, dest_path) == 0
+				&& !is_stdio(src_path) && !in_place)
+			{
+				fprintf(stderr, "Error: You must use -i to "
+					"patch in place.\n");
+				rc = PCIPS_EARGS;
+				break;
+			}
+
+			patch_paths[1] = src_path;
+			patch_paths[2] = dest_path;
+			rc = submit(lo.connect, PCIPS_JOB_APPLY, flags,
+				patch_paths, 3);
+			break;
+		}
+
+		if (is_stdio(src_path))
+			src_file = stdin;
+		else
+			src_file = fopen(src_path, "rb+");
+
 		if (!src_file)
 		{
 			fprintf(stderr, "Error opening %s: %s\n", src_path,
@@ -185,7 +1014,27 @@ main(int argc, char *argv[])
 			break;
 		}
 
-		if (!ignore_limit && file_length(src_file) > IPS_MAX_OFFSET)
+		pcips_stats_begin(stats_ptr, &timer);
+		rc = open_bps(&bps_file, patch_paths, n_patches);
+		if (rc)
+			break;
+
+		if (!bps_file)
+			rc = load_patches(&patch, patch_paths, n_patches);
+
+		if (rc)
+			break;
+
+		pcips_stats_end(stats_ptr, &timer, PCIPS_PHASE_PARSE);
+		if (patch)
+		{
+			PCIPS_STAT_ADD(stats_ptr, plain_read, patch->n_plain);
+			PCIPS_STAT_ADD(stats_ptr, rle_read, patch->n_rle);
+		}
+
+		/* an IPS32 patch in the chain lifts the limit for all of it */
+		if (!ignore_limit && patch && &pcips_ips == patch->format
+			&& file_length(src_file) > IPS_MAX_OFFSET)
 		{
 			fprintf(stderr,
 				"Source file %s exceeds max IPS offset of 16MB.\n",
@@ -194,16 +1043,22 @@ main(int argc, char *argv[])
 			break;
 		}
 
-		patch_file = fopen(patch_path, "rb");
-		if (!patch_file)
+		if (check && bps_file)
 		{
-			fprintf(stderr, "Error opening %s: %s\n", patch_path,
-				strerror(errno));
+			fprintf(stderr,
+				"Error: BPS patches cannot be checked.\n");
 			rc = PCIPS_EARGS;
 			break;
 		}
 
-		if (strcmp(src_path, dest_path) == 0)
+		if (check)
+		{
+			rc = check_patch(patch, src_file);
+			break;
+		}
+
+		/* "-" for both reads standard input and writes standard output */
+		if (strcmp(src_path, dest_path) == 0 && !is_stdio(src_path))
 		{
 			if (!in_place)
 			{
@@ -213,11 +1068,17 @@ main(int argc, char *argv[])
 				goto end;
 			}
 
-			rc = pcips_apply_patch(src_file, src_file, patch_file);
+			rc = apply(patch, bps_file, src_file, src_file,
+				&apply_opts);
 		}
 		else
 		{
-			dest_file = fopen(dest_path, "wb+");
+			apply_opts.stream_dest = is_stdio(dest_path);
+			if (is_stdio(dest_path))
+				dest_file = stdout;
+			else
+				dest_file = fopen(dest_path, "wb+");
+
 			if (!dest_file)
 			{
 				fprintf(stderr, "Error opening %s: %s\n",
@@ -226,8 +1087,14 @@ main(int argc, char *argv[])
 				break;
 			}
 
-			rc = pcips_apply_patch(src_file, dest_file,
-					patch_file);
+			rc = apply(patch, bps_file, src_file, dest_file,
+				&apply_opts);
+		}
+
+		if (apply_opts.computed && (!rc || PCIPS_ECHECKSUM == rc))
+		{
+			fprintf(stderr, "source CRC-32: %08lx\n", sums.src);
+			fprintf(stderr, "output CRC-32: %08lx\n", sums.out);
 		}
 
 		if (rc)
@@ -236,14 +1103,14 @@ main(int argc, char *argv[])
 				pcips_strerror(rc));
 
 			if (PCIPS_EARGS == rc)
-				fprintf(stderr, "%s\n", USAGE);
+				print_usage();
 		}
 		break;
 
 	case MODE_CREATE:
 		if (remaining_args != 2)
 		{
-			fprintf(stderr, "%s\n", USAGE);
+			print_usage();
 			rc = PCIPS_EARGS;
 			break;
 		}
@@ -251,6 +1118,35 @@ main(int argc, char *argv[])
 		src_path = argv[optind];
 		dest_path = argv[optind + 1];
 
+		if (tree && lo.connect)
+		{
+			fprintf(stderr,
+				"Error: -r cannot be sent to a server.\n");
+			rc = PCIPS_EARGS;
+			break;
+		}
+
+		if (tree)
+		{
+			/* the pool keeps the cores busy, one file each */
+			tree_opts.threads = create_opts.threads;
+			tree_opts.create = &create_opts;
+			tree_opts.error = print_tree_error;
+			tree_opts.ctx = NULL;
+			rc = pcips_create_tree(patch_paths[0], src_path,
+				dest_path, &tree_opts);
+			break;
+		}
+
+		if (lo.connect)
+		{
+			patch_paths[1] = src_path;
+			patch_paths[2] = dest_path;
+			rc = submit(lo.connect, PCIPS_JOB_CREATE, flags,
+				patch_paths, 3);
+			break;
+		}
+
 		src_file = fopen(src_path, "rb");
 		if (!src_file)
 		{
@@ -260,11 +1156,13 @@ main(int argc, char *argv[])
 			break;
 		}
 
-		if (file_length(src_file) > IPS_MAX_OFFSET)
+		if (!create_opts.bps
+			&& file_length(src_file) > format->max_offset)
 		{
-			fprintf(stderr,
-				"Source file %s exceeds max IPS offset of 16MB.\n",
-				src_path);
+			fprintf(stderr, "Source file %s exceeds max %s.\n",
+				src_path, format == &pcips_ips
+				? "IPS offset of 16MB (use -L)"
+				: "IPS32 offset of 2GB");
 			rc = PCIPS_EFILE;
 			break;
 		}
@@ -278,52 +1176,77 @@ main(int argc, char *argv[])
 			break;
 		}
 
-		if (file_length(dest_file) > IPS_MAX_OFFSET)
+		if (!create_opts.bps
+			&& file_length(dest_file) > format->max_offset)
 		{
-			fprintf(stderr,
-				"Modified file %s exceeds max IPS offset of 16MB.\n",
-				dest_path);
+			fprintf(stderr, "Modified file %s exceeds max %s.\n",
+				dest_path, format == &pcips_ips
+				? "IPS offset of 16MB (use -L)"
+				: "IPS32 offset of 2GB");
 			rc = PCIPS_EFILE;
 			break;
 		}
 
-		patch_file = fopen(patch_path, "wb");
+		/* BPS matches data anywhere, so block hashes do not help it */
+		if (lo.index && !create_opts.bps)
+		{
+			pcips_stats_begin(stats_ptr, &timer);
+			rc = open_index(&index, src_path, src_file);
+			pcips_stats_end(stats_ptr, &timer, PCIPS_PHASE_PARSE);
+			if (rc)
+			{
+				fprintf(stderr, "Error indexing %s: %s\n",
+					src_path, pcips_strerror(rc));
+				break;
+			}
+
+			create_opts.index = &index;
+		}
+
+		patch_file = fopen(patch_paths[0], "wb");
 		if (!patch_file)
 		{
-			fprintf(stderr, "Error opening %s: %s\n", patch_path,
-				strerror(errno));
+			fprintf(stderr, "Error opening %s: %s\n",
+				patch_paths[0], strerror(errno));
 			rc = PCIPS_EARGS;
 			break;
 		}
 
 		rc = pcips_create_patch(src_file, dest_file, patch_file,
-					file_length(src_file));
+					file_length(src_file), &create_opts);
 		if (rc)
 		{
 			fprintf(stderr, "Error creating patch: %s\n",
 				pcips_strerror(rc));
 
 			if (PCIPS_EARGS == rc)
-				fprintf(stderr, "%s\n", USAGE);
+				print_usage();
 		}
 		break;
 
 	case MODE_JOIN:
 		if (0 == remaining_args)
 		{
-			fprintf(stderr, "%s\n", USAGE);
+			print_usage();
 			rc = PCIPS_EARGS;
 			break;
 		}
 
 		if (1 == remaining_args)
 		{
-			fprintf(stderr, "Error: no inputs specified\n\n%s\n",
-				USAGE);
+			fprintf(stderr, "Error: no inputs specified\n\n");
+			print_usage();
 			rc = PCIPS_EARGS;
 			break;
 		}
 
+		if (lo.connect)
+		{
+			rc = submit(lo.connect, PCIPS_JOB_JOIN, flags,
+				argv + optind, remaining_args);
+			break;
+		}
+
 		dest_path = argv[optind];
 		dest_file = fopen(dest_path, "wb");
 		if (!dest_file)
@@ -337,17 +1260,44 @@ main(int argc, char *argv[])
 		rc = pcips_join_patches(dest_file,
 					(const char * const *)
 					argv + optind + 1,
-					remaining_args - 1);
+					remaining_args - 1, &join_opts);
+		break;
+
+	case MODE_BATCH:
+		if (remaining_args)
+		{
+			print_usage();
+			rc = PCIPS_EARGS;
+			break;
+		}
+
+		if (check || apply_opts.computed || lo.connect)
+		{
+			fprintf(stderr, "Error: -C, -k, -R, -S and --connect "
+				"cannot be used with -B.\n");
+			rc = PCIPS_EARGS;
+			break;
+		}
+
+		rc = apply_batch(patch_paths[0], in_place,
+			create_opts.threads, &apply_opts);
 		break;
 	}
 
 end:
-	if (patch_path)
-	{
-		free(patch_path);
-		if (patch_file)
-			fclose(patch_file);
-	}
+	if (stats_ptr)
+		pcips_stats_print(stats_ptr, stderr, STATS_JSON == lo.stats);
+
+	free(patch_paths);
+	pcips_patch_free(patch);
+	if (create_opts.index)
+		pcips_index_free(&index);
+
+	if (patch_file)
+		fclose(patch_file);
+
+	if (bps_file)
+		fclose(bps_file);
 
 	if (src_file)
 		fclose(src_file);
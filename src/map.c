@@ -0,0 +1,134 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "err.h"
+#include "map.h"
+
+#define READ_CHUNK 65536
+
+int
+pcips_file_is_regular(FILE *f)
+{
+	struct stat st;
+
+	if (fstat(fileno(f), &st) != 0)
+		return 0;
+
+	return S_ISREG(st.st_mode);
+}
+
+static int
+read_file(struct pcips_map *map, FILE *f)
+{
+	unsigned char *data = NULL, *tmp;
+	size_t n, cap = 0, len = 0;
+
+	rewind(f);
+	do
+	{
+		if (len == cap)
+		{
+			cap += READ_CHUNK;
+			tmp = realloc(data, cap);
+			if (!tmp)
+			{
+				free(data);
+				return PCIPS_ENOMEM;
+			}
+
+			data = tmp;
+		}
+
+		n = fread(data + len, 1, cap - len, f);
+		len += n;
+	}
+	while (n > 0);
+
+	if (ferror(f))
+	{
+		free(data);
+		return PCIPS_EIO;
+	}
+
+	map->data = data;
+	map->length = len;
+	map->mapped = 0;
+	return 0;
+}
+
+/*
+ * Makes the full contents of f available in memory. Regular files are mapped
+ * read-only; anything else (pipes, character devices) is read into a heap
+ * buffer instead. Release with pcips_unmap().
+ */
+int
+pcips_map_file(struct pcips_map *map, FILE *f)
+{
+	struct stat st;
+	void *p;
+
+	map->data = NULL;
+	map->length = 0;
+	map->mapped = 0;
+
+	if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode))
+		return read_file(map, f);
+
+	if (0 == st.st_size)
+		return 0;
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	if (MAP_FAILED == p)
+		return read_file(map, f);
+
+	map->data = p;
+	map->length = st.st_size;
+	map->mapped = 1;
+	return 0;
+}
+
+void
+pcips_unmap(struct pcips_map *map)
+{
+	if (map->mapped)
+		munmap(map->data, map->length);
+	else
+		free(map->data);
+
+	map->data = NULL;
+	map->length = 0;
+	map->mapped = 0;
+}
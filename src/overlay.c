@@ -0,0 +1,154 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "err.h"
+#include "overlay.h"
+
+void
+pcips_overlay_init(struct pcips_overlay *o)
+{
+	o->extents = NULL;
+	o->count = 0;
+	o->cap = 0;
+	o->end = 0;
+}
+
+/* index of the first extent that ends after offset */
+static long
+find(const struct pcips_overlay *o, long offset)
+{
+	long lo = 0, hi = o->count, mid;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (o->extents[mid].offset + o->extents[mid].length <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void
+trim_front(struct pcips_extent *e, long offset)
+{
+	long cut = offset - e->offset;
+
+	e->offset = offset;
+	e->length -= cut;
+	if (e->data)
+		e->data += cut;
+}
+
+/*
+ * Records that length bytes at offset are written, either from data or, if
+ * data is NULL, as repeats of value. Whatever was previously recorded for
+ * those bytes is discarded, so adding the records of a patch (or of several
+ * patches) in order leaves only the writes that survive, sorted by offset
+ * and never overlapping. data is not copied and must outlive the overlay.
+ */
+int
+pcips_overlay_add(struct pcips_overlay *o, long offset, long length,
+	const unsigned char *data, int value)
+{
+	long lo, hi, n, cap, end = offset + length;
+	struct pcips_extent left, right, *tmp;
+	int keep_left = 0, keep_right = 0;
+
+	if (end > o->end)
+		o->end = end;
+
+	if (0 == length)
+		return 0;
+
+	lo = find(o, offset);
+	for (hi = lo; hi < o->count && o->extents[hi].offset < end; ++hi)
+		;
+
+	if (lo < hi && o->extents[lo].offset < offset)
+	{
+		left = o->extents[lo];
+		left.length = offset - left.offset;
+		keep_left = 1;
+	}
+
+	if (lo < hi && o->extents[hi - 1].offset + o->extents[hi - 1].length
+		> end)
+	{
+		right = o->extents[hi - 1];
+		trim_front(&right, end);
+		keep_right = 1;
+	}
+
+	n = keep_left + 1 + keep_right;
+	if (o->count - (hi - lo) + n > o->cap)
+	{
+		cap = o->cap ? o->cap * 2 : 64;
+		if (cap < o->count + n)
+			cap = o->count + n;
+
+		tmp = realloc(o->extents, cap * sizeof *tmp);
+		if (!tmp)
+			return PCIPS_ENOMEM;
+
+		o->extents = tmp;
+		o->cap = cap;
+	}
+
+	memmove(o->extents + lo + n, o->extents + hi,
+		(o->count - hi) * sizeof o->extents[0]);
+	o->count += n - (hi - lo);
+
+	if (keep_left)
+		o->extents[lo++] = left;
+
+	o->extents[lo].offset = offset;
+	o->extents[lo].length = length;
+	o->extents[lo].data = data;
+	o->extents[lo].value = value;
+
+	if (keep_right)
+		o->extents[lo + 1] = right;
+
+	return 0;
+}
+
+void
+pcips_overlay_free(struct pcips_overlay *o)
+{
+	free(o->extents);
+	pcips_overlay_init(o);
+}
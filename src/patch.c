@@ -0,0 +1,232 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "err.h"
+#include "overlay.h"
+#include "patch.h"
+#include "reader.h"
+
+/*
+ * Copies the payloads that still point into an input being released, which
+ * occupies [lo, hi), into a new arena owned by the patch. Earlier arenas are
+ * left alone, so composing a chain of patches copies each byte only once.
+ */
+static int
+pack(struct pcips_patch *patch, const unsigned char *lo,
+	const unsigned char *hi)
+{
+	long i, size = 0;
+	unsigned char *arena, *p, **tmp;
+	struct pcips_extent *e;
+
+	for (i = 0; i < patch->writes.count; ++i)
+	{
+		e = &patch->writes.extents[i];
+		if (e->data && e->data >= lo && e->data < hi)
+			size += e->length;
+	}
+
+	if (0 == size)
+		return 0;
+
+	tmp = realloc(patch->arenas, (patch->n_arenas + 1) * sizeof *tmp);
+	if (!tmp)
+		return PCIPS_ENOMEM;
+
+	patch->arenas = tmp;
+
+	arena = malloc(size);
+	if (!arena)
+		return PCIPS_ENOMEM;
+
+	patch->arenas[patch->n_arenas++] = arena;
+
+	p = arena;
+	for (i = 0; i < patch->writes.count; ++i)
+	{
+		e = &patch->writes.extents[i];
+		if (e->data && e->data >= lo && e->data < hi)
+		{
+			memcpy(p, e->data, e->length);
+			e->data = p;
+			p += e->length;
+		}
+	}
+
+	return 0;
+}
+
+static struct pcips_patch *
+new_patch(void)
+{
+	struct pcips_patch *p;
+
+	p = malloc(sizeof *p);
+	if (!p)
+		return NULL;
+
+	p->format = &pcips_ips;
+	pcips_overlay_init(&p->writes);
+	p->arenas = NULL;
+	p->n_arenas = 0;
+	p->n_plain = p->n_rle = 0;
+	return p;
+}
+
+/* Adds the remaining records of an open patch on top of a loaded one. */
+static int
+add_records(struct pcips_patch *patch, struct pcips_reader *reader)
+{
+	int rc;
+	struct pcips_record rec;
+
+	/* a chain that includes IPS32 patches can only be written as IPS32 */
+	if (reader->format->offset_size > patch->format->offset_size)
+		patch->format = reader->format;
+
+	while ((rc = pcips_reader_next(reader, &rec)) > 0)
+	{
+		if (rec.size)
+		{
+			rc = pcips_overlay_add(&patch->writes, rec.offset,
+					rec.size, rec.data, 0);
+			++patch->n_plain;
+		}
+		else
+		{
+			rc = pcips_overlay_add(&patch->writes, rec.offset,
+					rec.rle_size, NULL, rec.rle_data);
+			++patch->n_rle;
+		}
+
+		if (rc)
+			break;
+	}
+
+	return rc < 0 ? reader->error : rc;
+}
+
+/*
+ * Parses and validates an IPS or IPS32 patch once, resolving overlapping
+ * records so that only the bytes each one finally writes are kept, sorted by
+ * offset.
+ * The result can be applied any number of times with pcips_patch_apply_to().
+ */
+int
+pcips_patch_load(struct pcips_patch **patch, FILE *f)
+{
+	int rc;
+	struct pcips_patch *p;
+
+	p = new_patch();
+	if (!p)
+		return PCIPS_ENOMEM;
+
+	rc = pcips_patch_append(p, f);
+	if (rc)
+		pcips_patch_free(p);
+	else
+		*patch = p;
+
+	return rc;
+}
+
+/*
+ * Like pcips_patch_load(), but for a patch held in memory. The payloads are
+ * not copied, so data must outlive the loaded patch.
+ */
+int
+pcips_patch_load_buffer(struct pcips_patch **patch, const unsigned char *data,
+	long length)
+{
+	int rc;
+	struct pcips_patch *p;
+	struct pcips_reader reader;
+
+	p = new_patch();
+	if (!p)
+		return PCIPS_ENOMEM;
+
+	rc = pcips_reader_open_buffer(&reader, data, length);
+	if (!rc)
+	{
+		rc = add_records(p, &reader);
+		pcips_reader_close(&reader);
+	}
+
+	if (rc)
+		pcips_patch_free(p);
+	else
+		*patch = p;
+
+	return rc;
+}
+
+/*
+ * Composes the IPS patch in f on top of a loaded patch, as if it were applied
+ * afterwards. On failure the loaded patch may be left partially updated and
+ * should be freed.
+ */
+int
+pcips_patch_append(struct pcips_patch *patch, FILE *f)
+{
+	int rc;
+	struct pcips_reader reader;
+
+	rc = pcips_reader_load(&reader, f);
+	if (rc)
+		return rc;
+
+	rc = add_records(patch, &reader);
+	if (!rc)
+		rc = pack(patch, reader.buf, reader.buf + reader.end);
+
+	pcips_reader_close(&reader);
+	return rc;
+}
+
+void
+pcips_patch_free(struct pcips_patch *patch)
+{
+	if (!patch)
+		return;
+
+	pcips_overlay_free(&patch->writes);
+	while (patch->n_arenas)
+		free(patch->arenas[--patch->n_arenas]);
+
+	free(patch->arenas);
+	free(patch);
+}
@@ -0,0 +1,475 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "copy.h"
+#include "err.h"
+#include "plan.h"
+#include "stats.h"
+#include "uring.h"
+
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define PLAN_BATCH IOV_MAX
+#else
+#define PLAN_BATCH 1024
+#endif
+
+/* largest run of unchanged bytes written back to join two extents */
+#define PLAN_GAP_SIZE 512
+
+/* most batches kept in flight with io_uring */
+#define PLAN_MAX_DEPTH 256
+
+#define FILL_SIZE 65536
+
+/* slices of the file covering one contiguous range, written by one call */
+struct batch
+{
+	struct iovec iov[PLAN_BATCH];
+	int count;
+	long start;
+	long size;
+};
+
+struct planner
+{
+	int fd;
+	long length;
+	const unsigned char *view;
+	unsigned char *fill[256];
+	struct batch *batches;
+	struct batch *cur;
+	int *idle;
+	int n_idle;
+	int in_flight;
+	int async;
+	int skip_unchanged;
+	struct pcips_stats *stats;
+	struct pcips_uring ring;
+	long pos;
+};
+
+static ssize_t
+write_at(int fd, const struct iovec *iov, int count, long offset)
+{
+#ifdef __linux__
+	return pwritev(fd, iov, count, offset);
+#else
+	if (lseek(fd, offset, SEEK_SET) != offset)
+		return -1;
+
+	return writev(fd, iov, count);
+#endif
+}
+
+/* Writes what remains of a batch after its first done bytes. */
+static int
+write_batch(int fd, struct batch *b, long done, struct pcips_stats *stats)
+{
+	ssize_t n = done;
+	struct iovec *iov = b->iov;
+	int count = b->count;
+	long offset = b->start;
+
+	for (;;)
+	{
+		offset += n;
+		while (count > 0 && (size_t) n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			++iov;
+			--count;
+		}
+
+		if (0 == count)
+			return 0;
+
+		iov->iov_base = (char *) iov->iov_base + n;
+		iov->iov_len -= n;
+
+		n = write_at(fd, iov, count, offset);
+		PCIPS_STAT_ADD(stats, syscalls, 1);
+		if (n < 0)
+		{
+			if (EINTR == errno)
+			{
+				n = 0;
+				continue;
+			}
+
+			return PCIPS_EIO;
+		}
+
+		if (0 == n)
+			return PCIPS_EIO;
+	}
+}
+
+/*
+ * Waits for one batch submitted to io_uring to complete. A short write is
+ * finished synchronously.
+ */
+static int
+reap(struct planner *p)
+{
+	unsigned long id;
+	long res;
+	struct batch *b;
+
+	if (pcips_uring_wait(&p->ring, &id, &res) != 0)
+	{
+		p->in_flight = 0;
+		return PCIPS_EIO;
+	}
+
+	--p->in_flight;
+	p->idle[p->n_idle++] = id;
+
+	b = &p->batches[id];
+	if (res < 0)
+		return PCIPS_EIO;
+
+	if (res < b->size)
+		return write_batch(p->fd, b, res, p->stats);
+
+	return 0;
+}
+
+/*
+ * Writes the current batch, or submits it to io_uring and moves on to an idle
+ * batch, waiting for one to complete if all of them are in flight.
+ */
+static int
+flush(struct planner *p)
+{
+	int rc = 0;
+	struct batch *b = p->cur;
+
+	if (0 == b->count)
+		return 0;
+
+	if (!p->async)
+	{
+		rc = write_batch(p->fd, b, 0, p->stats);
+	}
+	else
+	{
+		PCIPS_STAT_ADD(p->stats, syscalls, 1);
+		if (pcips_uring_writev(&p->ring, p->fd, b->iov, b->count,
+				b->start, b - p->batches) != 0)
+			return PCIPS_EIO;
+
+		++p->in_flight;
+		if (0 == p->n_idle)
+		{
+			rc = reap(p);
+			if (0 == p->n_idle)
+				return rc;
+		}
+
+		p->cur = &p->batches[p->idle[--p->n_idle]];
+	}
+
+	p->cur->count = 0;
+	p->cur->size = 0;
+	return rc;
+}
+
+static int
+queue_slice(struct planner *p, long offset, const unsigned char *data, long n)
+{
+	int rc;
+	struct batch *b;
+
+	if (PLAN_BATCH == p->cur->count)
+	{
+		rc = flush(p);
+		if (rc)
+			return rc;
+	}
+
+	b = p->cur;
+	if (0 == b->count)
+		b->start = offset;
+
+	b->iov[b->count].iov_base = (void *) data;
+	b->iov[b->count].iov_len = n;
+	++b->count;
+	b->size += n;
+
+	p->pos = offset + n;
+	return 0;
+}
+
+/*
+ * Queues n bytes to be written at offset. A write that does not continue the
+ * current range starts a new one, unless the gap is short enough to be
+ * filled with the file's own bytes from its mapping.
+ */
+static int
+queue(struct planner *p, long offset, const unsigned char *data, long n)
+{
+	int rc;
+
+	if (p->cur->count > 0 && offset != p->pos)
+	{
+		if (p->view && offset - p->pos <= PLAN_GAP_SIZE
+			&& offset <= p->length)
+		{
+			PCIPS_STAT_ADD(p->stats, padding_bytes,
+				offset - p->pos);
+			rc = queue_slice(p, p->pos, p->view + p->pos,
+				offset - p->pos);
+		}
+		else
+		{
+			rc = flush(p);
+		}
+
+		if (rc)
+			return rc;
+	}
+
+	return queue_slice(p, offset, data, n);
+}
+
+/*
+ * Tells whether n bytes at offset already hold data, or n copies of value if
+ * data is NULL, so that writing them can be skipped. This is only checked
+ * when requested, since it reads every byte the patch would write.
+ */
+static int
+unchanged(const struct planner *p, long offset, const unsigned char *data,
+	int value, long n)
+{
+	const unsigned char *cur;
+	long i;
+
+	if (!p->skip_unchanged || !p->view || offset + n > p->length)
+		return 0;
+
+	cur = p->view + offset;
+	if (data)
+		return memcmp(cur, data, n) == 0;
+
+	for (i = 0; i < n; ++i)
+	{
+		if (cur[i] != value)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Queues a run of n copies of value, sharing one buffer per value. */
+static int
+queue_run(struct planner *p, long offset, int value, long n)
+{
+	int rc;
+	long size;
+
+	if (!p->fill[value])
+	{
+		p->fill[value] = malloc(FILL_SIZE);
+		if (!p->fill[value])
+			return PCIPS_ENOMEM;
+
+		memset(p->fill[value], value, FILL_SIZE);
+	}
+
+	for (; n > 0; offset += size, n -= size)
+	{
+		size = n < FILL_SIZE ? n : FILL_SIZE;
+		rc = queue(p, offset, p->fill[value], size);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+/*
+ * Clears n bytes at offset. Bytes at or beyond the original length are
+ * already zero, and long runs are punched out of the file where the
+ * filesystem allows it.
+ */
+static int
+queue_zeros(struct planner *p, long offset, long n)
+{
+	if (offset >= p->length)
+		return 0;
+
+	if (offset + n > p->length)
+		n = p->length - offset;
+
+	if (unchanged(p, offset, NULL, 0, n))
+		return 0;
+
+	if (n >= PCIPS_PUNCH_MIN_SIZE
+		&& pcips_punch_hole(p->fd, offset, n, p->stats) == 0)
+		return 0;
+
+	return queue_run(p, offset, 0, n);
+}
+
+/*
+ * Writes the extents of an overlay to fd with positioned, vectored writes.
+ * The extents are already sorted and free of overlaps, so runs of adjacent or
+ * nearby extents become a single write, and up to PLAN_BATCH of them are
+ * passed to the kernel at once. The file must already be at least o->end
+ * bytes long, and length is its size before it was extended.
+ *
+ * If opts->queue_depth is positive, the writes are submitted through io_uring
+ * with up to that many in flight. Where io_uring is not available they are
+ * made synchronously instead. With opts->skip_unchanged, extents that the
+ * file already holds are not written at all.
+ */
+int
+pcips_plan_write(int fd, const struct pcips_overlay *o, long length,
+	const struct pcips_apply_options *opts)
+{
+	int rc = 0, i, depth = 1, queue_depth = opts ? opts->queue_depth : 0;
+	long j, n;
+	const struct pcips_extent *e, *next;
+	struct planner *p;
+	void *view;
+
+	p = malloc(sizeof *p);
+	if (!p)
+		return PCIPS_ENOMEM;
+
+	p->fd = fd;
+	p->length = length;
+	p->view = NULL;
+	p->pos = 0;
+	p->in_flight = 0;
+	p->skip_unchanged = opts ? opts->skip_unchanged : 0;
+	p->stats = opts ? opts->stats : NULL;
+	for (i = 0; i < 256; ++i)
+		p->fill[i] = NULL;
+
+	if (queue_depth > PLAN_MAX_DEPTH)
+		queue_depth = PLAN_MAX_DEPTH;
+
+	p->async = queue_depth > 0
+		&& pcips_uring_init(&p->ring, queue_depth) == 0;
+	if (p->async)
+		depth = queue_depth + 1;
+
+	p->batches = malloc(depth * sizeof *p->batches);
+	p->idle = malloc(depth * sizeof *p->idle);
+	if (!p->batches || !p->idle)
+	{
+		rc = PCIPS_ENOMEM;
+		goto end;
+	}
+
+	/* the first batch is filled while the others wait to be used */
+	p->cur = p->batches;
+	p->cur->count = 0;
+	p->cur->size = 0;
+	for (p->n_idle = 0; p->n_idle < depth - 1; ++p->n_idle)
+		p->idle[p->n_idle] = depth - 1 - p->n_idle;
+
+	if (length > 0)
+	{
+		view = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+		if (view != MAP_FAILED)
+			p->view = view;
+	}
+
+	for (j = 0; !rc && j < o->count; ++j)
+	{
+		e = &o->extents[j];
+		if (e->data)
+		{
+			if (!unchanged(p, e->offset, e->data, 0, e->length))
+				rc = queue(p, e->offset, e->data, e->length);
+		}
+		else if (e->value != 0)
+		{
+			if (!unchanged(p, e->offset, NULL, e->value, e->length))
+				rc = queue_run(p, e->offset, e->value,
+					e->length);
+		}
+		else
+		{
+			/* clear adjacent runs of zeros together */
+			n = e->length;
+			for (next = e + 1; j + 1 < o->count && !next->data
+				&& 0 == next->value
+				&& next->offset == e->offset + n; ++next, ++j)
+			{
+				n += next->length;
+			}
+
+			rc = queue_zeros(p, e->offset, n);
+		}
+	}
+
+	if (!rc)
+		rc = flush(p);
+
+	/* nothing can be released while the kernel may still read it */
+	while (p->in_flight > 0)
+	{
+		i = reap(p);
+		if (!rc)
+			rc = i;
+	}
+
+end:
+	if (p->async)
+		pcips_uring_exit(&p->ring);
+
+	if (p->view)
+		munmap((void *) p->view, length);
+
+	for (i = 0; i < 256; ++i)
+		free(p->fill[i]);
+
+	free(p->idle);
+	free(p->batches);
+	free(p);
+	return rc;
+}
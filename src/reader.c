@@ -0,0 +1,294 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "err.h"
+#include "format.h"
+#include "map.h"
+#include "reader.h"
+
+/* must be able to hold the largest possible record */
+#define READER_BLOCK_SIZE 262144L
+
+static unsigned long
+unbuffer(const unsigned char *buf, int nmemb)
+{
+	unsigned long value = 0;
+	int i;
+
+	for (i = 0; i < nmemb; ++i)
+	{
+		value <<= 8;
+		value |= buf[i];
+	}
+
+	return value;
+}
+
+/*
+ * Makes at least n bytes available at r->buf + r->start unless the end of the
+ * patch is reached first. Returns the number of bytes available.
+ */
+static long
+fill(struct pcips_reader *r, long n)
+{
+	size_t got;
+	long avail = r->end - r->start;
+
+	if (avail >= n || r->eof)
+		return avail;
+
+	memmove(r->buf, r->buf + r->start, avail);
+	r->start = 0;
+	r->end = avail;
+
+	while (r->end < n && !r->eof)
+	{
+		got = fread(r->buf + r->end, 1, READER_BLOCK_SIZE - r->end,
+			r->file);
+		r->end += got;
+
+		if (0 == got)
+		{
+			r->eof = 1;
+			if (ferror(r->file))
+				r->error = PCIPS_EIO;
+		}
+	}
+
+	return r->end;
+}
+
+/* Checks the header and detects whether the patch is IPS or IPS32. */
+static int
+read_header(struct pcips_reader *r)
+{
+	if (fill(r, FILE_HEADER_SIZE) < FILE_HEADER_SIZE)
+		return r->error ? r->error : PCIPS_EFILE;
+
+	r->format = pcips_format_detect(r->buf + r->start);
+	if (!r->format)
+		return PCIPS_EFILE;
+
+	r->start += FILE_HEADER_SIZE;
+	return 0;
+}
+
+static int
+open_reader(struct pcips_reader *r, FILE *patch, int whole)
+{
+	int rc;
+
+	r->file = patch;
+	r->format = NULL;
+	r->buf = NULL;
+	r->start = 0;
+	r->end = 0;
+	r->eof = 0;
+	r->error = 0;
+	r->map.data = NULL;
+	r->map.length = 0;
+	r->map.mapped = 0;
+
+	if (whole || pcips_file_is_regular(patch))
+	{
+		rc = pcips_map_file(&r->map, patch);
+		if (rc)
+			return rc;
+	}
+
+	if (r->map.data)
+	{
+		r->buf = r->map.data;
+		r->end = r->map.length;
+		r->eof = 1;
+	}
+	else
+	{
+		r->buf = malloc(READER_BLOCK_SIZE);
+		if (!r->buf)
+			return PCIPS_ENOMEM;
+
+		rewind(patch);
+	}
+
+	rc = read_header(r);
+	if (rc)
+		pcips_reader_close(r);
+
+	return rc;
+}
+
+/*
+ * Prepares to read the records of an IPS or IPS32 patch from its beginning.
+ * Patches stored in regular files are mapped; anything else is read in large
+ * blocks. Either way, records are handed out without copying their payloads.
+ */
+int
+pcips_reader_open(struct pcips_reader *r, FILE *patch)
+{
+	return open_reader(r, patch, 0);
+}
+
+/*
+ * Like pcips_reader_open(), but always holds the whole patch in memory so
+ * that record payloads stay valid until the reader is closed.
+ */
+int
+pcips_reader_load(struct pcips_reader *r, FILE *patch)
+{
+	return open_reader(r, patch, 1);
+}
+
+/*
+ * Reads the patch held in memory at data without copying it. data must stay
+ * valid until the reader is closed, and so do the record payloads.
+ */
+int
+pcips_reader_open_buffer(struct pcips_reader *r, const unsigned char *data,
+	long length)
+{
+	r->file = NULL;
+	r->format = NULL;
+	r->buf = (unsigned char *) data;
+	r->start = 0;
+	r->end = length;
+	r->eof = 1;
+	r->error = 0;
+	r->map.data = NULL;
+	r->map.length = 0;
+	r->map.mapped = 0;
+
+	return read_header(r);
+}
+
+/*
+ * Reads the next record. Returns 1 if a record was read, 0 if the footer was
+ * reached, or -1 on error, in which case r->error holds the error code. The
+ * record's data pointers remain valid until the next call.
+ */
+int
+pcips_reader_next(struct pcips_reader *r, struct pcips_record *rec)
+{
+	const struct pcips_format *fmt = r->format;
+	const unsigned char *p;
+	long avail, need, header_size = RECORD_HEADER_SIZE(fmt);
+
+	avail = fill(r, header_size);
+	if (r->error)
+		return -1;
+
+	p = r->buf + r->start;
+	if (avail < header_size)
+	{
+		if (fmt->footer_size == avail
+			&& memcmp(p, fmt->footer, fmt->footer_size) == 0)
+			return 0;
+
+		r->error = PCIPS_EFILE;
+		return -1;
+	}
+
+	if (unbuffer(p, fmt->offset_size) > (unsigned long) fmt->max_offset)
+	{
+		r->error = PCIPS_EFILE;
+		return -1;
+	}
+
+	rec->offset = unbuffer(p, fmt->offset_size);
+	rec->size = unbuffer(&p[fmt->offset_size], IPS_SIZE_SIZE);
+
+	need = rec->size ? header_size + (long) rec->size : RLE_SIZE(fmt);
+	if (fill(r, need) < need)
+	{
+		if (!r->error)
+			r->error = PCIPS_EFILE;
+
+		return -1;
+	}
+
+	p = r->buf + r->start;
+	if (0 == rec->size) /* RLE record */
+	{
+		rec->rle_size = unbuffer(&p[header_size], IPS_SIZE_SIZE);
+		rec->rle_data = p[header_size + IPS_SIZE_SIZE];
+		rec->data = NULL;
+	}
+	else
+	{
+		rec->rle_size = 0;
+		rec->rle_data = -1;
+		rec->data = p + header_size;
+	}
+
+	rec->raw = p;
+	rec->raw_size = need;
+	r->start += need;
+
+	return 1;
+}
+
+int
+pcips_reader_rewind(struct pcips_reader *r)
+{
+	r->error = 0;
+	if (r->map.data || !r->file)
+	{
+		r->start = 0;
+	}
+	else
+	{
+		rewind(r->file);
+		if (ferror(r->file))
+			return PCIPS_EIO;
+
+		r->start = 0;
+		r->end = 0;
+		r->eof = 0;
+	}
+
+	return read_header(r);
+}
+
+void
+pcips_reader_close(struct pcips_reader *r)
+{
+	if (r->map.data)
+		pcips_unmap(&r->map);
+	else if (r->file)
+		free(r->buf);
+
+	r->buf = NULL;
+}
@@ -0,0 +1,82 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#ifndef PCIPS_READER_H
+#define PCIPS_READER_H
+
+#include <stdio.h>
+
+#include "format.h"
+#include "map.h"
+
+struct pcips_record
+{
+	long offset;
+	unsigned int size;
+	unsigned int rle_size;
+	const unsigned char *data;
+	int rle_data;
+	const unsigned char *raw;
+	long raw_size;
+};
+
+struct pcips_reader
+{
+	FILE *file;
+	const struct pcips_format *format;
+	struct pcips_map map;
+	unsigned char *buf;
+	long start;
+	long end;
+	int eof;
+	int error;
+};
+
+int
+pcips_reader_open(struct pcips_reader *r, FILE *patch);
+
+int
+pcips_reader_load(struct pcips_reader *r, FILE *patch);
+
+int
+pcips_reader_open_buffer(struct pcips_reader *r, const unsigned char *data,
+	long length);
+
+int
+pcips_reader_next(struct pcips_reader *r, struct pcips_record *rec);
+
+int
+pcips_reader_rewind(struct pcips_reader *r);
+
+void
+pcips_reader_close(struct pcips_reader *r);
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+#define ONES (~0UL / 0xFF)
+#define HIGHS (ONES << 7)
+
+/* nonzero if any byte of x is zero */
+#define HAS_ZERO_BYTE(x) (((x) - ONES) & ~(x) & HIGHS)
+
+static long
+mismatch_portable(const unsigned char *a, const unsigned char *b, long n)
+{
+	unsigned long wa, wb;
+	long i = 0;
+
+	for (; i + (long) sizeof wa <= n; i += sizeof wa)
+	{
+		memcpy(&wa, a + i, sizeof wa);
+		memcpy(&wb, b + i, sizeof wb);
+		if (wa != wb)
+			break;
+	}
+
+	for (; i < n; ++i)
+	{
+		if (a[i] != b[i])
+			break;
+	}
+
+	return i;
+}
+
+static long
+match_portable(const unsigned char *a, const unsigned char *b, long n)
+{
+	unsigned long wa, wb, x;
+	long i = 0;
+
+	for (; i + (long) sizeof wa <= n; i += sizeof wa)
+	{
+		memcpy(&wa, a + i, sizeof wa);
+		memcpy(&wb, b + i, sizeof wb);
+		x = wa ^ wb;
+		if (HAS_ZERO_BYTE(x))
+			break;
+	}
+
+	for (; i < n; ++i)
+	{
+		if (a[i] == b[i])
+			break;
+	}
+
+	return i;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static long
+mismatch_sse2(const unsigned char *a, const unsigned char *b, long n)
+{
+	__m128i va, vb;
+	unsigned int mask;
+	long i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		va = _mm_loadu_si128((const __m128i *) (a + i));
+		vb = _mm_loadu_si128((const __m128i *) (b + i));
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+		if (mask != 0xFFFF)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + mismatch_portable(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static long
+match_sse2(const unsigned char *a, const unsigned char *b, long n)
+{
+	__m128i va, vb;
+	unsigned int mask;
+	long i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		va = _mm_loadu_si128((const __m128i *) (a + i));
+		vb = _mm_loadu_si128((const __m128i *) (b + i));
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + match_portable(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static long
+mismatch_avx2(const unsigned char *a, const unsigned char *b, long n)
+{
+	__m256i va, vb;
+	unsigned int mask;
+	long i;
+
+	for (i = 0; i + 32 <= n; i += 32)
+	{
+		va = _mm256_loadu_si256((const __m256i *) (a + i));
+		vb = _mm256_loadu_si256((const __m256i *) (b + i));
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (mask != 0xFFFFFFFFU)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + mismatch_sse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static long
+match_avx2(const unsigned char *a, const unsigned char *b, long n)
+{
+	__m256i va, vb;
+	unsigned int mask;
+	long i;
+
+	for (i = 0; i + 32 <= n; i += 32)
+	{
+		va = _mm256_loadu_si256((const __m256i *) (a + i));
+		vb = _mm256_loadu_si256((const __m256i *) (b + i));
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + match_sse2(a + i, b + i, n - i);
+}
+#endif
+
+/*
+ * Returns the index of the first byte that differs between a and b, or n if
+ * the first n bytes are identical. The widest vector unit supported by the
+ * running CPU is used.
+ */
+long
+pcips_mismatch(const unsigned char *a, const unsigned char *b, long n)
+{
+#ifdef SCAN_X86
+	if (__builtin_cpu_supports("avx2"))
+		return mismatch_avx2(a, b, n);
+
+	if (__builtin_cpu_supports("sse2"))
+		return mismatch_sse2(a, b, n);
+#endif
+
+	return mismatch_portable(a, b, n);
+}
+
+/*
+ * Returns the index of the first byte that is the same in a and b, or n if
+ * the first n bytes all differ.
+ */
+long
+pcips_match(const unsigned char *a, const unsigned char *b, long n)
+{
+#ifdef SCAN_X86
+	if (__builtin_cpu_supports("avx2"))
+		return match_avx2(a, b, n);
+
+	if (__builtin_cpu_supports("sse2"))
+		return match_sse2(a, b, n);
+#endif
+
+	return match_portable(a, b, n);
+}
@@ -0,0 +1,912 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "apply.h"
+#include "bps.h"
+#include "cache.h"
+#include "create.h"
+#include "err.h"
+#include "format.h"
+#include "join.h"
+#include "map.h"
+#include "serve.h"
+#include "sink.h"
+
+#define DEFAULT_WORKERS 4
+#define DEFAULT_CACHE_SIZE 64
+
+/* connections accepted but not yet taken by a worker */
+#define PENDING_MAX 128
+
+/* largest job accepted, and most descriptors passed with one */
+#define JOB_MAX_SIZE 65536L
+#define JOB_MAX_FDS 8
+
+#define MSG_SIZE 512
+
+struct server;
+
+struct worker
+{
+	pthread_t thread;
+	struct server *server;
+	int conn;
+	int started;
+
+	/* kept from one job to the next so that they are only allocated once */
+	char *buf;
+	long used;
+	const char **fields;
+	int fields_cap;
+	int fds[JOB_MAX_FDS];
+	int n_fds;
+	struct pcips_sink out;
+};
+
+struct server
+{
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t space;
+	int pending[PENDING_MAX];
+	int head;
+	int n_pending;
+	int stopping;
+	struct pcips_cache cache;
+	struct worker *workers;
+	int n_workers;
+};
+
+static void
+close_fds(struct worker *w)
+{
+	int i;
+
+	for (i = 0; i < w->n_fds; ++i)
+	{
+		if (w->fds[i] >= 0)
+			close(w->fds[i]);
+	}
+
+	w->n_fds = 0;
+}
+
+/* Keeps the descriptors passed in a message, closing any beyond the limit. */
+static void
+take_fds(struct worker *w, struct msghdr *mh)
+{
+	struct cmsghdr *cmsg;
+	unsigned char *p;
+	int fd;
+	size_t i, n;
+
+	for (cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET
+			|| cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		p = CMSG_DATA(cmsg);
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof fd;
+		for (i = 0; i < n; ++i)
+		{
+			memcpy(&fd, p + i * sizeof fd, sizeof fd);
+			if (w->n_fds < JOB_MAX_FDS)
+				w->fds[w->n_fds++] = fd;
+			else
+				close(fd);
+		}
+	}
+}
+
+/*
+ * Splits the start of the buffer into fields if it holds a whole job, and
+ * returns how many there are, 0 if more must be received first, or -2 if
+ * the job is complete but has no fields at all.
+ */
+static int
+split_job(struct worker *w, long *size)
+{
+	int n = 0;
+	long pos = 0;
+	char *nul;
+	const char **tmp;
+
+	while (pos < w->used)
+	{
+		nul = memchr(w->buf + pos, '\0', w->used - pos);
+		if (!nul)
+			break;
+
+		if (nul == w->buf + pos)
+		{
+			*size = pos + 1;
+			return n ? n : -2;
+		}
+
+		if (n == w->fields_cap)
+		{
+			tmp = realloc(w->fields,
+				(w->fields_cap + 16) * sizeof *tmp);
+			if (!tmp)
+				return -1;
+
+			w->fields = tmp;
+			w->fields_cap += 16;
+		}
+
+		w->fields[n++] = w->buf + pos;
+		pos = nul - w->buf + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Receives the next job on a worker's connection. Returns the number of
+ * fields, 0 when the client is done, -1 if the job cannot be read, or -2
+ * if it was read but has too few fields to be run.
+ */
+static int
+read_job(struct worker *w, long *size)
+{
+	int n;
+	long got;
+	struct msghdr mh;
+	struct iovec iov;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(JOB_MAX_FDS * sizeof(int))];
+	} control;
+
+	for (;;)
+	{
+		n = split_job(w, size);
+		if (n != 0)
+			return 1 == n ? -2 : n;
+
+		if (w->used == JOB_MAX_SIZE)
+			return -1;
+
+		if (!w->buf)
+		{
+			w->buf = malloc(JOB_MAX_SIZE);
+			if (!w->buf)
+				return -1;
+		}
+
+		memset(&mh, 0, sizeof mh);
+		iov.iov_base = w->buf + w->used;
+		iov.iov_len = JOB_MAX_SIZE - w->used;
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control.buf;
+		mh.msg_controllen = sizeof control.buf;
+
+		got = recvmsg(w->conn, &mh, 0);
+		if (got < 0 && EINTR == errno)
+			continue;
+
+		if (got <= 0)
+			return got < 0 ? -1 : 0;
+
+		take_fds(w, &mh);
+		w->used += got;
+	}
+}
+
+/*
+ * Opens a path named in a job, or takes the next descriptor passed with it
+ * if the path is "-". Passed descriptors are opened with fd_mode, since they
+ * may not allow everything that mode asks for.
+ */
+static FILE *
+open_path(struct worker *w, const char *path, const char *mode,
+	const char *fd_mode, int *next_fd)
+{
+	FILE *f;
+
+	if (strcmp(path, "-") != 0)
+		return fopen(path, mode);
+
+	if (*next_fd >= w->n_fds)
+	{
+		errno = EBADF;
+		return NULL;
+	}
+
+	f = fdopen(w->fds[*next_fd], fd_mode);
+	if (f)
+		w->fds[*next_fd] = -1;
+
+	++*next_fd;
+	return f;
+}
+
+static int
+open_error(const char *path, char *msg)
+{
+	sprintf(msg, "Error opening %.256s: %.128s", path, strerror(errno));
+	return PCIPS_EARGS;
+}
+
+static int
+close_output(FILE *f, int rc)
+{
+	if (fclose(f) == EOF && !rc)
+		return PCIPS_EIO;
+
+	return rc;
+}
+
+/* apply PATCH SOURCE OUTPUT, patching in place if both paths are the same */
+static int
+apply_job(struct worker *w, const char **paths, const char *flags, char *msg)
+{
+	int rc, next_fd = 0, in_place;
+	FILE *patch_file, *src = NULL, *dest = NULL;
+	struct pcips_cache_entry *entry = NULL;
+	struct pcips_patch *patch = NULL;
+	struct pcips_apply_options opts;
+
+	memset(&opts, 0, sizeof opts);
+	opts.skip_unchanged = strchr(flags, 's') != NULL;
+	opts.stream_dest = strcmp(paths[2], "-") == 0;
+	in_place = strcmp(paths[1], paths[2]) == 0
+		&& strcmp(paths[1], "-") != 0;
+
+	patch_file = open_path(w, paths[0], "rb", "rb", &next_fd);
+	if (!patch_file)
+		return open_error(paths[0], msg);
+
+	src = open_path(w, paths[1], in_place ? "rb+" : "rb", "rb", &next_fd);
+	if (!src)
+	{
+		rc = open_error(paths[1], msg);
+		goto end;
+	}
+
+	dest = in_place ? src : open_path(w, paths[2], "wb+", "wb", &next_fd);
+	if (!dest)
+	{
+		rc = open_error(paths[2], msg);
+		goto end;
+	}
+
+	if (pcips_bps_detect(patch_file))
+	{
+		rc = pcips_bps_apply(patch_file, src, dest, &opts);
+		goto end;
+	}
+
+	/* only patches named by path can be found again */
+	if (strcmp(paths[0], "-") == 0)
+	{
+		rc = pcips_patch_load(&patch, patch_file);
+	}
+	else
+	{
+		rc = pcips_cache_get(&w->server->cache, paths[0], patch_file,
+			&entry);
+		if (!rc)
+			patch = entry->patch;
+	}
+
+	if (!rc)
+		rc = pcips_patch_apply_to(patch, src, dest, &opts);
+
+end:
+	if (rc && !msg[0])
+		sprintf(msg, "Error applying patch: %s", pcips_strerror(rc));
+
+	if (entry)
+		pcips_cache_release(&w->server->cache, entry);
+	else
+		pcips_patch_free(patch);
+
+	if (dest)
+		rc = close_output(dest, rc);
+
+	if (src && src != dest)
+		fclose(src);
+
+	fclose(patch_file);
+	return rc;
+}
+
+/*
+ * create PATCH SOURCE MODIFIED. The patch is built in the worker's buffer, so
+ * a failed job leaves an existing patch file alone.
+ */
+static int
+create_job(struct worker *w, const char **paths, const char *flags, char *msg)
+{
+	int rc, next_fd = 0;
+	FILE *src, *mod = NULL, *patch;
+	struct pcips_map src_map, mod_map;
+	struct pcips_create_options opts;
+
+	opts.threads = 1;
+	opts.optimal = strchr(flags, 'O') != NULL;
+	opts.format = strchr(flags, 'L') ? &pcips_ips32 : NULL;
+	opts.bps = strchr(flags, 'b') != NULL;
+	opts.index = NULL;
+	opts.stats = NULL;
+	src_map.data = mod_map.data = NULL;
+	src_map.length = mod_map.length = 0;
+	src_map.mapped = mod_map.mapped = 0;
+
+	src = open_path(w, paths[1], "rb", "rb", &next_fd);
+	if (!src)
+		return open_error(paths[1], msg);
+
+	mod = open_path(w, paths[2], "rb", "rb", &next_fd);
+	if (!mod)
+	{
+		rc = open_error(paths[2], msg);
+		goto end;
+	}
+
+	rc = pcips_map_file(&src_map, src);
+	if (!rc)
+		rc = pcips_map_file(&mod_map, mod);
+
+	w->out.length = 0;
+	if (!rc)
+		rc = pcips_create_buffer(src_map.data, src_map.length,
+			mod_map.data, mod_map.length, &w->out, &opts);
+
+	if (rc)
+		goto end;
+
+	patch = open_path(w, paths[0], "wb", "wb", &next_fd);
+	if (!patch)
+	{
+		rc = open_error(paths[0], msg);
+		goto end;
+	}
+
+	if (fwrite(w->out.data, 1, w->out.length, patch)
+		!= (size_t) w->out.length)
+		rc = PCIPS_EIO;
+
+	rc = close_output(patch, rc);
+
+end:
+	if (rc && !msg[0])
+		sprintf(msg, "Error creating patch: %s", pcips_strerror(rc));
+
+	pcips_unmap(&mod_map);
+	pcips_unmap(&src_map);
+
+	if (mod)
+		fclose(mod);
+
+	fclose(src);
+	return rc;
+}
+
+/* join OUTPUT PATCH1 PATCH2 ... */
+static int
+join_job(struct worker *w, const char **paths, int n, const char *flags,
+	char *msg)
+{
+	int rc, i, next_fd = 0;
+	FILE *dest;
+	struct pcips_join_options opts;
+
+	for (i = 1; i < n; ++i)
+	{
+		if (strcmp(paths[i], "-") == 0)
+		{
+			strcpy(msg, "Error: patches to join must be paths");
+			return PCIPS_EARGS;
+		}
+	}
+
+	opts.compact = strchr(flags, 'O') != NULL;
+	opts.format = strchr(flags, 'L') ? &pcips_ips32 : NULL;
+	opts.stats = NULL;
+
+	dest = open_path(w, paths[0], "wb", "wb", &next_fd);
+	if (!dest)
+		return open_error(paths[0], msg);
+
+	rc = close_output(dest, pcips_join_patches(dest, paths + 1, n - 1,
+			&opts));
+	if (rc)
+		sprintf(msg, "Error joining patches: %s", pcips_strerror(rc));
+
+	return rc;
+}
+
+static int
+run_job(struct worker *w, int n, char *msg)
+{
+	const char *job = w->fields[0], *flags = w->fields[1];
+	const char **paths = w->fields + 2;
+
+	n -= 2;
+	if ('-' != flags[0])
+		return PCIPS_EARGS;
+
+	if (strcmp(job, PCIPS_JOB_APPLY) == 0 && 3 == n)
+		return apply_job(w, paths, flags + 1, msg);
+
+	if (strcmp(job, PCIPS_JOB_CREATE) == 0 && 3 == n)
+		return create_job(w, paths, flags + 1, msg);
+
+	if (strcmp(job, PCIPS_JOB_JOIN) == 0 && n >= 2)
+		return join_job(w, paths, n, flags + 1, msg);
+
+	return PCIPS_EARGS;
+}
+
+static int
+send_all(int fd, const char *data, size_t n)
+{
+	ssize_t sent;
+
+	while (n > 0)
+	{
+		sent = send(fd, data, n, MSG_NOSIGNAL);
+		if (sent < 0 && EINTR == errno)
+			continue;
+
+		if (sent < 0)
+			return -1;
+
+		data += sent;
+		n -= sent;
+	}
+
+	return 0;
+}
+
+/* Runs the jobs sent on a connection one after another until it closes. */
+static void
+serve_connection(struct worker *w)
+{
+	int rc, n;
+	long size;
+	char msg[MSG_SIZE], reply[MSG_SIZE + 16];
+
+	w->used = 0;
+	for (;;)
+	{
+		n = read_job(w, &size);
+		if (n <= 0 && n != -2)
+			break;
+
+		msg[0] = '\0';
+		rc = n < 0 ? PCIPS_EARGS : run_job(w, n, msg);
+		sprintf(reply, "%d %s\n", rc,
+			msg[0] ? msg : pcips_strerror(rc));
+		close_fds(w);
+
+		memmove(w->buf, w->buf + size, w->used - size);
+		w->used -= size;
+
+		if (send_all(w->conn, reply, strlen(reply)) != 0)
+			break;
+	}
+
+	close_fds(w);
+}
+
+static void *
+work(void *arg)
+{
+	int conn;
+	struct worker *w = arg;
+	struct server *s = w->server;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&s->lock);
+		while (0 == s->n_pending && !s->stopping)
+			pthread_cond_wait(&s->ready, &s->lock);
+
+		if (s->stopping)
+		{
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+
+		conn = s->pending[s->head];
+		s->head = (s->head + 1) % PENDING_MAX;
+		--s->n_pending;
+		w->conn = conn;
+		pthread_cond_signal(&s->space);
+		pthread_mutex_unlock(&s->lock);
+
+		serve_connection(w);
+
+		pthread_mutex_lock(&s->lock);
+		w->conn = -1;
+		pthread_mutex_unlock(&s->lock);
+		close(conn);
+	}
+
+	return NULL;
+}
+
+/* Hands a connection to the workers, waiting while they are all behind. */
+static void
+enqueue(struct server *s, int conn)
+{
+	pthread_mutex_lock(&s->lock);
+	while (PENDING_MAX == s->n_pending)
+		pthread_cond_wait(&s->space, &s->lock);
+
+	s->pending[(s->head + s->n_pending++) % PENDING_MAX] = conn;
+	pthread_cond_signal(&s->ready);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Wakes the workers to exit. Connections being served are shut down, so a
+ * worker finishes the job it is running and then stops waiting for more.
+ */
+static void
+stop_workers(struct server *s)
+{
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	s->stopping = 1;
+	for (i = 0; i < s->n_workers; ++i)
+	{
+		if (s->workers[i].conn >= 0)
+			shutdown(s->workers[i].conn, SHUT_RDWR);
+	}
+
+	pthread_cond_broadcast(&s->ready);
+	pthread_mutex_unlock(&s->lock);
+
+	for (i = 0; i < s->n_workers; ++i)
+	{
+		if (s->workers[i].started)
+			pthread_join(s->workers[i].thread, NULL);
+
+		free(s->workers[i].buf);
+		free(s->workers[i].fields);
+		free(s->workers[i].out.data);
+	}
+
+	while (s->n_pending)
+	{
+		close(s->pending[s->head]);
+		s->head = (s->head + 1) % PENDING_MAX;
+		--s->n_pending;
+	}
+}
+
+static int
+set_address(struct sockaddr_un *addr, const char *path)
+{
+	if (strlen(path) >= sizeof addr->sun_path)
+		return PCIPS_EARGS;
+
+	memset(addr, 0, sizeof *addr);
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+static int
+connect_to(const struct sockaddr_un *addr)
+{
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (const struct sockaddr *) addr, sizeof *addr) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Listens on a Unix socket at path. A socket left behind by a server that is
+ * no longer running is replaced, but one that still answers is not. Jobs
+ * read and write files with the server's rights, so only its own user may
+ * connect; the mode is set before listening, so nobody can get in first.
+ */
+static int
+listen_on(const char *path, int *fd)
+{
+	int rc, probe, bound, err;
+	struct sockaddr_un addr;
+
+	rc = set_address(&addr, path);
+	if (rc)
+		return rc;
+
+	*fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (*fd < 0)
+		return PCIPS_EIO;
+
+	bound = bind(*fd, (struct sockaddr *) &addr, sizeof addr) == 0;
+	if (!bound && EADDRINUSE == errno)
+	{
+		probe = connect_to(&addr);
+		if (probe >= 0)
+		{
+			close(probe);
+			errno = EADDRINUSE;
+		}
+		else if (unlink(path) == 0)
+		{
+			bound = bind(*fd, (struct sockaddr *) &addr,
+				sizeof addr) == 0;
+		}
+	}
+
+	if (!bound || chmod(path, S_IRUSR | S_IWUSR) != 0
+		|| listen(*fd, SOMAXCONN) != 0)
+	{
+		/* left in errno for the caller to report */
+		err = errno;
+		close(*fd);
+		errno = err;
+		return PCIPS_EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Serves apply, create and join jobs sent to a Unix socket at socket_path by
+ * pcips_serve_submit(). Connections are handed to a pool of workers, each
+ * running the jobs sent on one connection in order, and IPS patches named by
+ * path stay loaded between jobs, in a cache of the most recently used ones.
+ * Serves until opts->stop_fd becomes readable, then finishes the jobs in
+ * progress, removes the socket and returns.
+ */
+int
+pcips_serve(const char *socket_path, const struct pcips_serve_options *opts)
+{
+	int rc, i, listen_fd, conn;
+	struct server s;
+	struct pollfd pfd[2];
+
+	s.n_workers = opts && opts->workers > 0 ? opts->workers
+		: DEFAULT_WORKERS;
+	s.head = s.n_pending = s.stopping = 0;
+
+	s.workers = calloc(s.n_workers, sizeof *s.workers);
+	if (!s.workers)
+		return PCIPS_ENOMEM;
+
+	rc = pcips_cache_init(&s.cache, opts && opts->cache_size > 0
+		? opts->cache_size : DEFAULT_CACHE_SIZE);
+	if (rc)
+	{
+		free(s.workers);
+		return rc;
+	}
+
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.ready, NULL);
+	pthread_cond_init(&s.space, NULL);
+
+	rc = listen_on(socket_path, &listen_fd);
+	if (rc)
+		goto end;
+
+	/* stop_workers() looks at every worker, started or not */
+	for (i = 0; i < s.n_workers; ++i)
+	{
+		s.workers[i].server = &s;
+		s.workers[i].conn = -1;
+		pcips_sink_buffer(&s.workers[i].out, NULL, 0,
+			pcips_grow_realloc, NULL);
+	}
+
+	for (i = 0; !rc && i < s.n_workers; ++i)
+	{
+		if (pthread_create(&s.workers[i].thread, NULL, work,
+				&s.workers[i]) != 0)
+			rc = PCIPS_ENOMEM;
+		else
+			s.workers[i].started = 1;
+	}
+
+	pfd[0].fd = listen_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = opts ? opts->stop_fd : -1;
+	pfd[1].events = POLLIN;
+
+	while (!rc)
+	{
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno != EINTR)
+				rc = PCIPS_EIO;
+
+			continue;
+		}
+
+		if (pfd[1].revents)
+			break;
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		conn = accept(listen_fd, NULL, NULL);
+		if (conn >= 0)
+			enqueue(&s, conn);
+		else if (errno != EINTR && errno != ECONNABORTED)
+			rc = PCIPS_EIO;
+	}
+
+	stop_workers(&s);
+	close(listen_fd);
+	unlink(socket_path);
+
+end:
+	pthread_cond_destroy(&s.space);
+	pthread_cond_destroy(&s.ready);
+	pthread_mutex_destroy(&s.lock);
+	pcips_cache_free(&s.cache);
+	free(s.workers);
+	return rc;
+}
+
+/*
+ * Sends a job to a server and waits for it to finish. fds are passed along
+ * for the fields that are "-", in order. Returns the job's error code, with
+ * the server's message in msg.
+ */
+int
+pcips_serve_submit(const char *socket_path, const char * const *fields,
+	int n_fields, const int *fds, int n_fds, char *msg, size_t msg_size)
+{
+	int rc, i, fd;
+	long size = 1, got, pos = 0;
+	char *job, *p, *end;
+	struct sockaddr_un addr;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(JOB_MAX_FDS * sizeof(int))];
+	} control;
+
+	msg[0] = '\0';
+	if (n_fds > JOB_MAX_FDS)
+		return PCIPS_EARGS;
+
+	rc = set_address(&addr, socket_path);
+	if (rc)
+		return rc;
+
+	for (i = 0; i < n_fields; ++i)
+		size += strlen(fields[i]) + 1;
+
+	if (size > JOB_MAX_SIZE)
+		return PCIPS_EARGS;
+
+	job = malloc(size);
+	if (!job)
+		return PCIPS_ENOMEM;
+
+	for (p = job, i = 0; i < n_fields; ++i)
+	{
+		strcpy(p, fields[i]);
+		p += strlen(fields[i]) + 1;
+	}
+	*p = '\0';
+
+	fd = connect_to(&addr);
+	if (fd < 0)
+	{
+		sprintf(msg, "Error connecting to %.256s: %.128s", socket_path,
+			strerror(errno));
+		free(job);
+		return PCIPS_EIO;
+	}
+
+	memset(&mh, 0, sizeof mh);
+	iov.iov_base = job;
+	iov.iov_len = size;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (n_fds)
+	{
+		memset(&control, 0, sizeof control);
+		mh.msg_control = control.buf;
+		mh.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+	}
+
+	got = sendmsg(fd, &mh, MSG_NOSIGNAL);
+	if (got < 0 || send_all(fd, job + got, size - got) != 0)
+		rc = PCIPS_EIO;
+
+	free(job);
+
+	/* the answer is a single line */
+	while (!rc && (size_t) pos + 1 < msg_size)
+	{
+		got = recv(fd, msg + pos, msg_size - pos - 1, 0);
+		if (got < 0 && EINTR == errno)
+			continue;
+
+		if (got <= 0)
+			break;
+
+		pos += got;
+		msg[pos] = '\0';
+		if (strchr(msg, '\n'))
+			break;
+	}
+
+	close(fd);
+	if (rc)
+		return rc;
+
+	p = strchr(msg, '\n');
+	rc = strtol(msg, &end, 10);
+	if (!p || end == msg || ' ' != *end)
+	{
+		strcpy(msg, "Error: no answer from the server");
+		return PCIPS_EIO;
+	}
+
+	*p = '\0';
+	memmove(msg, end + 1, strlen(end + 1) + 1);
+	return rc;
+}
@@ -0,0 +1,62 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#ifndef PCIPS_SERVE_H
+#define PCIPS_SERVE_H
+
+#include <stddef.h>
+
+/*
+ * A job is sent to the server as a series of NUL-terminated fields, ended by
+ * an empty one: the job (apply, create or join), its option letters after a
+ * "-", and the absolute paths it names. A path given as "-" stands for the
+ * next file descriptor passed along with the job. The server answers each job
+ * with the error code and message, as in "0 no error\n".
+ */
+#define PCIPS_JOB_APPLY "apply"
+#define PCIPS_JOB_CREATE "create"
+#define PCIPS_JOB_JOIN "join"
+
+struct pcips_serve_options
+{
+	int workers;
+	int cache_size;
+	int stop_fd;
+};
+
+int
+pcips_serve(const char *socket_path, const struct pcips_serve_options *opts);
+
+int
+pcips_serve_submit(const char *socket_path, const char * const *fields,
+	int n_fields, const int *fds, int n_fds, char *msg, size_t msg_size);
+
+#endif
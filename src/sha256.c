@@ -0,0 +1,162 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <string.h>
+
+#include "sha256.h"
+
+#define BLOCK_SIZE 64
+
+#define MASK(x) ((x) & 0xffffffffUL)
+#define ROTR(x, n) MASK(((x) >> (n)) | ((x) << (32 - (n))))
+
+static const unsigned long k[64] = {
+	0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL,
+	0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+	0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL,
+	0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+	0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+	0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+	0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL,
+	0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+	0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL,
+	0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+	0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL,
+	0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+	0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL,
+	0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+	0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+	0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+static void
+compress(unsigned long *h, const unsigned char *block)
+{
+	unsigned long w[64], a, b, c, d, e, f, g, hh, s0, s1, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; ++i)
+	{
+		w[i] = (unsigned long) block[i * 4] << 24
+			| (unsigned long) block[i * 4 + 1] << 16
+			| (unsigned long) block[i * 4 + 2] << 8
+			| block[i * 4 + 3];
+	}
+
+	for (i = 16; i < 64; ++i)
+	{
+		s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18)
+			^ (w[i - 15] >> 3);
+		s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19)
+			^ (w[i - 2] >> 10);
+		w[i] = MASK(w[i - 16] + s0 + w[i - 7] + s1);
+	}
+
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+	e = h[4];
+	f = h[5];
+	g = h[6];
+	hh = h[7];
+
+	for (i = 0; i < 64; ++i)
+	{
+		s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+		t1 = MASK(hh + s1 + ((e & f) ^ (~e & g)) + k[i] + w[i]);
+		s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+		t2 = MASK(s0 + ((a & b) ^ (a & c) ^ (b & c)));
+		hh = g;
+		g = f;
+		f = e;
+		e = MASK(d + t1);
+		d = c;
+		c = b;
+		b = a;
+		a = MASK(t1 + t2);
+	}
+
+	h[0] = MASK(h[0] + a);
+	h[1] = MASK(h[1] + b);
+	h[2] = MASK(h[2] + c);
+	h[3] = MASK(h[3] + d);
+	h[4] = MASK(h[4] + e);
+	h[5] = MASK(h[5] + f);
+	h[6] = MASK(h[6] + g);
+	h[7] = MASK(h[7] + hh);
+}
+
+/* Computes the SHA-256 digest of n bytes in one go. */
+void
+pcips_sha256(const unsigned char *data, size_t n,
+	unsigned char digest[PCIPS_SHA256_SIZE])
+{
+	unsigned long h[8] = {
+		0x6a09e667UL, 0xbb67ae85UL, 0x3c6ef372UL, 0xa54ff53aUL,
+		0x510e527fUL, 0x9b05688cUL, 0x1f83d9abUL, 0x5be0cd19UL
+	};
+	unsigned char tail[BLOCK_SIZE * 2];
+	size_t i, rest, tail_size;
+	unsigned long bits;
+
+	for (i = 0; i + BLOCK_SIZE <= n; i += BLOCK_SIZE)
+		compress(h, data + i);
+
+	/* the rest, a 1 bit, zeroes, and the length in bits */
+	rest = n - i;
+	tail_size = rest + 9 <= BLOCK_SIZE ? BLOCK_SIZE : BLOCK_SIZE * 2;
+	memset(tail, 0, sizeof tail);
+	if (rest)
+		memcpy(tail, data + i, rest);
+
+	tail[rest] = 0x80;
+	bits = (unsigned long) n;
+	tail[tail_size - 1] = (unsigned char) (bits << 3);
+	bits >>= 5;
+	for (i = 2; i <= 8; ++i)
+	{
+		tail[tail_size - i] = (unsigned char) bits;
+		bits >>= 8;
+	}
+
+	compress(h, tail);
+	if (tail_size > BLOCK_SIZE)
+		compress(h, tail + BLOCK_SIZE);
+
+	for (i = 0; i < 8; ++i)
+	{
+		digest[i * 4] = (unsigned char) (h[i] >> 24);
+		digest[i * 4 + 1] = (unsigned char) (h[i] >> 16);
+		digest[i * 4 + 2] = (unsigned char) (h[i] >> 8);
+		digest[i * 4 + 3] = (unsigned char) h[i];
+	}
+}
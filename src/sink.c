@@ -0,0 +1,275 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "sink.h"
+#include "stats.h"
+
+#define FILL_CHUNK 4096
+
+void
+pcips_sink_file(struct pcips_sink *sink, FILE *f)
+{
+	sink->file = f;
+	sink->data = NULL;
+	sink->length = 0;
+	sink->size = 0;
+	sink->used = 0;
+	sink->grow = NULL;
+	sink->ctx = NULL;
+	sink->stats = NULL;
+}
+
+/*
+ * Writes to f through the size bytes at buf, with one write() each time they
+ * fill up, and counts those calls in stats. Nothing more is held in memory
+ * however much is written. pcips_sink_flush() writes out the rest.
+ */
+void
+pcips_sink_stream(struct pcips_sink *sink, FILE *f, unsigned char *buf,
+	long size, struct pcips_stats *stats)
+{
+	pcips_sink_file(sink, f);
+	sink->data = buf;
+	sink->size = size;
+	sink->stats = stats;
+}
+
+/*
+ * Writes to size bytes at data. If grow is given, it is called to make room
+ * when they are full, so data may start out NULL; otherwise, anything that
+ * does not fit is counted but dropped.
+ */
+void
+pcips_sink_buffer(struct pcips_sink *sink, unsigned char *data, long size,
+	pcips_grow_fn grow, void *ctx)
+{
+	sink->file = NULL;
+	sink->data = data;
+	sink->length = 0;
+	sink->size = size;
+	sink->used = 0;
+	sink->grow = grow;
+	sink->ctx = ctx;
+	sink->stats = NULL;
+}
+
+/* A grow function for buffers from malloc(), which the caller then frees. */
+unsigned char *
+pcips_grow_realloc(void *ctx, unsigned char *data, long size)
+{
+	(void) ctx;
+	return realloc(data, size);
+}
+
+/*
+ * Makes room for n more bytes in a buffer, growing it at least twofold so that
+ * a sink written in small pieces is copied only a few times. Returns nonzero
+ * if the bytes fit.
+ */
+static int
+make_room(struct pcips_sink *sink, long n, int *rc)
+{
+	long size;
+	unsigned char *tmp;
+
+	*rc = 0;
+	if (sink->length + n <= sink->size)
+		return 1;
+
+	if (!sink->grow || sink->length > sink->size)
+		return 0;
+
+	size = sink->size > 4096 ? sink->size * 2 : 8192;
+	if (size < sink->length + n)
+		size = sink->length + n;
+
+	tmp = sink->grow(sink->ctx, sink->data, size);
+	if (!tmp)
+	{
+		*rc = PCIPS_ENOMEM;
+		return 0;
+	}
+
+	sink->data = tmp;
+	sink->size = size;
+	return 1;
+}
+
+/* Writes n bytes to a stream's file descriptor, counting the calls. */
+static int
+write_fd(struct pcips_sink *sink, const unsigned char *data, long n)
+{
+	ssize_t got;
+
+	/* anything written to the stream itself goes first */
+	if (fflush(sink->file) == EOF)
+		return PCIPS_EIO;
+
+	while (n > 0)
+	{
+		got = write(fileno(sink->file), data, n);
+		PCIPS_STAT_ADD(sink->stats, syscalls, 1);
+		if (got < 0 && EINTR == errno)
+			continue;
+
+		if (got <= 0)
+			return PCIPS_EIO;
+
+		data += got;
+		n -= got;
+	}
+
+	return 0;
+}
+
+/* Writes out what a stream's buffer holds. */
+int
+pcips_sink_flush(struct pcips_sink *sink)
+{
+	int rc;
+
+	if (!sink->file || !sink->used)
+		return 0;
+
+	rc = write_fd(sink, sink->data, sink->used);
+	sink->used = 0;
+	return rc;
+}
+
+int
+pcips_sink_write(struct pcips_sink *sink, const void *data, long n)
+{
+	int rc;
+
+	if (sink->file && sink->data)
+	{
+		if (sink->used + n > sink->size)
+		{
+			rc = pcips_sink_flush(sink);
+			if (rc)
+				return rc;
+		}
+
+		/* what would not fit in the empty buffer skips it */
+		if (n > sink->size)
+		{
+			rc = write_fd(sink, data, n);
+			if (rc)
+				return rc;
+		}
+		else
+		{
+			memcpy(sink->data + sink->used, data, n);
+			sink->used += n;
+		}
+	}
+	else if (sink->file)
+	{
+		if (fwrite(data, 1, n, sink->file) != (size_t) n)
+			return PCIPS_EIO;
+	}
+	else if (make_room(sink, n, &rc))
+	{
+		memcpy(sink->data + sink->length, data, n);
+	}
+	else if (rc)
+	{
+		return rc;
+	}
+
+	sink->length += n;
+	return 0;
+}
+
+/* Writes n copies of value. */
+int
+pcips_sink_fill(struct pcips_sink *sink, int value, long n)
+{
+	int rc = 0;
+	long chunk;
+	unsigned char buf[FILL_CHUNK];
+
+	if (!sink->file)
+	{
+		if (make_room(sink, n, &rc))
+			memset(sink->data + sink->length, value, n);
+		else if (rc)
+			return rc;
+
+		sink->length += n;
+		return 0;
+	}
+
+	memset(buf, value, n < FILL_CHUNK ? n : FILL_CHUNK);
+	for (; !rc && n > 0; n -= chunk)
+	{
+		chunk = n < FILL_CHUNK ? n : FILL_CHUNK;
+		rc = pcips_sink_write(sink, buf, chunk);
+	}
+
+	return rc;
+}
+
+/*
+ * Hands out the next n bytes of a buffer to be filled in place, or returns
+ * NULL if the sink is a stream or the bytes do not fit, in which case nothing
+ * is counted and they must be written with pcips_sink_write() instead.
+ */
+unsigned char *
+pcips_sink_reserve(struct pcips_sink *sink, long n)
+{
+	int rc;
+	unsigned char *p;
+
+	if (sink->file || !make_room(sink, n, &rc))
+		return NULL;
+
+	p = sink->data + sink->length;
+	sink->length += n;
+	return p;
+}
+
+/* Tells whether everything written to a buffer fit in it. */
+int
+pcips_sink_check(const struct pcips_sink *sink)
+{
+	if (!sink->file && sink->length > sink->size)
+		return PCIPS_ENOSPC;
+
+	return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#ifndef PCIPS_SINK_H
+#define PCIPS_SINK_H
+
+#include <stdio.h>
+
+#include "stats.h"
+
+/*
+ * Grows a sink's buffer to hold at least size bytes, keeping its contents,
+ * and returns the new buffer, or NULL if it cannot. ctx is the pointer given
+ * to pcips_sink_buffer().
+ */
+typedef unsigned char *(*pcips_grow_fn)(void *ctx, unsigned char *data,
+	long size);
+
+/* a good size for the buffer given to pcips_sink_stream() */
+#define PCIPS_SINK_BUFFER_SIZE 65536
+
+/*
+ * Where patches and patched data are written: either a stream, or a buffer in
+ * memory. length counts every byte written, even those that did not fit in a
+ * buffer that cannot grow, so it tells the caller how large a buffer to retry
+ * with. A stream may be written through a buffer of its own, of which used
+ * bytes are waiting to go out.
+ */
+struct pcips_sink
+{
+	FILE *file;
+	unsigned char *data;
+	long length;
+	long size;
+	long used;
+	pcips_grow_fn grow;
+	void *ctx;
+	struct pcips_stats *stats;
+};
+
+void
+pcips_sink_file(struct pcips_sink *sink, FILE *f);
+
+void
+pcips_sink_stream(struct pcips_sink *sink, FILE *f, unsigned char *buf,
+	long size, struct pcips_stats *stats);
+
+void
+pcips_sink_buffer(struct pcips_sink *sink, unsigned char *data, long size,
+	pcips_grow_fn grow, void *ctx);
+
+unsigned char *
+pcips_grow_realloc(void *ctx, unsigned char *data, long size);
+
+int
+pcips_sink_write(struct pcips_sink *sink, const void *data, long n);
+
+int
+pcips_sink_fill(struct pcips_sink *sink, int value, long n);
+
+unsigned char *
+pcips_sink_reserve(struct pcips_sink *sink, long n);
+
+int
+pcips_sink_check(const struct pcips_sink *sink);
+
+int
+pcips_sink_flush(struct pcips_sink *sink);
+
+#endif
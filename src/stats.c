@@ -0,0 +1,173 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+static const char * const phase_names[] = {
+	"parse",
+	"diff",
+	"copy",
+	"write"
+};
+
+void
+pcips_stats_init(struct pcips_stats *stats)
+{
+	memset(stats, 0, sizeof *stats);
+}
+
+static double
+seconds(clockid_t clock)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock, &ts) != 0)
+		return 0;
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static clockid_t
+cpu_clock(const struct pcips_stats *stats)
+{
+	return stats->per_thread ? CLOCK_THREAD_CPUTIME_ID
+		: CLOCK_PROCESS_CPUTIME_ID;
+}
+
+/* Starts timing a phase. Nothing is read from the clock without stats. */
+void
+pcips_stats_begin(const struct pcips_stats *stats, struct pcips_timer *timer)
+{
+	if (!stats)
+		return;
+
+	timer->wall = seconds(CLOCK_MONOTONIC);
+	timer->cpu = seconds(cpu_clock(stats));
+}
+
+/*
+ * Adds the time since pcips_stats_begin() to a phase. Unless stats is
+ * per_thread, CPU time is that of the whole process, so it includes every
+ * thread working in the phase.
+ */
+void
+pcips_stats_end(struct pcips_stats *stats, const struct pcips_timer *timer,
+	enum pcips_phase phase)
+{
+	if (!stats)
+		return;
+
+	stats->wall[phase] += seconds(CLOCK_MONOTONIC) - timer->wall;
+	stats->cpu[phase] += seconds(cpu_clock(stats)) - timer->cpu;
+}
+
+/*
+ * Adds the counters and timings in src, which should be per_thread if other
+ * threads ran at the same time, to dest. The wall time of a phase that ran
+ * on several threads is then their total, which can exceed that of the run.
+ */
+void
+pcips_stats_merge(struct pcips_stats *dest, const struct pcips_stats *src)
+{
+	int i;
+
+	for (i = 0; i < PCIPS_PHASE_COUNT; ++i)
+	{
+		dest->wall[i] += src->wall[i];
+		dest->cpu[i] += src->cpu[i];
+	}
+
+	dest->plain_read += src->plain_read;
+	dest->rle_read += src->rle_read;
+	dest->plain_written += src->plain_written;
+	dest->rle_written += src->rle_written;
+	dest->payload_bytes += src->payload_bytes;
+	dest->padding_bytes += src->padding_bytes;
+	dest->bytes_compared += src->bytes_compared;
+	dest->seeks += src->seeks;
+	dest->syscalls += src->syscalls;
+}
+
+static void
+print_json(const struct pcips_stats *s, FILE *f)
+{
+	int i;
+
+	fprintf(f, "{\"records_read\":{\"plain\":%ld,\"rle\":%ld},",
+		s->plain_read, s->rle_read);
+	fprintf(f, "\"records_written\":{\"plain\":%ld,\"rle\":%ld},",
+		s->plain_written, s->rle_written);
+	fprintf(f, "\"payload_bytes\":%ld,\"padding_bytes\":%ld,",
+		s->payload_bytes, s->padding_bytes);
+	fprintf(f, "\"bytes_compared\":%ld,\"seeks\":%ld,\"syscalls\":%ld,",
+		s->bytes_compared, s->seeks, s->syscalls);
+
+	fputs("\"phases\":{", f);
+	for (i = 0; i < PCIPS_PHASE_COUNT; ++i)
+	{
+		fprintf(f, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f}",
+			i ? "," : "", phase_names[i], s->wall[i], s->cpu[i]);
+	}
+
+	fputs("}}\n", f);
+}
+
+/* Prints the counters for people to read, or as one line of JSON. */
+void
+pcips_stats_print(const struct pcips_stats *s, FILE *f, int json)
+{
+	int i;
+
+	if (json)
+	{
+		print_json(s, f);
+		return;
+	}
+
+	fprintf(f, "%-18s %ld plain, %ld RLE\n", "records read:",
+		s->plain_read, s->rle_read);
+	fprintf(f, "%-18s %ld plain, %ld RLE\n", "records written:",
+		s->plain_written, s->rle_written);
+	fprintf(f, "%-18s %ld (%ld padding)\n", "payload bytes:",
+		s->payload_bytes, s->padding_bytes);
+	fprintf(f, "%-18s %ld\n", "bytes compared:", s->bytes_compared);
+	fprintf(f, "%-18s %ld\n", "look-ahead seeks:", s->seeks);
+	fprintf(f, "%-18s %ld\n", "I/O system calls:", s->syscalls);
+	fprintf(f, "%-8s %12s %12s\n", "phase", "wall (s)", "CPU (s)");
+	for (i = 0; i < PCIPS_PHASE_COUNT; ++i)
+	{
+		fprintf(f, "%-8s %12.6f %12.6f\n", phase_names[i],
+			s->wall[i], s->cpu[i]);
+	}
+}
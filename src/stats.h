@@ -0,0 +1,92 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#ifndef PCIPS_STATS_H
+#define PCIPS_STATS_H
+
+#include <stdio.h>
+
+enum pcips_phase
+{
+	PCIPS_PHASE_PARSE,
+	PCIPS_PHASE_DIFF,
+	PCIPS_PHASE_COPY,
+	PCIPS_PHASE_WRITE,
+	PCIPS_PHASE_COUNT
+};
+
+/*
+ * Counters collected during a run when requested. Everything that takes a
+ * pointer to this accepts NULL to collect nothing. With per_thread set, CPU
+ * time is that of the collecting thread rather than the whole process.
+ */
+struct pcips_stats
+{
+	long plain_read;
+	long rle_read;
+	long plain_written;
+	long rle_written;
+	long payload_bytes;
+	long padding_bytes;
+	long bytes_compared;
+	long seeks;
+	long syscalls;
+	double wall[PCIPS_PHASE_COUNT];
+	double cpu[PCIPS_PHASE_COUNT];
+	int per_thread;
+};
+
+struct pcips_timer
+{
+	double wall;
+	double cpu;
+};
+
+#define PCIPS_STAT_ADD(stats, field, n) \
+	do { if (stats) (stats)->field += (n); } while (0)
+
+void
+pcips_stats_init(struct pcips_stats *stats);
+
+void
+pcips_stats_begin(const struct pcips_stats *stats, struct pcips_timer *timer);
+
+void
+pcips_stats_end(struct pcips_stats *stats, const struct pcips_timer *timer,
+	enum pcips_phase phase);
+
+void
+pcips_stats_merge(struct pcips_stats *dest, const struct pcips_stats *src);
+
+void
+pcips_stats_print(const struct pcips_stats *stats, FILE *f, int json);
+
+#endif
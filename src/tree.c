@@ -0,0 +1,650 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "create.h"
+#include "err.h"
+#include "format.h"
+#include "map.h"
+#include "sink.h"
+#include "stats.h"
+#include "tree.h"
+
+struct entry
+{
+	char *path;
+	off_t size;
+};
+
+struct entry_list
+{
+	struct entry *entries;
+	long count;
+	long cap;
+};
+
+/* a relative path found in either tree, and what became of it */
+struct tree_file
+{
+	char *path;
+	char *patch;
+	off_t size;
+	int in_src;
+	int in_mod;
+	int changed;
+	int rc;
+};
+
+struct pool
+{
+	pthread_mutex_t lock;
+	struct tree_file **jobs;
+	long n_jobs;
+	long next;
+	const char *patch_dir;
+	const char *src_dir;
+	const char *mod_dir;
+	const struct pcips_tree_options *opts;
+};
+
+struct tree_worker
+{
+	pthread_t thread;
+	struct pool *pool;
+	struct pcips_stats stats;
+	struct pcips_stats *stats_ptr;
+	int started;
+};
+
+/* Returns dir/name followed by ext, or just name and ext if dir is NULL. */
+static char *
+join_path(const char *dir, const char *name, const char *ext)
+{
+	char *path;
+
+	path = malloc((dir ? strlen(dir) + 1 : 0) + strlen(name)
+		+ strlen(ext) + 1);
+	if (path)
+	{
+		sprintf(path, "%s%s%s%s", dir ? dir : "", dir ? "/" : "",
+			name, ext);
+	}
+
+	return path;
+}
+
+static void
+report(const struct pcips_tree_options *opts, const char *path, int error)
+{
+	if (opts->error)
+		opts->error(opts->ctx, path, error);
+}
+
+static int
+add_entry(struct entry_list *list, char *path, off_t size)
+{
+	struct entry *tmp;
+
+	if (list->count == list->cap)
+	{
+		list->cap = list->cap ? list->cap * 2 : 64;
+		tmp = realloc(list->entries, list->cap * sizeof *tmp);
+		if (!tmp)
+			return PCIPS_ENOMEM;
+
+		list->entries = tmp;
+	}
+
+	list->entries[list->count].path = path;
+	list->entries[list->count].size = size;
+	++list->count;
+	return 0;
+}
+
+static void
+free_entries(struct entry_list *list)
+{
+	long i;
+
+	for (i = 0; i < list->count; ++i)
+		free(list->entries[i].path);
+
+	free(list->entries);
+}
+
+/*
+ * Adds the regular files under the directory rel in root to list, by their
+ * paths relative to root. Symbolic links and special files are left out.
+ * Anything below root that cannot be read is reported and skipped, and
+ * *skipped is set.
+ */
+static int
+walk(struct entry_list *list, const char *root, const char *rel,
+	const struct pcips_tree_options *opts, int *skipped)
+{
+	int rc = 0;
+	char *dir_path, *child = NULL, *path;
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+
+	dir_path = join_path(rel ? root : NULL, rel ? rel : root, "");
+	if (!dir_path)
+		return PCIPS_ENOMEM;
+
+	dir = opendir(dir_path);
+	if (!dir)
+	{
+		report(opts, dir_path, PCIPS_EIO);
+		free(dir_path);
+		if (!rel)
+			return PCIPS_EIO;
+
+		*skipped = PCIPS_EIO;
+		return 0;
+	}
+
+	while (!rc && (de = readdir(dir)))
+	{
+		if (strcmp(de->d_name, ".") == 0
+			|| strcmp(de->d_name, "..") == 0)
+			continue;
+
+		child = join_path(rel, de->d_name, "");
+		if (!child)
+		{
+			rc = PCIPS_ENOMEM;
+			break;
+		}
+
+		path = join_path(dir_path, de->d_name, "");
+		if (!path)
+		{
+			free(child);
+			rc = PCIPS_ENOMEM;
+			break;
+		}
+
+		if (lstat(path, &st) != 0)
+		{
+			report(opts, path, PCIPS_EIO);
+			*skipped = PCIPS_EIO;
+		}
+		else if (S_ISDIR(st.st_mode))
+		{
+			rc = walk(list, root, child, opts, skipped);
+		}
+		else if (S_ISREG(st.st_mode))
+		{
+			rc = add_entry(list, child, st.st_size);
+			if (!rc)
+				child = NULL;
+		}
+
+		free(path);
+		free(child);
+	}
+
+	closedir(dir);
+	free(dir_path);
+	return rc;
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+	return strcmp(((const struct entry *) a)->path,
+		((const struct entry *) b)->path);
+}
+
+/* larger files first, so that no big one is left for the end of the run */
+static int
+compare_jobs(const void *a, const void *b)
+{
+	const struct tree_file *x = *(struct tree_file * const *) a;
+	const struct tree_file *y = *(struct tree_file * const *) b;
+
+	if (x->size != y->size)
+		return x->size > y->size ? -1 : 1;
+
+	return strcmp(x->path, y->path);
+}
+
+/*
+ * Pairs the files of both trees by path. The result is in path order and
+ * takes over the paths from the lists.
+ */
+static int
+pair_files(struct tree_file **files, long *n, struct entry_list *src,
+	struct entry_list *mod)
+{
+	long i = 0, j = 0, k = 0;
+	int cmp;
+	struct tree_file *f;
+
+	*files = calloc(src->count + mod->count + 1, sizeof **files);
+	if (!*files)
+		return PCIPS_ENOMEM;
+
+	qsort(src->entries, src->count, sizeof *src->entries,
+		compare_entries);
+	qsort(mod->entries, mod->count, sizeof *mod->entries,
+		compare_entries);
+
+	while (i < src->count || j < mod->count)
+	{
+		f = &(*files)[k++];
+		if (i == src->count)
+			cmp = 1;
+		else if (j == mod->count)
+			cmp = -1;
+		else
+			cmp = strcmp(src->entries[i].path,
+				mod->entries[j].path);
+
+		if (cmp <= 0)
+		{
+			f->in_src = 1;
+			f->path = src->entries[i].path;
+			src->entries[i++].path = NULL;
+		}
+
+		if (cmp >= 0)
+		{
+			f->in_mod = 1;
+			f->size = mod->entries[j].size;
+			if (f->path)
+				free(mod->entries[j].path);
+			else
+				f->path = mod->entries[j].path;
+
+			mod->entries[j++].path = NULL;
+		}
+	}
+
+	*n = k;
+	return 0;
+}
+
+/* Creates the directories leading up to path, as mkdir -p would. */
+static int
+make_parents(char *path)
+{
+	char *p;
+	int rc;
+
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/'))
+	{
+		*p = '\0';
+		rc = mkdir(path, 0777) != 0 && errno != EEXIST;
+		*p = '/';
+		if (rc)
+			return PCIPS_EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Compares one pair of files and writes a patch for them if they differ.
+ * Files too large for IPS get an IPS32 patch unless a format was chosen.
+ */
+static int
+diff_file(const struct pool *p, struct tree_file *file,
+	struct pcips_stats *stats)
+{
+	int rc = 0;
+	char *src_path, *mod_path, *patch_path = NULL;
+	FILE *src = NULL, *mod = NULL, *out = NULL;
+	struct pcips_map src_map, mod_map;
+	struct pcips_create_options create;
+	struct pcips_sink sink;
+	struct pcips_timer timer;
+	unsigned char buf[PCIPS_SINK_BUFFER_SIZE];
+
+	src_map.data = mod_map.data = NULL;
+	src_map.length = mod_map.length = 0;
+	src_map.mapped = mod_map.mapped = 0;
+
+	src_path = join_path(p->src_dir, file->path, "");
+	mod_path = join_path(p->mod_dir, file->path, "");
+	if (!src_path || !mod_path)
+	{
+		rc = PCIPS_ENOMEM;
+		goto end;
+	}
+
+	src = fopen(src_path, "rb");
+	mod = fopen(mod_path, "rb");
+	if (!src || !mod)
+	{
+		rc = PCIPS_EIO;
+		goto end;
+	}
+
+	rc = pcips_map_file(&src_map, src);
+	if (!rc)
+		rc = pcips_map_file(&mod_map, mod);
+	if (rc)
+		goto end;
+
+	if (src_map.length == mod_map.length && (0 == src_map.length
+			|| memcmp(src_map.data, mod_map.data,
+				src_map.length) == 0))
+		goto end;
+
+	file->changed = 1;
+	create = *p->opts->create;
+	create.threads = 1;
+	create.index = NULL;
+	create.stats = stats;
+	if (!create.bps && !create.format
+		&& mod_map.length > pcips_ips.max_offset)
+		create.format = &pcips_ips32;
+
+	patch_path = join_path(p->patch_dir, file->patch, "");
+	if (!patch_path)
+	{
+		rc = PCIPS_ENOMEM;
+		goto end;
+	}
+
+	rc = make_parents(patch_path);
+	if (rc)
+		goto end;
+
+	out = fopen(patch_path, "wb");
+	if (!out)
+	{
+		rc = PCIPS_EIO;
+		goto end;
+	}
+
+	pcips_sink_stream(&sink, out, buf, sizeof buf, stats);
+	rc = pcips_create_buffer(src_map.data, src_map.length, mod_map.data,
+		mod_map.length, &sink, &create);
+
+	if (!rc)
+	{
+		pcips_stats_begin(stats, &timer);
+		rc = pcips_sink_flush(&sink);
+		pcips_stats_end(stats, &timer, PCIPS_PHASE_WRITE);
+	}
+
+	if (fclose(out) != 0 && !rc)
+		rc = PCIPS_EIO;
+
+	if (rc)
+		remove(patch_path);
+
+end:
+	pcips_unmap(&mod_map);
+	pcips_unmap(&src_map);
+	if (mod)
+		fclose(mod);
+	if (src)
+		fclose(src);
+
+	free(patch_path);
+	free(mod_path);
+	free(src_path);
+	return rc;
+}
+
+/*
+ * Takes files from the shared queue until none are left. Each file is a job
+ * of its own, so a thread that finishes early simply takes the next one.
+ */
+static void *
+work(void *arg)
+{
+	struct tree_worker *w = arg;
+	struct pool *p = w->pool;
+	struct tree_file *file;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&p->lock);
+		file = p->next < p->n_jobs ? p->jobs[p->next++] : NULL;
+		pthread_mutex_unlock(&p->lock);
+
+		if (!file)
+			break;
+
+		file->rc = diff_file(p, file, w->stats_ptr);
+		if (file->rc)
+		{
+			pthread_mutex_lock(&p->lock);
+			report(p->opts, file->path, file->rc);
+			pthread_mutex_unlock(&p->lock);
+		}
+	}
+
+	return NULL;
+}
+
+static int
+run_pool(struct pool *p, struct pcips_stats *stats)
+{
+	int i, threads = p->opts->threads > 1 ? p->opts->threads : 1;
+	struct tree_worker *workers;
+
+	if (threads > p->n_jobs)
+		threads = p->n_jobs ? p->n_jobs : 1;
+
+	workers = calloc(threads, sizeof *workers);
+	if (!workers)
+		return PCIPS_ENOMEM;
+
+	for (i = 0; i < threads; ++i)
+	{
+		workers[i].pool = p;
+		if (stats)
+		{
+			pcips_stats_init(&workers[i].stats);
+			workers[i].stats.per_thread = 1;
+			workers[i].stats_ptr = &workers[i].stats;
+		}
+
+		if (i > 0)
+		{
+			workers[i].started = !pthread_create(
+				&workers[i].thread, NULL, work, &workers[i]);
+		}
+	}
+
+	work(&workers[0]);
+	for (i = 0; i < threads; ++i)
+	{
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+
+		if (stats)
+			pcips_stats_merge(stats, &workers[i].stats);
+	}
+
+	free(workers);
+	return 0;
+}
+
+/*
+ * Lists each patch written, tab-separated from the file it applies to, one
+ * per line. Files only in one of the trees are listed in comments.
+ */
+static int
+write_manifest(const char *path, const struct tree_file *files, long n)
+{
+	long i;
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f)
+		return PCIPS_EIO;
+
+	for (i = 0; i < n; ++i)
+	{
+		if (!files[i].in_src)
+			fprintf(f, "# added\t%s\n", files[i].path);
+		else if (!files[i].in_mod)
+			fprintf(f, "# removed\t%s\n", files[i].path);
+		else if (files[i].changed && !files[i].rc)
+			fprintf(f, "%s\t%s\n", files[i].patch, files[i].path);
+	}
+
+	if (fclose(f) != 0)
+		return PCIPS_EIO;
+
+	return 0;
+}
+
+/*
+ * Compares every file in mod_dir with the file at the same path in src_dir,
+ * and writes a patch to the same path in patch_dir, plus .ips or .bps, for
+ * each pair that differs. The pairs are compared on opts->threads threads,
+ * each creating one patch at a time, and patch_dir gets a manifest of the
+ * patches written. A file that fails is reported through opts->error, the
+ * others are still done, and the first error is returned.
+ */
+int
+pcips_create_tree(const char *patch_dir, const char *src_dir,
+	const char *mod_dir, const struct pcips_tree_options *opts)
+{
+	int rc, skipped = 0;
+	long i, n = 0;
+	char *manifest = NULL;
+	const char *ext;
+	struct entry_list src, mod;
+	struct tree_file *files = NULL;
+	struct pcips_stats *stats = opts->create->stats;
+	struct pool p;
+
+	src.entries = mod.entries = NULL;
+	src.count = src.cap = mod.count = mod.cap = 0;
+	ext = opts->create->bps ? ".bps" : ".ips";
+
+	rc = walk(&src, src_dir, NULL, opts, &skipped);
+	if (!rc)
+		rc = walk(&mod, mod_dir, NULL, opts, &skipped);
+	if (rc)
+		goto end;
+
+	rc = pair_files(&files, &n, &src, &mod);
+	if (rc)
+		goto end;
+
+	p.jobs = calloc(n + 1, sizeof *p.jobs);
+	if (!p.jobs)
+	{
+		rc = PCIPS_ENOMEM;
+		goto end;
+	}
+
+	p.n_jobs = p.next = 0;
+	for (i = 0; !rc && i < n; ++i)
+	{
+		if (!files[i].in_src || !files[i].in_mod)
+			continue;
+
+		/* the manifest could not tell these paths apart */
+		if (strpbrk(files[i].path, "\t\n"))
+		{
+			files[i].rc = PCIPS_EFILE;
+			report(opts, files[i].path, files[i].rc);
+			continue;
+		}
+
+		files[i].patch = join_path(NULL, files[i].path, ext);
+		if (!files[i].patch)
+			rc = PCIPS_ENOMEM;
+
+		p.jobs[p.n_jobs++] = &files[i];
+	}
+
+	manifest = join_path(patch_dir, PCIPS_MANIFEST, "");
+	if (!rc && !manifest)
+		rc = PCIPS_ENOMEM;
+
+	if (!rc)
+		rc = make_parents(manifest);
+
+	if (!rc && pthread_mutex_init(&p.lock, NULL) != 0)
+		rc = PCIPS_ENOMEM;
+
+	if (rc)
+	{
+		free(p.jobs);
+		goto end;
+	}
+
+	qsort(p.jobs, p.n_jobs, sizeof *p.jobs, compare_jobs);
+	p.patch_dir = patch_dir;
+	p.src_dir = src_dir;
+	p.mod_dir = mod_dir;
+	p.opts = opts;
+
+	rc = run_pool(&p, stats);
+
+	pthread_mutex_destroy(&p.lock);
+	free(p.jobs);
+	if (rc)
+		goto end;
+
+	rc = write_manifest(manifest, files, n);
+	if (rc)
+		report(opts, manifest, rc);
+
+	for (i = 0; !rc && i < n; ++i)
+		rc = files[i].rc;
+
+end:
+	if (!rc)
+		rc = skipped;
+
+	for (i = 0; i < n; ++i)
+	{
+		free(files[i].path);
+		free(files[i].patch);
+	}
+
+	free(files);
+	free(manifest);
+	free_entries(&mod);
+	free_entries(&src);
+	return rc;
+}
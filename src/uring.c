@@ -0,0 +1,245 @@
+/*
+ *  pcips - portable C IPS patch utility
+ *  Copyright (C) 2022 David McMackins II
+ *
+ *  Redistributions, modified or unmodified, in whole or in part, must retain
+ *  applicable notices of copyright or other legal privilege, these conditions,
+ *  and the following license terms and disclaimer.  Subject to these
+ *  conditions, each holder of copyright or other legal privileges, author or
+ *  assembler, and contributor of this work, henceforth "licensor", hereby
+ *  grants to any person who obtains a copy of this work in any form:
+ *
+ *  1. Permission to reproduce, modify, distribute, publish, sell, sublicense,
+ *  use, and/or otherwise deal in the licensed material without restriction.
+ *
+ *  2. A perpetual, worldwide, non-exclusive, royalty-free, gratis, irrevocable
+ *  patent license to make, have made, provide, transfer, import, use, and/or
+ *  otherwise deal in the licensed material without restriction, for any and
+ *  all patents held by such licensor and necessarily infringed by the form of
+ *  the work upon distribution of that licensor's contribution to the work
+ *  under the terms of this license.
+ *
+ *  NO WARRANTY OF ANY KIND IS IMPLIED BY, OR SHOULD BE INFERRED FROM, THIS
+ *  LICENSE OR THE ACT OF DISTRIBUTION UNDER THE TERMS OF THIS LICENSE,
+ *  INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR
+ *  A PARTICULAR PURPOSE, AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS,
+ *  ASSEMBLERS, OR HOLDERS OF COPYRIGHT OR OTHER LEGAL PRIVILEGE BE LIABLE FOR
+ *  ANY CLAIM, DAMAGES, OR OTHER LIABILITY, WHETHER IN ACTION OF CONTRACT,
+ *  TORT, OR OTHERWISE ARISING FROM, OUT OF, OR IN CONNECTION WITH THE WORK OR
+ *  THE USE OF OR OTHER DEALINGS IN THE WORK.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/*
+ * io_uring is driven through its system calls directly rather than through
+ * liburing, so it is available wherever the kernel headers describe it. It
+ * can be left out by building with -DPCIPS_NO_URING.
+ */
+#if defined(__linux__) && !defined(PCIPS_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define HAVE_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_URING
+static int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		NULL, 0);
+}
+
+static void *
+map_ring(int fd, size_t size, off_t offset)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+	return MAP_FAILED == p ? NULL : p;
+}
+
+/*
+ * Sets up a ring with room for entries requests in flight. Returns -1 if
+ * io_uring is not available, for instance on older kernels or where it is
+ * blocked by a seccomp policy, so that the caller can write synchronously.
+ */
+int
+pcips_uring_init(struct pcips_uring *ring, unsigned entries)
+{
+	struct io_uring_params params;
+	unsigned char *sq, *cq;
+
+	memset(ring, 0, sizeof *ring);
+	memset(&params, 0, sizeof params);
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_ring_size = params.sq_off.array
+		+ params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes
+		+ params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size,
+		IORING_OFF_SQ_RING);
+	ring->cq_ring = map_ring(ring->fd, ring->cq_ring_size,
+		IORING_OFF_CQ_RING);
+	ring->sqes = map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+	if (!ring->sq_ring || !ring->cq_ring || !ring->sqes)
+	{
+		pcips_uring_exit(ring);
+		return -1;
+	}
+
+	sq = ring->sq_ring;
+	ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = cq + params.cq_off.cqes;
+
+	return 0;
+}
+
+/*
+ * Submits a vectored write of count slices at offset. The slices and the
+ * memory they point to must stay valid until the completion for id has been
+ * returned by pcips_uring_wait(). The caller must not have more requests in
+ * flight than the ring was created for.
+ */
+int
+pcips_uring_writev(struct pcips_uring *ring, int fd, const struct iovec *iov,
+	int count, long offset, unsigned long id)
+{
+	unsigned tail, index;
+	struct io_uring_sqe *sqe;
+
+	tail = *ring->sq_tail;
+	index = tail & *ring->sq_mask;
+
+	sqe = (struct io_uring_sqe *) ring->sqes + index;
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (unsigned long) iov;
+	sqe->len = count;
+	sqe->user_data = id;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	while (uring_enter(ring->fd, 1, 0, 0) < 0)
+	{
+		if (errno != EINTR)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Waits for the next completion, storing the id it was submitted with and
+ * its result: the number of bytes written, or a negated errno value.
+ */
+int
+pcips_uring_wait(struct pcips_uring *ring, unsigned long *id, long *res)
+{
+	unsigned head;
+	struct io_uring_cqe *cqe;
+
+	for (;;)
+	{
+		head = *ring->cq_head;
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			cqe = (struct io_uring_cqe *) ring->cqes
+				+ (head & *ring->cq_mask);
+			*id = cqe->user_data;
+			*res = cqe->res;
+
+			__atomic_store_n(ring->cq_head, head + 1,
+				__ATOMIC_RELEASE);
+			return 0;
+		}
+
+		if (uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0
+			&& errno != EINTR)
+			return -1;
+	}
+}
+
+void
+pcips_uring_exit(struct pcips_uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+
+	if (ring->cq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+
+	close(ring->fd);
+}
+#else
+int
+pcips_uring_init(struct pcips_uring *ring, unsigned entries)
+{
+	(void) ring;
+	(void) entries;
+
+	return -1;
+}
+
+int
+pcips_uring_writev(struct pcips_uring *ring, int fd, const struct iovec *iov,
+	int count, long offset, unsigned long id)
+{
+	(void) ring;
+	(void) fd;
+	(void) iov;
+	(void) count;
+	(void) offset;
+	(void) id;
+
+	return -1;
+}
+
+int
+pcips_uring_wait(struct pcips_uring *ring, unsigned long *id, long *res)
+{
+	(void) ring;
+	(void) id;
+	(void) res;
+
+	return -1;
+}
+
+void
+pcips_uring_exit(struct pcips_uring *ring)
+{
+	(void) ring;
+}
+#endif
@@ -0,0 +1,106 @@
+#!/bin/sh
+#
+# Applies sparse, dense, RLE and growing patches without -Q and with queue
+# depths of 1, 4 and 64, both to another file and in place, and checks that
+# every output matches the modified file byte for byte.
+#
+# usage: tests/uring.sh [pcips]
+
+pcips=${1:-./pcips}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' 0
+fail=0
+
+# writes $2 KiB of random bytes to $1
+random()
+{
+	dd if=/dev/urandom of="$1" bs=1024 count="$2" 2>/dev/null
+}
+
+# writes $1 copies of the byte with octal code $2 into $4 at offset $3
+run()
+{
+	dd if=/dev/zero bs="$1" count=1 2>/dev/null | tr '\000' "\\$2" \
+		| dd of="$4" bs=1 seek="$3" conv=notrunc 2>/dev/null
+}
+
+# copies $1 bytes of random data into $2 at offset $3
+poke()
+{
+	dd if=/dev/urandom bs="$1" count=1 2>/dev/null \
+		| dd of="$2" bs=1 seek="$3" conv=notrunc 2>/dev/null
+}
+
+check()
+{
+	name=$1
+	"$pcips" -c "$dir/$name.ips" "$dir/$name.src" "$dir/$name.mod" || {
+		echo "$name: cannot create patch"
+		fail=1
+		return
+	}
+
+	for depth in "" 1 4 64
+	do
+		opts=${depth:+-Q $depth}
+
+		# a larger file is left in the output to show it is emptied
+		cp "$dir/big" "$dir/out"
+		if ! "$pcips" $opts -a "$dir/$name.ips" "$dir/$name.src" \
+				"$dir/out" || ! cmp -s "$dir/out" "$dir/$name.mod"
+		then
+			echo "$name: output differs with ${opts:-no -Q}"
+			fail=1
+		fi
+
+		cp "$dir/$name.src" "$dir/out"
+		if ! "$pcips" $opts -ia "$dir/$name.ips" "$dir/out" \
+				|| ! cmp -s "$dir/out" "$dir/$name.mod"
+		then
+			echo "$name: in place output differs with ${opts:-no -Q}"
+			fail=1
+		fi
+	done
+}
+
+random "$dir/base" 1024
+random "$dir/big" 2048
+
+# a few scattered changes
+cp "$dir/base" "$dir/sparse.src"
+cp "$dir/base" "$dir/sparse.mod"
+for off in 0 4099 65536 300001 777777 1048570
+do
+	poke 6 "$dir/sparse.mod" $off
+done
+check sparse
+
+# a quarter of all bytes changed
+cp "$dir/base" "$dir/dense.src"
+tr '\000-\077' '\100-\177' <"$dir/base" >"$dir/dense.mod"
+check dense
+
+# runs of one byte
+cp "$dir/base" "$dir/rle.src"
+cp "$dir/base" "$dir/rle.mod"
+run 5000 101 1000 "$dir/rle.mod"
+run 70000 000 300000 "$dir/rle.mod"
+run 40 377 1048500 "$dir/rle.mod"
+check rle
+
+# data and runs past the end of the source
+cp "$dir/base" "$dir/grow.src"
+cp "$dir/base" "$dir/grow.mod"
+poke 3 "$dir/grow.mod" 500000
+random "$dir/tail" 300
+cat "$dir/tail" >>"$dir/grow.mod"
+run 20000 102 $((1024 * 1024 + 300 * 1024)) "$dir/grow.mod"
+check grow
+
+# an empty source
+: >"$dir/empty.src"
+random "$dir/empty.mod" 100
+check empty
+
+[ $fail = 0 ] && echo "$pcips: all outputs match"
+exit $fail